@@ -99,6 +99,24 @@ uint64_t now_micros_coarse() {
   return t;
 }
 
+uint64_t thread_cpu_micros() {
+  uint64_t t;
+
+  /* independent of PRELOAD_USE_CLOCK_GETTIME, which only picks the wall
+   * clock: there is no other way to get a thread's cpu time */
+#if defined(CLOCK_THREAD_CPUTIME_ID)
+  struct timespec tp;
+
+  clock_gettime(CLOCK_THREAD_CPUTIME_ID, &tp);
+  t = static_cast<uint64_t>(tp.tv_sec) * 1000000;
+  t += tp.tv_nsec / 1000;
+#else
+  t = now_micros();
+#endif
+
+  return t;
+}
+
 void check_clockres() {
   int n;
 #if defined(__linux) && defined(PRELOAD_USE_CLOCK_GETTIME)
@@ -69,6 +69,10 @@ uint64_t now_micros();
 /* get the current time in us with fast but coarse-grained timestamps. */
 uint64_t now_micros_coarse();
 
+/* get the cpu time (in us) used by the calling thread. falls back to wall
+ * time on systems without CLOCK_THREAD_CPUTIME_ID. */
+uint64_t thread_cpu_micros();
+
 /* convert posix timeval to micros */
 uint64_t timeval_to_micros(const struct timeval* tv);
 
@@ -113,6 +117,19 @@ inline int getr(int min, int max) {
       min);
 }
 
+/* fast_rand: a per-thread xorshift64* generator. not for crypto. */
+inline uint64_t fast_rand() {
+  static __thread uint64_t s = 0;
+  if (s == 0) {
+    s = (now_micros() << 16) ^ reinterpret_cast<uintptr_t>(&s) ^ getpid();
+    if (s == 0) s = 1;
+  }
+  s ^= s >> 12;
+  s ^= s << 25;
+  s ^= s >> 27;
+  return s * 2685821657736338717ULL;
+}
+
 inline int pthread_cv_notifyall(pthread_cond_t* cv) {
   int r = pthread_cond_broadcast(cv);
   if (r != 0) {
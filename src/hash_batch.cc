@@ -0,0 +1,204 @@
+/*
+ * Copyright (c) 2019 Carnegie Mellon University,
+ * Copyright (c) 2019 Triad National Security, LLC, as operator of
+ *     Los Alamos National Laboratory.
+ * All rights reserved.
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * with the Software without restriction, including without limitation the
+ * rights to use, copy, modify, merge, publish, distribute, sublicense, and/or
+ * sell copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice,
+ *    this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ *    this list of conditions and the following disclaimer in the documentation
+ *    and/or other materials provided with the distribution.
+ * 3. Neither the name of CMU, TRIAD, Los Alamos National Laboratory, LANL, the
+ *    U.S. Government, nor the names of its contributors may be used to endorse
+ *    or promote products derived from this software without specific prior
+ *    written permission.
+
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS "AS IS" AND ANY EXPRESS OR
+ * IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO
+ * EVENT SHALL THE COPYRIGHT HOLDERS OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT,
+ * INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include "hash_batch.h"
+
+#include <pthread.h>
+#include <string.h>
+#if defined(__x86_64__) && defined(__GNUC__)
+#include <immintrin.h>
+#endif
+
+#include <pdlfs-common/xxhash.h>
+
+namespace {
+#if defined(__x86_64__) && defined(__GNUC__)
+const uint32_t P1 = 2654435761U;
+const uint32_t P2 = 2246822519U;
+const uint32_t P3 = 3266489917U;
+const uint32_t P4 = 668265263U;
+const uint32_t P5 = 374761393U;
+
+typedef uint32_t v8u32_t __attribute__((vector_size(32)));
+
+/*
+ * load8: fill lane j of v with the 4-byte word at offset off of key j. the
+ * key pointers themselves serve as 64-bit gather indices, 4 keys at a time.
+ * xxhash32 reads words in host byte order, which is what we get here.
+ */
+inline __attribute__((target("avx2"))) void load8(v8u32_t* v,
+                                                  const char* const* keys,
+                                                  size_t off) {
+  const int* const base = reinterpret_cast<const int*>(off);
+  __m256i lo = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(keys));
+  __m256i hi = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(keys + 4));
+  __m128i a = _mm256_i64gather_epi32(base, lo, 1);
+  __m128i b = _mm256_i64gather_epi32(base, hi, 1);
+  *v = reinterpret_cast<v8u32_t>(
+      _mm256_inserti128_si256(_mm256_castsi128_si256(a), b, 1));
+}
+
+/*
+ * xxh32_lanes8: xxhash32 on 8 keys at once, one key per vector lane.
+ */
+inline __attribute__((target("avx2"))) void xxh32_lanes8(
+    const char* const* keys, size_t len, uint32_t seed, uint32_t* out) {
+  v8u32_t v1, v2, v3, v4, h, w;
+  size_t off;
+  int j;
+
+#define XXH_ROTL(x, r) (((x) << (r)) | ((x) >> (32 - (r))))
+#define XXH_SPLAT(v, x) \
+  for (j = 0; j < 8; j++) v[j] = (x)
+
+  off = 0;
+  if (len >= 16) {
+    XXH_SPLAT(v1, seed + P1 + P2);
+    XXH_SPLAT(v2, seed + P2);
+    XXH_SPLAT(v3, seed);
+    XXH_SPLAT(v4, seed - P1);
+    for (; off + 16 <= len; off += 16) {
+      load8(&w, keys, off);
+      v1 += w * P2;
+      v1 = XXH_ROTL(v1, 13) * P1;
+      load8(&w, keys, off + 4);
+      v2 += w * P2;
+      v2 = XXH_ROTL(v2, 13) * P1;
+      load8(&w, keys, off + 8);
+      v3 += w * P2;
+      v3 = XXH_ROTL(v3, 13) * P1;
+      load8(&w, keys, off + 12);
+      v4 += w * P2;
+      v4 = XXH_ROTL(v4, 13) * P1;
+    }
+    h = XXH_ROTL(v1, 1) + XXH_ROTL(v2, 7) + XXH_ROTL(v3, 12) +
+        XXH_ROTL(v4, 18);
+  } else {
+    XXH_SPLAT(h, seed + P5);
+  }
+  h += static_cast<uint32_t>(len);
+  for (; off + 4 <= len; off += 4) {
+    load8(&w, keys, off);
+    h += w * P3;
+    h = XXH_ROTL(h, 17) * P4;
+  }
+  /* a word load here could read past the end of a key */
+  for (; off < len; off++) {
+    for (j = 0; j < 8; j++) w[j] = static_cast<unsigned char>(keys[j][off]);
+    h += w * P5;
+    h = XXH_ROTL(h, 11) * P1;
+  }
+  h ^= h >> 15;
+  h *= P2;
+  h ^= h >> 13;
+  h *= P3;
+  h ^= h >> 16;
+  for (j = 0; j < 8; j++) out[j] = h[j];
+
+#undef XXH_SPLAT
+#undef XXH_ROTL
+}
+
+__attribute__((target("avx2"))) void xxhash32_batch_avx2(
+    const char* const* keys, size_t n, size_t len, uint32_t seed,
+    uint32_t* out) {
+  size_t i;
+  for (i = 0; i + 8 <= n; i += 8) {
+    xxh32_lanes8(keys + i, len, seed, out + i);
+  }
+  xxhash32_batch_scalar(keys + i, n - i, len, seed, out + i);
+}
+#endif
+
+pthread_once_t batch_once = PTHREAD_ONCE_INIT;
+xxhash32_batch_fn batch_fn = xxhash32_batch_scalar;
+const char* batch_name = "scalar";
+
+/* batch_ok: check a batch function against pdlfs::xxhash32 across all the
+ * code paths of the hash (short keys, stripes, and tails) */
+int batch_ok(xxhash32_batch_fn fn) {
+  char buf[64 + 16];
+  const char* keys[16];
+  uint32_t out[16];
+  size_t len;
+  int i;
+
+  for (i = 0; i < int(sizeof(buf)); i++) buf[i] = char(i * 37 + 11);
+  for (i = 0; i < 16; i++) keys[i] = buf + i;
+  for (len = 1; len <= 64; len++) {
+    fn(keys, 16, len, 0, out);
+    for (i = 0; i < 16; i++) {
+      if (out[i] != pdlfs::xxhash32(keys[i], len, 0)) return 0;
+    }
+  }
+  return 1;
+}
+
+void batch_init() {
+#if defined(__x86_64__) && defined(__GNUC__)
+  __builtin_cpu_init();
+  /* w/o gathers, filling vector lanes one word at a time costs more than
+   * what we save by hashing 4 keys at once, so there is no sse4.2 path */
+  if (__builtin_cpu_supports("avx2") && batch_ok(xxhash32_batch_avx2)) {
+    batch_fn = xxhash32_batch_avx2;
+    batch_name = "avx2";
+  }
+#endif
+}
+}  // namespace
+
+void xxhash32_batch_scalar(const char* const* keys, size_t n, size_t len,
+                           uint32_t seed, uint32_t* out) {
+  for (size_t i = 0; i < n; i++) {
+    out[i] = pdlfs::xxhash32(keys[i], len, seed);
+  }
+}
+
+void xxhash32_batch(const char* const* keys, size_t n, size_t len,
+                    uint32_t seed, uint32_t* out) {
+  pthread_once(&batch_once, batch_init);
+  /* trailing bytes are hashed one lane at a time, which is slower than
+   * doing them one key at a time */
+  if ((len & 3) != 0) {
+    xxhash32_batch_scalar(keys, n, len, seed, out);
+  } else {
+    batch_fn(keys, n, len, seed, out);
+  }
+}
+
+const char* xxhash32_batch_impl() {
+  pthread_once(&batch_once, batch_init);
+  return batch_name;
+}
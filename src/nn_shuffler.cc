@@ -44,7 +44,9 @@
 #include "common.h"
 #include "nn_shuffler.h"
 #include "nn_shuffler_internal.h"
+#include "shuffler/shufzip.h"
 
+#include <algorithm>
 #include <vector>
 
 /*
@@ -69,7 +71,8 @@ static const int rpc_cv = 1;
 /* used when waiting for the next available rpc callback slot */
 static const int cb_cv = 2;
 
-/* used when waiting for a busy rpc queue */
+/* used to protect the rpc queue buffer pool and shared queue stats
+ * (each rpc queue has its own lock for waiting on a busy queue) */
 static const int qu_cv = 3;
 
 /* used when waiting for work items */
@@ -91,15 +94,54 @@ static size_t items_completed = 0;
 /* rpc queue */
 static std::vector<int> rpcq_order; /* flush order */
 typedef struct rpcq {
-  uint32_t sz; /* aggregated size of all pending writes */
-  int lepo;    /* epoch number for the last write */
-  int busy;    /* non-zero when queue is locked and is being flushed */
-  char* buf;   /* heap-allocated memory for the queue */
+  pthread_mutex_t mtx; /* protects the fields below */
+  pthread_cond_t cv;   /* used when waiting for the queue to be not busy */
+  uint32_t sz;  /* aggregated size of all pending writes */
+  uint32_t lim; /* flush the queue once it would grow past this size */
+  uint32_t cap; /* size of buf (may lag behind lim in adaptive mode) */
+  uint64_t rtt; /* smoothed rpc round-trip time in us (adaptive mode) */
+  uint64_t lru; /* time of the last write (coarse, in us) */
+  int lepo;     /* epoch number for the last write */
+  int busy;     /* non-zero when writers must wait (no buffer to fill) */
+  int inflight; /* non-zero when a flush of the queue is being sent */
+  int hidx;     /* position in qholders (locked by mtx[qu_cv]) */
+  char* buf;    /* heap-allocated memory for the queue (NULL until used) */
+  char* spare;  /* 2nd buffer (cap bytes) to fill while buf is sent */
 } rpcq_t;
 static rpcq_t* rpcqs = NULL;
-static size_t max_rpcq_sz = 0; /* buffer size per rpc queue */
+static size_t max_rpcq_sz = 0; /* max buffer size per rpc queue */
 static int nrpcqs = 0;         /* number of queues */
 
+/* queue buffers are allocated when a queue is first used and come from a
+ * shared pool bounded by rpcq_budget. when the pool is dry we flush and
+ * take the buffer of the least recently used (or the fullest) queue.
+ * idle buffers go back to the pool at the end of each epoch. locked by
+ * mtx[qu_cv]. lock order: a queue's lock may be held when taking
+ * mtx[qu_cv], never the other way around, and no thread holds more
+ * than one queue lock at a time. */
+static std::vector<char*> qbufs; /* free queue buffers (qbuf_sz each) */
+static std::vector<int> qholders; /* queues that currently hold a buffer */
+static size_t qbuf_sz = 0;        /* size of a fresh queue buffer */
+static size_t qbuf_inuse = 0;     /* total size of buffers held by queues */
+
+/* adaptive rpc batching (SHUFFLE_Adaptive_rpc). queue lims and the
+ * outstanding rpc window follow rpc round-trip times: they grow while
+ * rtts stay close to the best rtt we have seen and shrink when rtts or
+ * our own incoming rpc backlog say we are congested. queue buffers
+ * follow their lims within rpcq_budget. locked by mtx[qu_cv] (lims and
+ * rtts are locked by their queue). */
+static size_t rpcq_mem = 0;    /* total size of all queue buffers */
+static size_t rpcq_budget = 0; /* max total size of all queue buffers */
+static uint32_t min_rpcq_sz = 0; /* queue lims never go below this */
+static uint64_t base_rtt = 0;    /* best recent rpc rtt in us */
+static int rtt_samples = 0;
+static int iq_last = 0; /* size of last incoming rpc batch (atomic) */
+static int iq_left = 0; /* rpcs left in the current batch (atomic) */
+#define ADAPT_MIN_BUFFER 512 /* min queue lim */
+#define ADAPT_RTT_AGING 256  /* age base_rtt every this many rpcs */
+/* free rpc compression buffers (max_rpcq_sz each), locked by mtx[qu_cv] */
+static std::vector<char*> zbufs;
+
 /* rpc callback slots */
 #define MAX_OUTSTANDING_RPC 128 /* hard limit */
 static hg_handle_t hg_hdls[MAX_OUTSTANDING_RPC] = {0};
@@ -107,6 +149,8 @@ static write_async_cb_t cb_slots[MAX_OUTSTANDING_RPC] = {0};
 static int cb_flags[MAX_OUTSTANDING_RPC] = {0};
 static int cb_allowed = 1; /* soft limit */
 static int cb_left = 1;
+static int max_cb_allowed = 1; /* upper bound for cb_allowed (adaptive) */
+static int cb_acks = 0;        /* replies since cb_allowed last changed */
 
 /* per-thread rusage */
 typedef struct rpcu {
@@ -195,6 +239,157 @@ void rpc_explain_timeout() {
           mssg_get_addr_str(nnctx.mssg, mssg_get_rank(nnctx.mssg)),
           int(pctx.mctx.nms), int(pctx.mctx.nmd), int(pctx.mctx.nmr));
 }
+
+/* rpcq_limit: max number of bytes a queue may hold before it is flushed.
+ * caller must hold the queue's lock. */
+inline uint32_t rpcq_limit(const rpcq_t* rpcq) {
+  return rpcq->lim < rpcq->cap ? rpcq->lim : rpcq->cap;
+}
+
+/* qbuf_get: get a buffer of sz bytes for a queue, from the pool if we
+ * can. returns NULL if that would take us over the budget. caller must
+ * hold mtx[qu_cv]. */
+char* qbuf_get(size_t sz) {
+  char* buf;
+
+  if (sz == qbuf_sz && !qbufs.empty()) {
+    buf = qbufs.back();
+    qbufs.pop_back();
+  } else {
+    /* free idle pool buffers if we need the room for an odd size */
+    while (rpcq_mem + sz > rpcq_budget && !qbufs.empty()) {
+      free(qbufs.back());
+      qbufs.pop_back();
+      rpcq_mem -= qbuf_sz;
+    }
+    if (rpcq_mem + sz > rpcq_budget) {
+      return NULL;
+    }
+    buf = static_cast<char*>(malloc(sz));
+    if (buf == NULL) {
+      ABORT("malloc");
+    }
+    rpcq_mem += sz;
+  }
+
+  qbuf_inuse += sz;
+  if (qbuf_inuse > pctx.mctx.max_nqm) {
+    pctx.mctx.max_nqm = pctx.mctx.nqm = qbuf_inuse;
+  }
+  return buf;
+}
+
+/* qbuf_put: give a buffer of sz bytes back. caller must hold
+ * mtx[qu_cv]. */
+void qbuf_put(char* buf, size_t sz) {
+  qbuf_inuse -= sz;
+  if (sz == qbuf_sz) {
+    qbufs.push_back(buf);
+  } else { /* resized by adaptive rpc */
+    free(buf);
+    rpcq_mem -= sz;
+  }
+}
+
+/* rpcq_resize: bring the buffers of an empty queue in line with its
+ * lim. buffers grow in big steps to avoid frequent mallocs, and only if
+ * the budget allows. caller must hold the queue's lock. */
+void rpcq_resize(rpcq_t* rpcq) {
+  uint32_t newcap;
+  char* buf;
+
+  if (rpcq->buf == NULL || rpcq->sz != 0 || rpcq->inflight != 0) {
+    return;
+  } else if (rpcq->lim > rpcq->cap) {
+    newcap = 2 * rpcq->cap;
+    if (newcap < rpcq->lim) newcap = rpcq->lim;
+    if (newcap > max_rpcq_sz) newcap = max_rpcq_sz;
+  } else if (rpcq->lim <= rpcq->cap / 2) {
+    newcap = rpcq->lim;
+  } else {
+    return;
+  }
+
+  pthread_mtx_lock(&mtx[qu_cv]);
+  if (rpcq->spare != NULL) { /* will get another one on the next flush */
+    qbuf_put(rpcq->spare, rpcq->cap);
+    rpcq->spare = NULL;
+  }
+  buf = qbuf_get(newcap);
+  if (buf != NULL) {
+    qbuf_put(rpcq->buf, rpcq->cap);
+    rpcq->buf = buf;
+    rpcq->cap = newcap;
+  }
+  pthread_mtx_unlock(&mtx[qu_cv]);
+}
+
+/* adapt_rpcq: feed the rtt of an rpc sent to a peer into that peer's
+ * queue lim. the lim grows while full batches go out and come back
+ * quickly, and shrinks when rtts get much worse than the best one we
+ * have seen or our own rpc worker is backlogged. returns non-zero if
+ * we look congested. */
+int adapt_rpcq(int peer, uint32_t sz, uint64_t rtt) {
+  rpcq_t* rpcq;
+  uint64_t base;
+  int congested;
+
+  pthread_mtx_lock(&mtx[qu_cv]);
+  if (base_rtt == 0 || rtt < base_rtt) {
+    base_rtt = rtt;
+    rtt_samples = 0;
+  } else if (++rtt_samples >= ADAPT_RTT_AGING) {
+    /* let it drift up in case the network has become slower for good */
+    base_rtt += base_rtt / 8 + 1;
+    rtt_samples = 0;
+  }
+  base = base_rtt;
+  pthread_mtx_unlock(&mtx[qu_cv]);
+
+  assert(peer >= 0 && peer < nrpcqs);
+  rpcq = &rpcqs[peer];
+  pthread_mtx_lock(&rpcq->mtx);
+  rpcq->rtt = (rpcq->rtt == 0) ? rtt : (7 * rpcq->rtt + rtt) / 8;
+  congested = rpcq->rtt > 4 * base ||
+              __sync_fetch_and_add(&iq_last, 0) >= MAX_WORK_ITEM / 2;
+  if (congested) {
+    rpcq->lim -= rpcq->lim / 4;
+    if (rpcq->lim < min_rpcq_sz) {
+      rpcq->lim = min_rpcq_sz;
+    }
+  } else if (rpcq->rtt <= 2 * base && sz + 256 > rpcq_limit(rpcq)) {
+    rpcq->lim += rpcq->lim / 8;
+    if (rpcq->lim > max_rpcq_sz) {
+      rpcq->lim = max_rpcq_sz;
+    }
+  }
+  pthread_mtx_unlock(&rpcq->mtx);
+
+  return congested;
+}
+
+/* adapt_window: aimd on the outstanding rpc window, evaluated once per
+ * window worth of replies. caller must hold mtx[cb_cv]. */
+void adapt_window(int congested) {
+  int delta;
+
+  if (++cb_acks < cb_allowed) {
+    return;
+  }
+  cb_acks = 0;
+  if (congested) {
+    delta = -(cb_allowed / 2);
+  } else if (cb_allowed < max_cb_allowed) {
+    delta = 1;
+  } else {
+    delta = 0;
+  }
+  cb_allowed += delta;
+  cb_left += delta;
+  if (delta > 0) {
+    pthread_cv_notifyall(&cv[cb_cv]);
+  }
+}
 }  // namespace
 
 /* rpc_work(): dedicated thread function to process rpc. each work item
@@ -250,8 +445,11 @@ static void* rpc_work(void* arg) {
       if (!todo.empty()) {
         num_items = todo.size();
         hstg_add(nnctx.iq_dep, num_items);
+        __sync_lock_test_and_set(&iq_last, num_items);
         for (it = todo.begin(); it != todo.end(); ++it) {
           h = static_cast<hg_handle_t>(*it);
+          __sync_lock_test_and_set(&iq_left,
+                                   static_cast<int>(todo.end() - it) - 1);
           if (h != NULL) {
             hret = nn_shuffler_write_rpc_handler(h, &info);
             if (hret != HG_SUCCESS) {
@@ -367,6 +565,42 @@ void nn_shuffler_debug(int src, int dst, int me, int hp) {
             mssg_get_addr_str(nnctx.mssg, hp));
   }
 }
+
+/* nn_shuffler_verify: check that a batch of incoming writes was meant for us,
+ * or was redirected to us by the receiver we are the overflow partner of.
+ * noop unless paranoid checks are on. range pivots may change between epochs
+ * and w/ epoch markers a peer may send us writes of the next epoch before we
+ * have updated ours, so we skip the check under range placement. */
+void nn_shuffler_verify(char* const* reqs, int n, int src, int dst) {
+  int targets[MAX_HANDLE_BATCH];
+  int rank;
+  int i;
+
+  if (!nnctx.paranoid_checks || nnctx.shctx->range) return;
+  assert(n <= MAX_HANDLE_BATCH);
+  rank = mssg_get_rank(nnctx.mssg);
+  shuffle_target_batch(nnctx.shctx, reqs, n, targets);
+  for (i = 0; i < n; i++) {
+    if (targets[i] != rank &&
+        shuffle_overflow_partner(nnctx.shctx, targets[i]) != rank) {
+      nn_shuffler_debug(src, dst, rank, targets[i]);
+      ABORT("rpc msg misdirected");
+    }
+  }
+}
+}  // namespace
+
+namespace {
+/* rpc_backlog: return the num of incoming rpcs waiting to be handled. only
+ * known when rpcs are handled by a separate worker thread. */
+unsigned int rpc_backlog() {
+  size_t n;
+  if (num_wk == 0) return 0;
+  pthread_mtx_lock(&mtx[wk_cv]);
+  n = wk_items.size();
+  pthread_mtx_unlock(&mtx[wk_cv]);
+  return static_cast<unsigned int>(n + __sync_fetch_and_add(&iq_left, 0));
+}
 }  // namespace
 
 /* nn_shuffler_write_rpc_handler: server-side rpc handler */
@@ -375,6 +609,12 @@ hg_return_t nn_shuffler_write_rpc_handler(hg_handle_t h, write_info_t* info) {
    * this thread is either a dedicated mercury progressing thread, or a separate
    * rpc worker thread. */
   static char buf[MAX_RPC_MESSAGE];
+  static char zbuf[MAX_RPC_MESSAGE]; /* compressed msgs are received here */
+  /* decoded writes handed to the upper layer in batches */
+  static char* reqs[MAX_HANDLE_BATCH];
+  static int srcs[MAX_HANDLE_BATCH];
+  unsigned int batch_sz;
+  int nreqs;
 
   char* input;
   uint32_t input_left;
@@ -387,15 +627,17 @@ hg_return_t nn_shuffler_write_rpc_handler(hg_handle_t h, write_info_t* info) {
   int epoch;
   int src;
   int dst;
-  int target_rank;
   int rank;
   int rv;
+  uint64_t t0;
 
   assert(nnctx.mssg != NULL);
   rank = mssg_get_rank(nnctx.mssg);
 
   write_in.msg = buf;
   write_in.sz = 0;
+  write_in.zmsg = zbuf;
+  write_in.zsz = 0;
 
   hret = HG_Get_input(h, &write_in);
   if (hret != HG_SUCCESS) {
@@ -403,6 +645,15 @@ hg_return_t nn_shuffler_write_rpc_handler(hg_handle_t h, write_info_t* info) {
   }
 
   shuffle_msg_received();
+  if (write_in.zsz != 0) {
+    t0 = thread_cpu_micros();
+    rv = shufzip_decompress(zbuf, write_in.zsz, buf, MAX_RPC_MESSAGE);
+    if (rv < 0 || static_cast<uint32_t>(rv) != write_in.sz) {
+      ABORT("rpc msg corrupted (bad compressed payload)");
+    }
+    t0 = thread_cpu_micros() - t0;
+    __sync_fetch_and_add(&pctx.mctx.zdu, t0);
+  }
   if (write_in.hash_sig != nn_shuffler_maybe_hashsig(&write_in)) {
     ABORT("rpc msg corrupted (hash_sig mismatch)");
   }
@@ -421,11 +672,15 @@ hg_return_t nn_shuffler_write_rpc_handler(hg_handle_t h, write_info_t* info) {
     }
   }
   write_out.rv = 0;
+  write_out.backlog = 0;
   input_left = write_info.sz = write_in.sz;
   epoch = write_in.epo;
   write_info.num_writes = 0;
   input = buf;
 
+  batch_sz = 0;
+  nreqs = 0;
+
   /* decode and execute writes */
   while (input_left != 0) {
     if (input_left < 1) {
@@ -441,24 +696,40 @@ hg_return_t nn_shuffler_write_rpc_handler(hg_handle_t h, write_info_t* info) {
     input_left -= req_sz;
     input += req_sz;
 
-    if (nnctx.paranoid_checks) {
-      target_rank = shuffle_target(nnctx.shctx, req, req_sz);
-      if (rank != target_rank) {
-        nn_shuffler_debug(src, dst, rank, target_rank);
-        ABORT("rpc msg misdirected");
+    if (nreqs == MAX_HANDLE_BATCH || (nreqs != 0 && req_sz != batch_sz)) {
+      nn_shuffler_verify(reqs, nreqs, src, dst);
+      rv = shuffle_handle_batch(nnctx.shctx, reqs, nreqs, batch_sz, epoch,
+                                srcs, dst);
+      write_info.num_writes += nreqs;
+      nreqs = 0;
+      if (write_out.rv == 0) {
+        write_out.rv = rv;
+      }
+      if (rv != 0) {
+        break;
       }
     }
 
-    rv = shuffle_handle(nnctx.shctx, req, req_sz, epoch, src, dst);
-    write_info.num_writes++;
-    if (write_out.rv == 0) {
-      write_out.rv = rv;
-    }
-    if (rv != 0) {
-      break;
-    }
+    batch_sz = req_sz;
+    srcs[nreqs] = src;
+    reqs[nreqs] = req;
+    nreqs++;
+  }
+
+  if (nreqs != 0 && write_out.rv == 0) {
+    nn_shuffler_verify(reqs, nreqs, src, dst);
+    rv = shuffle_handle_batch(nnctx.shctx, reqs, nreqs, batch_sz, epoch, srcs,
+                              dst);
+    write_info.num_writes += nreqs;
+    write_out.rv = rv;
+  }
+
+  if (write_in.mark != 0 && write_out.rv == 0) {
+    shuffle_epoch_marker(nnctx.shctx, src, epoch, write_in.mark - 1);
   }
 
+  /* tell the sender how far behind we are */
+  write_out.backlog = rpc_backlog();
   hret = HG_Respond(h, NULL, NULL, &write_out);
   if (hret != HG_SUCCESS) {
     RPC_FAILED("HG_Respond", hret);
@@ -483,6 +754,7 @@ hg_return_t nn_shuffler_write_async_handler(const struct hg_cb_info* info) {
   int cache;
   write_async_cb_t* write_cb;
   write_out_t write_out;
+  int congested;
   int rv;
 
   assert(info->type == HG_CB_FORWARD);
@@ -499,20 +771,29 @@ hg_return_t nn_shuffler_write_async_handler(const struct hg_cb_info* info) {
     RPC_FAILED("HG_Get_output", hret);
   } else {
     rv = write_out.rv;
+    shuffle_backlog(nnctx.shctx, write_cb->peer, write_out.backlog);
   }
 
   HG_Free_output(h, &write_out);
   shuffle_msg_replied(write_cb->arg1, write_cb->arg2);
+  congested = 0;
+  if (nnctx.adaptive_rpc) {
+    congested = adapt_rpcq(write_cb->peer, write_cb->sz,
+                           now_micros() - write_cb->t0);
+  }
 
   /* return rpc callback slot */
   pthread_mtx_lock(&mtx[cb_cv]);
   cache = nnctx.cache_hlds && (h == hg_hdls[write_cb->slot]);
   cb_flags[write_cb->slot] = 0;
   assert(cb_left < cb_allowed);
-  if (cb_left == 0 || cb_left == cb_allowed - 1) {
+  if (cb_left <= 0 || cb_left == cb_allowed - 1) {
     pthread_cv_notifyall(&cv[cb_cv]);
   }
   cb_left++;
+  if (nnctx.adaptive_rpc) {
+    adapt_window(congested);
+  }
   pthread_mtx_unlock(&mtx[cb_cv]);
   if (!cache) {
     HG_Destroy(h);
@@ -538,6 +819,7 @@ int nn_shuffler_write_send_async(write_in_t* write_in, int peer_rank,
   time_t now;
   struct timespec abstime;
   useconds_t delay;
+  uint64_t t0;
   int slot;
   int rank;
   int e;
@@ -560,7 +842,8 @@ int nn_shuffler_write_send_async(write_in_t* write_in, int peer_rank,
 
   /* wait for slot */
   pthread_mtx_lock(&mtx[cb_cv]);
-  while (cb_left == 0) { /* no slots available */
+  t0 = (cb_left <= 0) ? now_micros() : 0;
+  while (cb_left <= 0) { /* no slots available */
     if (pctx.testin) {
       pthread_mtx_unlock(&mtx[cb_cv]);
       if (pctx.trace != NULL) {
@@ -582,12 +865,16 @@ int nn_shuffler_write_send_async(write_in_t* write_in, int peer_rank,
       }
     }
   }
-  for (slot = 0; slot < cb_allowed; slot++) {
+  if (t0 != 0) {
+    hstg_add(nnctx.cb_wait, now_micros() - t0);
+  }
+  /* cb_allowed may have shrunk while high slots are still in use */
+  for (slot = 0; slot < MAX_OUTSTANDING_RPC; slot++) {
     if (cb_flags[slot] == 0) {
       break;
     }
   }
-  assert(slot < cb_allowed);
+  assert(slot < MAX_OUTSTANDING_RPC);
   write_cb = &cb_slots[slot];
   cb_flags[slot] = 1;
   assert(cb_left > 0);
@@ -619,6 +906,9 @@ int nn_shuffler_write_send_async(write_in_t* write_in, int peer_rank,
   write_cb->slot = slot;
   write_cb->arg1 = arg1;
   write_cb->arg2 = arg2;
+  write_cb->peer = peer_rank;
+  write_cb->sz = write_in->sz;
+  write_cb->t0 = nnctx.adaptive_rpc ? now_micros() : 0;
 
   hret = HG_Forward(h, nn_shuffler_write_async_handler, write_cb, write_in);
 
@@ -771,6 +1061,7 @@ int nn_shuffler_write_send(write_in_t* write_in, int peer_rank) {
     RPC_FAILED("HG_Get_output", hret);
   } else {
     rv = write_out.rv;
+    shuffle_backlog(nnctx.shctx, peer_rank, write_out.backlog);
   }
 
   HG_Free_output(h, &write_out);
@@ -779,49 +1070,156 @@ int nn_shuffler_write_send(write_in_t* write_in, int peer_rank) {
   return rv;
 }
 
-/* nn_shuffler_enqueue:
- *   encode a req and append it into a corresponding rpc queue */
-void nn_shuffler_enqueue(char* req, unsigned char req_sz, int epoch,
-                         int peer_rank, int rank) {
+namespace {
+/* zbuf_get: get a compression buffer, or NULL if compression is off. */
+char* zbuf_get() {
+  char* zbuf;
+  if (!nnctx.compress) {
+    return NULL;
+  }
+  pthread_mtx_lock(&mtx[qu_cv]);
+  if (zbufs.empty()) {
+    zbuf = NULL;
+  } else {
+    zbuf = zbufs.back();
+    zbufs.pop_back();
+  }
+  pthread_mtx_unlock(&mtx[qu_cv]);
+  if (zbuf == NULL) {
+    zbuf = static_cast<char*>(malloc(max_rpcq_sz));
+    if (zbuf == NULL) {
+      ABORT("malloc");
+    }
+  }
+  return zbuf;
+}
+
+/* zbuf_put: return a compression buffer and account for the msg it
+ * was used for. */
+void zbuf_put(char* zbuf, const write_in_t* write_in, uint64_t usec) {
+  if (zbuf != NULL) {
+    pthread_mtx_lock(&mtx[qu_cv]);
+    zbufs.push_back(zbuf);
+    pthread_mtx_unlock(&mtx[qu_cv]);
+    __sync_fetch_and_add(&pctx.mctx.zcu, usec);
+    __sync_fetch_and_add(&pctx.mctx.zrb, write_in->sz);
+    __sync_fetch_and_add(&pctx.mctx.zcb,
+                         (write_in->zsz != 0) ? write_in->zsz : write_in->sz);
+  }
+}
+
+/* maybe_compress: compress an outgoing msg into zbuf (if not NULL).
+ * the msg goes out as is if compression doesn't make it smaller.
+ * returns the cpu time spent compressing. */
+uint64_t maybe_compress(write_in_t* write_in, char* zbuf) {
+  uint64_t t0;
+  int n;
+
+  write_in->zsz = 0;
+  write_in->zmsg = NULL;
+  if (zbuf == NULL) {
+    return 0;
+  }
+
+  t0 = thread_cpu_micros();
+  n = shufzip_compress(write_in->msg, write_in->sz, zbuf,
+                       static_cast<int>(write_in->sz) - 1);
+  if (n > 0) {
+    write_in->zsz = n;
+    write_in->zmsg = zbuf;
+  }
+  return thread_cpu_micros() - t0;
+}
+
+/* rpcq_flush: send out the contents of a non-empty queue. caller must
+ * hold the queue's lock and the queue must be neither busy nor in flight.
+ * if the queue has (or can get) a second buffer, writers keep filling that
+ * one while we send. otherwise the queue is busy until we are done. the
+ * lock is dropped while the rpc is sent. */
+void rpcq_flush(int peer_rank) {
   write_in_t write_in;
   rpcq_t* rpcq;
-  int rpcq_idx;
-  time_t now;
-  struct timespec abstime;
-  useconds_t delay;
-  int world_sz;
-  int rv;
+  uint64_t zusec;
+  char* sendbuf;
+  char* zbuf;
   void* arg1;
   void* arg2;
-  int e;
-
-  assert(nnctx.mssg != NULL);
-  assert(rank == mssg_get_rank(nnctx.mssg));
-  world_sz = mssg_get_count(nnctx.mssg);
+  int rv;
 
-  if (nnctx.paranoid_checks) {
-    if (!shuffle_is_rank_receiver(nnctx.shctx, peer_rank)) {
-      ABORT("peer rank is not a receiver");
-    }
-    if (peer_rank < 0 || peer_rank >= world_sz) {
-      ABORT("invalid peer rank");
-    }
+  rpcq = &rpcqs[peer_rank];
+  assert(rpcq->busy == 0 && rpcq->inflight == 0);
+  if (rpcq->sz > MAX_RPC_MESSAGE) {
+    /* happens when the total size of queued data is greater than
+     * the size limit for an rpc message */
+    ABORT("rpc overflow");
   }
+  write_in.dst = peer_rank;
+  write_in.src = mssg_get_rank(nnctx.mssg);
+  write_in.epo = rpcq->lepo;
+  write_in.mark = 0;
+  write_in.sz = rpcq->sz;
+  write_in.msg = sendbuf = rpcq->buf;
+  if (rpcq->spare == NULL) {
+    pthread_mtx_lock(&mtx[qu_cv]);
+    rpcq->spare = qbuf_get(rpcq->cap);
+    pthread_mtx_unlock(&mtx[qu_cv]);
+  }
+  rpcq->inflight = 1;
+  if (rpcq->spare != NULL) { /* writers go on with the other buffer */
+    rpcq->buf = rpcq->spare;
+    rpcq->spare = NULL;
+    rpcq->sz = 0;
+  } else {
+    rpcq->busy = 1; /* force other writers to block */
+  }
+  /* unlock when sending the rpc */
+  pthread_mtx_unlock(&rpcq->mtx);
+  zbuf = zbuf_get();
+  write_in.hash_sig = nn_shuffler_maybe_hashsig(&write_in);
+  zusec = maybe_compress(&write_in, zbuf);
+  if (!nnctx.force_sync) {
+    shuffle_msg_sent(0, &arg1, &arg2);
+    rv = nn_shuffler_write_send_async(&write_in, peer_rank, arg1, arg2);
+  } else {
+    shuffle_msg_sent(0, &arg1, &arg2);
+    rv = nn_shuffler_write_send(&write_in, peer_rank);
+    shuffle_msg_replied(arg1, arg2);
+  }
+  if (rv != 0) {
+    ABORT("plfsdir peer write failed");
+  }
+  zbuf_put(zbuf, &write_in, zusec);
+  pthread_mtx_lock(&rpcq->mtx);
+  pthread_cv_notifyall(&rpcq->cv);
+  /* the msg has been encoded into the rpc, so its buffer is free now */
+  if (rpcq->busy == 0) {
+    rpcq->spare = sendbuf;
+  } else {
+    rpcq->busy = 0;
+    rpcq->sz = 0;
+  }
+  rpcq->inflight = 0;
+}
 
-  pthread_mtx_lock(&mtx[qu_cv]);
+/* rpcq_wait: wait until a queue is not busy (and not in flight if
+ * "flushing" is set). caller must hold the queue's lock. */
+void rpcq_wait(rpcq_t* rpcq, int flushing) {
+  time_t now;
+  struct timespec abstime;
+  useconds_t delay;
+  uint64_t t0;
+  int e;
 
-  rpcq_idx = peer_rank; /* we have one queue per rank */
-  assert(rpcq_idx < nrpcqs);
-  rpcq = &rpcqs[rpcq_idx];
-  assert(rpcq != NULL);
-  assert(rpcq->buf != NULL);
+  if (rpcq->busy == 0 && (!flushing || rpcq->inflight == 0)) {
+    return;
+  }
 
+  t0 = now_micros();
   delay = 1000; /* 1000 us */
 
-  /* wait for queue */
-  while (rpcq->busy != 0) {
+  while (rpcq->busy != 0 || (flushing && rpcq->inflight != 0)) {
     if (pctx.testin) {
-      pthread_mtx_unlock(&mtx[qu_cv]);
+      pthread_mtx_unlock(&rpcq->mtx);
       if (pctx.trace != NULL) {
         fprintf(pctx.trace, "[ENQUEUE-WAIT] %d us\n", int(delay));
       }
@@ -829,13 +1227,13 @@ void nn_shuffler_enqueue(char* req, unsigned char req_sz, int epoch,
       usleep(delay);
       delay <<= 1;
 
-      pthread_mtx_lock(&mtx[qu_cv]);
+      pthread_mtx_lock(&rpcq->mtx);
     } else {
       now = time(NULL);
       abstime.tv_sec = now + nnctx.timeout;
       abstime.tv_nsec = 0;
 
-      e = pthread_cv_timedwait(&cv[qu_cv], &mtx[qu_cv], &abstime);
+      e = pthread_cv_timedwait(&rpcq->cv, &rpcq->mtx, &abstime);
       if (e == ETIMEDOUT) {
         rpc_explain_timeout();
         ABORT("timeout waiting for rpc queue to flush");
@@ -843,107 +1241,278 @@ void nn_shuffler_enqueue(char* req, unsigned char req_sz, int epoch,
     }
   }
 
-  /* flush queue if full */
-  if (rpcq->sz + req_sz + 1 > max_rpcq_sz) {
-    if (rpcq->sz > MAX_RPC_MESSAGE) {
-      /* happens when the total size of queued data is greater than
-       * the size limit for an rpc message */
-      ABORT("rpc overflow");
+  pthread_mtx_lock(&mtx[qu_cv]);
+  hstg_add(nnctx.qu_wait, now_micros() - t0);
+  pthread_mtx_unlock(&mtx[qu_cv]);
+}
+
+/* qbuf_release: hand the buffers of an idle and empty queue back to the
+ * pool. caller must hold the queue's lock. */
+void qbuf_release(int idx) {
+  rpcq_t* rpcq = &rpcqs[idx];
+  int last;
+
+  assert(rpcq->buf != NULL);
+  assert(rpcq->busy == 0 && rpcq->inflight == 0 && rpcq->sz == 0);
+  pthread_mtx_lock(&mtx[qu_cv]);
+  last = qholders.back();
+  qholders[rpcq->hidx] = last;
+  rpcqs[last].hidx = rpcq->hidx;
+  qholders.pop_back();
+  rpcq->hidx = -1;
+  qbuf_put(rpcq->buf, rpcq->cap);
+  if (rpcq->spare != NULL) {
+    qbuf_put(rpcq->spare, rpcq->cap);
+  }
+  pthread_mtx_unlock(&mtx[qu_cv]);
+  rpcq->buf = rpcq->spare = NULL;
+  rpcq->cap = 0;
+}
+
+/* qbuf_victim: pick a queue to give up its buffers, or -1 if all queues
+ * with a buffer are busy. caller must hold mtx[qu_cv]. we peek at the
+ * queues without their locks, so the caller must recheck the victim
+ * once it has locked it. */
+int qbuf_victim() {
+  const rpcq_t* q;
+  int victim;
+  size_t i;
+
+  victim = -1;
+  for (i = 0; i < qholders.size(); i++) {
+    q = &rpcqs[qholders[i]];
+    if (q->busy != 0 || q->inflight != 0) {
+      continue;
+    } else if (victim == -1) {
+      victim = qholders[i];
+    } else if (nnctx.evict_largest ? q->sz > rpcqs[victim].sz
+                                   : q->lru < rpcqs[victim].lru) {
+      victim = qholders[i];
+    }
+  }
+
+  return victim;
+}
+
+/* qbuf_acquire: give a queue without a buffer one from the pool, flushing
+ * other queues to free up memory if we are at the budget. caller must hold
+ * the queue's lock and must have marked the queue busy. the lock is
+ * dropped while we work. */
+void qbuf_acquire(int idx) {
+  rpcq_t* rpcq;
+  rpcq_t* vq;
+  time_t deadline;
+  char* buf;
+  int evicted;
+  int victim;
+
+  rpcq = &rpcqs[idx];
+  assert(rpcq->buf == NULL && rpcq->busy != 0);
+  pthread_mtx_unlock(&rpcq->mtx);
+  deadline = time(NULL) + nnctx.timeout;
+
+  pthread_mtx_lock(&mtx[qu_cv]);
+  while ((buf = qbuf_get(qbuf_sz)) == NULL) {
+    victim = qbuf_victim();
+    pthread_mtx_unlock(&mtx[qu_cv]);
+    evicted = 0;
+    if (victim == -1) { /* all buffers are being flushed, retry soon */
+      if (!pctx.testin && time(NULL) > deadline) {
+        rpc_explain_timeout();
+        ABORT("timeout waiting for an rpc queue buffer");
+      }
+      usleep(1000);
     } else {
-      rpcq->busy = 1; /* force other writers to block */
-      /* unlock when sending the rpc */
-      pthread_mtx_unlock(&mtx[qu_cv]);
-      write_in.dst = peer_rank;
-      write_in.src = rank;
-      write_in.epo = rpcq->lepo;
-      write_in.sz = rpcq->sz;
-      write_in.msg = rpcq->buf;
-      write_in.hash_sig = nn_shuffler_maybe_hashsig(&write_in);
-      if (!nnctx.force_sync) {
-        shuffle_msg_sent(0, &arg1, &arg2);
-        rv = nn_shuffler_write_send_async(&write_in, peer_rank, arg1, arg2);
-      } else {
-        shuffle_msg_sent(0, &arg1, &arg2);
-        rv = nn_shuffler_write_send(&write_in, peer_rank);
-        shuffle_msg_replied(arg1, arg2);
+      vq = &rpcqs[victim];
+      pthread_mtx_lock(&vq->mtx);
+      if (vq->busy == 0 && vq->inflight == 0 && vq->buf != NULL &&
+          vq->sz != 0) {
+        rpcq_flush(victim);
+        evicted = 1;
       }
-      if (rv != 0) {
-        ABORT("plfsdir peer write failed");
+      if (vq->busy == 0 && vq->inflight == 0 && vq->buf != NULL &&
+          vq->sz == 0) {
+        qbuf_release(victim);
       }
-      pthread_mtx_lock(&mtx[qu_cv]);
-      pthread_cv_notifyall(&cv[qu_cv]);
+      pthread_mtx_unlock(&vq->mtx);
+    }
+    pthread_mtx_lock(&mtx[qu_cv]);
+    pctx.mctx.nqe += evicted;
+  }
+  rpcq->hidx = qholders.size();
+  qholders.push_back(idx);
+  pthread_mtx_unlock(&mtx[qu_cv]);
+
+  pthread_mtx_lock(&rpcq->mtx);
+  rpcq->buf = buf;
+  rpcq->cap = qbuf_sz;
+}
+}  // namespace
+
+/* nn_shuffler_reserve:
+ *   make room for a req_sz req in the corresponding rpc queue and return
+ *   where the req should be encoded. the queue stays locked until
+ *   nn_shuffler_commit is called */
+char* nn_shuffler_reserve(unsigned char req_sz, int epoch, int peer_rank,
+                          int rank) {
+  rpcq_t* rpcq;
+  int rpcq_idx;
+  int world_sz;
+  char* req;
+
+  assert(nnctx.mssg != NULL);
+  assert(rank == mssg_get_rank(nnctx.mssg));
+  world_sz = mssg_get_count(nnctx.mssg);
+
+  if (nnctx.paranoid_checks) {
+    if (!shuffle_is_rank_receiver(nnctx.shctx, peer_rank)) {
+      ABORT("peer rank is not a receiver");
+    }
+    if (peer_rank < 0 || peer_rank >= world_sz) {
+      ABORT("invalid peer rank");
+    }
+  }
+
+  rpcq_idx = peer_rank; /* we have one queue per rank */
+  assert(rpcq_idx < nrpcqs);
+  rpcq = &rpcqs[rpcq_idx];
+  assert(rpcq != NULL);
+
+  pthread_mtx_lock(&rpcq->mtx);
+
+  /* make sure there is room: get a buffer if the queue does not have
+   * one, or flush it if full. at most one flush per queue is in flight
+   * so rpcs to a peer go out in order. */
+  while (true) {
+    rpcq_wait(rpcq, 0);
+    if (rpcq->buf == NULL) {
+      rpcq->busy = 1; /* force other writers to block */
+      qbuf_acquire(rpcq_idx);
       rpcq->busy = 0;
-      rpcq->sz = 0;
+      pthread_cv_notifyall(&rpcq->cv);
+    } else if (rpcq->sz + req_sz + 1 <= rpcq_limit(rpcq)) {
+      break;
+    } else if (rpcq->sz == 0) {
+      /* happens when the memory reserved for the queue is smaller than
+       * a single write */
+      ABORT("rpc overflow");
+    } else if (rpcq->inflight != 0) {
+      rpcq_wait(rpcq, 1);
+    } else {
+      rpcq_flush(rpcq_idx);
+      rpcq_resize(rpcq);
     }
   }
+  rpcq->lru = now_micros_coarse();
 
   /* enqueue */
-  if (rpcq->sz + req_sz + 1 > max_rpcq_sz) {
-    /* happens when the memory reserved for the queue is smaller than
-     * a single write */
-    ABORT("rpc overflow");
+  rpcq->lepo = epoch;
+  rpcq->buf[rpcq->sz] = req_sz;
+  req = rpcq->buf + rpcq->sz + 1;
+  rpcq->sz += req_sz + 1;
+
+  return req;
+}
+
+/* nn_shuffler_commit:
+ *   unlock the rpc queue after a req has been encoded into it */
+void nn_shuffler_commit(int peer_rank) {
+  assert(peer_rank < nrpcqs);
+  pthread_mtx_unlock(&rpcqs[peer_rank].mtx);
+}
+
+/* nn_shuffler_enqueue:
+ *   encode a req and append it into a corresponding rpc queue */
+void nn_shuffler_enqueue(char* req, unsigned char req_sz, int epoch,
+                         int peer_rank, int rank) {
+  memcpy(nn_shuffler_reserve(req_sz, epoch, peer_rank, rank), req, req_sz);
+  nn_shuffler_commit(peer_rank);
+}
+
+/* nn_shuffler_mark: send an end-of-epoch marker to a peer carrying the number
+ * of writes we have sent to it in an epoch. the marker travels as an empty
+ * rpc so it is counted and waited for like any other rpc. */
+void nn_shuffler_mark(int peer_rank, int epoch, unsigned long long nwrites) {
+  static char empty[1];
+  write_in_t write_in;
+  void* arg1;
+  void* arg2;
+  int rv;
+
+  assert(nnctx.mssg != NULL);
+  if (nwrites >= 0xffffffffULL) {
+    ABORT("too many writes for an epoch marker");
+  }
+  write_in.dst = peer_rank;
+  write_in.src = mssg_get_rank(nnctx.mssg);
+  write_in.epo = epoch;
+  write_in.mark = static_cast<hg_uint32_t>(nwrites + 1);
+  write_in.sz = 0;
+  write_in.msg = empty;
+  write_in.zsz = 0;
+  write_in.zmsg = NULL;
+  write_in.hash_sig = nn_shuffler_maybe_hashsig(&write_in);
+  shuffle_msg_sent(0, &arg1, &arg2);
+  if (!nnctx.force_sync) {
+    rv = nn_shuffler_write_send_async(&write_in, peer_rank, arg1, arg2);
   } else {
-    rpcq->lepo = epoch;
-    rpcq->buf[rpcq->sz] = req_sz;
-    memcpy(rpcq->buf + rpcq->sz + 1, req, req_sz);
-    rpcq->sz += req_sz + 1;
+    rv = nn_shuffler_write_send(&write_in, peer_rank);
+    shuffle_msg_replied(arg1, arg2);
+  }
+  if (rv != 0) {
+    ABORT("plfsdir peer marker failed");
   }
-
-  pthread_mtx_unlock(&mtx[qu_cv]);
 }
 
 /* nn_shuffler_flushq: force flushing all rpc queue */
 void nn_shuffler_flushq() {
-  write_in_t write_in;
   rpcq_t* rpcq;
-  void* arg1;
-  void* arg2;
   int peer_rank_idx;
   int peer_rank;
-  int rank;
-  int rv;
 
   assert(nnctx.mssg != NULL);
-  rank = mssg_get_rank(nnctx.mssg);
-
-  pthread_mtx_lock(&mtx[qu_cv]);
 
   for (peer_rank_idx = 0; peer_rank_idx < nrpcqs; peer_rank_idx++) {
     peer_rank = rpcq_order[peer_rank_idx];
     rpcq = &rpcqs[peer_rank];
-    if (rpcq->sz == 0) { /* skip empty queue */
-      continue;
-    } else if (rpcq->sz > MAX_RPC_MESSAGE) {
-      ABORT("rpc overflow");
-    } else {
-      rpcq->busy = 1; /* force other writers to block */
-      /* unlock when sending the rpc */
-      pthread_mtx_unlock(&mtx[qu_cv]);
-      write_in.dst = peer_rank;
-      write_in.src = rank;
-      write_in.epo = rpcq->lepo;
-      write_in.sz = rpcq->sz;
-      write_in.msg = rpcq->buf;
-      write_in.hash_sig = nn_shuffler_maybe_hashsig(&write_in);
-      if (!nnctx.force_sync) {
-        shuffle_msg_sent(0, &arg1, &arg2);
-        rv = nn_shuffler_write_send_async(&write_in, peer_rank, arg1, arg2);
-      } else {
-        shuffle_msg_sent(0, &arg1, &arg2);
-        rv = nn_shuffler_write_send(&write_in, peer_rank);
-        shuffle_msg_replied(arg1, arg2);
-      }
-      if (rv != 0) {
-        ABORT("plfsdir peer write failed");
-      }
-      pthread_mtx_lock(&mtx[qu_cv]);
-      pthread_cv_notifyall(&cv[qu_cv]);
-      rpcq->busy = 0;
-      rpcq->sz = 0;
+    pthread_mtx_lock(&rpcq->mtx);
+    rpcq_wait(rpcq, 1);
+    if (rpcq->sz != 0) {
+      rpcq_flush(peer_rank);
+      rpcq_resize(rpcq);
+      rpcq_wait(rpcq, 1);
+    }
+    /* return idle buffers to the pool */
+    if (rpcq->buf != NULL && rpcq->sz == 0) {
+      qbuf_release(peer_rank);
     }
+    pthread_mtx_unlock(&rpcq->mtx);
   }
+}
 
+/* nn_shuffler_progress: send out the queues that hold pending writes. only
+ * queues holding a buffer are visited, and queues that are locked, being
+ * flushed, or waited on by writers are skipped rather than waited for. idle
+ * buffers stay with their queues until the epoch ends. */
+void nn_shuffler_progress() {
+  std::vector<int> holders;
+  rpcq_t* rpcq;
+  size_t i;
+
+  if (rpcqs == NULL || is_shuttingdown() != 0) return;
+  pthread_mtx_lock(&mtx[qu_cv]);
+  holders = qholders;
   pthread_mtx_unlock(&mtx[qu_cv]);
+
+  for (i = 0; i < holders.size(); i++) {
+    rpcq = &rpcqs[holders[i]];
+    if (pthread_mutex_trylock(&rpcq->mtx) != 0) continue;
+    if (rpcq->busy == 0 && rpcq->inflight == 0 && rpcq->buf != NULL &&
+        rpcq->sz != 0) {
+      rpcq_flush(holders[i]);
+    }
+    pthread_mtx_unlock(&rpcq->mtx);
+  }
 }
 
 /* bg_work(): dedicated thread function to drive mercury progress */
@@ -1172,13 +1741,19 @@ void nn_shuffler_init(shuffle_ctx_t* ctx) {
   }
 
   cb_left = cb_allowed;
+  max_cb_allowed = cb_allowed;
+  cb_acks = 0;
 
   if (is_envset("SHUFFLE_Hash_sig")) nnctx.hash_sig = 1;
+  if (is_envset("SHUFFLE_Compress")) nnctx.compress = 1;
   if (is_envset("SHUFFLE_Force_sync_rpc")) nnctx.force_sync = 1;
   if (is_envset("SHUFFLE_Paranoid_checks")) nnctx.paranoid_checks = 1;
   if (is_envset("SHUFFLE_Random_flush")) nnctx.random_flush = 1;
   if (is_envset("SHUFFLE_Mercury_cache_handles")) nnctx.cache_hlds = 1;
   if (is_envset("SHUFFLE_Mercury_rusage")) nnctx.hg_rusage = 1;
+  if (is_envset("SHUFFLE_Adaptive_rpc")) nnctx.adaptive_rpc = 1;
+  if (is_envset("SHUFFLE_Buffer_evict_largest")) nnctx.evict_largest = 1;
+  if (nnctx.force_sync) nnctx.adaptive_rpc = 0; /* needs async rpc replies */
 
   nnctx.hg_clz = HG_Init(nnctx.my_addr, ctx->is_receiver);
   if (!nnctx.hg_clz) ABORT("HG_Init");
@@ -1227,7 +1802,8 @@ void nn_shuffler_init(shuffle_ctx_t* ctx) {
 
   env = maybe_getenv("SHUFFLE_Buffer_per_queue");
   if (env == NULL) {
-    max_rpcq_sz = DEFAULT_BUFFER_PER_QUEUE;
+    max_rpcq_sz = nnctx.adaptive_rpc ? DEFAULT_ADAPTIVE_MAX_BUFFER
+                                     : DEFAULT_BUFFER_PER_QUEUE;
   } else {
     max_rpcq_sz = atoi(env);
     if (max_rpcq_sz > MAX_RPC_MESSAGE) {
@@ -1243,24 +1819,80 @@ void nn_shuffler_init(shuffle_ctx_t* ctx) {
     }
   }
 
-  nbufs = 0; /* number sender buffers we actually allocated */
-
-  rpcqs = static_cast<rpcq_t*>(malloc(nrpcqs * sizeof(rpcq_t)));
+  nbufs = 0; /* number of queues that may need a buffer */
   for (i = 0; i < nrpcqs; i++) {
     if (shuffle_is_rank_receiver(ctx, i)) {
-      rpcqs[i].buf = static_cast<char*>(malloc(max_rpcq_sz));
       nbufs++;
-    } else {
-      rpcqs[i].buf = NULL;
     }
+  }
+
+  /* queue buffers come from a pool bounded by a budget. by default the
+   * budget is what one buffer per queue would take, up to a cap. in
+   * adaptive mode queues start with an even share of the budget and
+   * then grow or shrink from there. */
+  min_rpcq_sz = max_rpcq_sz;
+  qbuf_sz = max_rpcq_sz;
+  env = maybe_getenv("SHUFFLE_Buffer_budget");
+  if (env == NULL) {
+    rpcq_budget = size_t(nbufs) * (nnctx.adaptive_rpc ? DEFAULT_BUFFER_PER_QUEUE
+                                                      : max_rpcq_sz);
+    rpcq_budget = std::min<size_t>(rpcq_budget, DEFAULT_BUFFER_BUDGET);
+  } else {
+    rpcq_budget = strtoull(env, NULL, 10);
+  }
+  if (nnctx.adaptive_rpc) {
+    min_rpcq_sz = std::min<size_t>(ADAPT_MIN_BUFFER, max_rpcq_sz);
+    if (nbufs != 0) {
+      qbuf_sz = std::min<size_t>(rpcq_budget / nbufs, max_rpcq_sz);
+      qbuf_sz = std::max<size_t>(qbuf_sz, min_rpcq_sz);
+    }
+    max_cb_allowed = MAX_OUTSTANDING_RPC;
+  }
+  if (rpcq_budget < qbuf_sz) {
+    if (pctx.my_rank == 0) {
+      logf(LOG_WARN, "RPC BUFFER BUDGET TOO SMALL - ONE BUFFER IS USED");
+    }
+    rpcq_budget = qbuf_sz;
+  }
+
+  rpcq_mem = 0;
+  qbuf_inuse = 0;
+  qholders.clear();
+  hstg_reset_min(nnctx.qu_wait);
+  hstg_reset_min(nnctx.cb_wait);
+  base_rtt = 0;
+  rpcqs = static_cast<rpcq_t*>(malloc(nrpcqs * sizeof(rpcq_t)));
+  for (i = 0; i < nrpcqs; i++) {
+    rpcqs[i].buf = NULL; /* allocated on first use */
+    rpcqs[i].spare = NULL;
+    rpcqs[i].inflight = 0;
+    rpcqs[i].cap = 0;
+    rpcqs[i].lim = qbuf_sz;
+    rpcqs[i].rtt = 0;
     rpcqs[i].busy = 0;
     rpcqs[i].lepo = 0;
     rpcqs[i].sz = 0;
+    rpcqs[i].lru = 0;
+    rpcqs[i].hidx = -1;
+    rv = pthread_mutex_init(&rpcqs[i].mtx, NULL);
+    if (rv) ABORT("pthread_mutex_init");
+    rv = pthread_cond_init(&rpcqs[i].cv, NULL);
+    if (rv) ABORT("pthread_cond_init");
   }
   if (pctx.my_rank == 0) {
-    logf(LOG_INFO, "rpc buffer: %s x %s (%s total)", pretty_num(nbufs).c_str(),
-         pretty_size(max_rpcq_sz).c_str(),
-         pretty_size(nbufs * max_rpcq_sz).c_str());
+    logf(LOG_INFO,
+         "rpc buffer: %s queues x %s, allocated on demand "
+         "(%s budget, evict %s)",
+         pretty_num(nbufs).c_str(), pretty_size(qbuf_sz).c_str(),
+         pretty_size(rpcq_budget).c_str(),
+         nnctx.evict_largest ? "largest" : "lru");
+    if (nnctx.adaptive_rpc) {
+      logf(LOG_INFO,
+           "adaptive rpc batching ON: queue size %s - %s\n>>> "
+           "max outstanding rpcs: %d",
+           pretty_size(min_rpcq_sz).c_str(), pretty_size(max_rpcq_sz).c_str(),
+           max_cb_allowed);
+    }
   }
 
   for (i = 0; i < 5; i++) {
@@ -1291,11 +1923,12 @@ void nn_shuffler_init(shuffle_ctx_t* ctx) {
     logf(LOG_INFO,
          "HG_Progress() timeout: %d ms, warn interval: %d ms, "
          "fatal rpc timeout: %d s, max error: %d\n>>> "
-         "cache hg_handle_t: %s, hash signature: %s\n>>> "
+         "cache hg_handle_t: %s, hash signature: %s, compression: %s\n>>> "
          "bg nice: %d",
          nnctx.hg_timeout, nnctx.hg_max_interval, nnctx.timeout,
          nnctx.hg_errors, nnctx.cache_hlds ? "YES" : "NO",
-         nnctx.hash_sig ? "YES" : "NO", nnctx.hg_nice);
+         nnctx.hash_sig ? "YES" : "NO", nnctx.compress ? "YES" : "NO",
+         nnctx.hg_nice);
     if (nnctx.paranoid_checks) {
       logf(
           LOG_WARN,
@@ -1366,6 +1999,14 @@ void nn_shuffler_destroy() {
   rpcu_accumulate(&nnctx.r[RPCU_ALLTHREADS], &rpcus[RPCU_ALLTHREADS]);
   rpcu_accumulate(&nnctx.r[RPCU_MAIN], &rpcus[RPCU_MAIN]);
 
+  if (nnctx.adaptive_rpc && pctx.my_rank == 0) {
+    logf(LOG_INFO,
+         "[adaptive rpc] final: %d outstanding rpcs, %s of queue buffers "
+         "(budget %s), best rtt %s",
+         cb_allowed, pretty_size(rpcq_mem).c_str(),
+         pretty_size(rpcq_budget).c_str(), pretty_dura(base_rtt).c_str());
+  }
+
   if (rpcqs != NULL) {
     for (i = 0; i < nrpcqs; i++) {
       assert(rpcqs[i].busy == 0);
@@ -1374,11 +2015,26 @@ void nn_shuffler_destroy() {
       if (rpcqs[i].buf) {
         free(rpcqs[i].buf);
       }
+      if (rpcqs[i].spare) {
+        free(rpcqs[i].spare);
+      }
+      pthread_mutex_destroy(&rpcqs[i].mtx);
+      pthread_cond_destroy(&rpcqs[i].cv);
     }
 
     free(rpcqs);
   }
 
+  while (!qbufs.empty()) {
+    free(qbufs.back());
+    qbufs.pop_back();
+  }
+
+  while (!zbufs.empty()) {
+    free(zbufs.back());
+    zbufs.pop_back();
+  }
+
   if (nnctx.mssg != NULL) {
     mssg_finalize(nnctx.mssg);
   }
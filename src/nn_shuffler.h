@@ -53,12 +53,18 @@
  *    Nice value to be applied to the looper thread
  *  SHUFFLE_Hash_sig
  *    Generate a hash signature for each rpc message
+ *  SHUFFLE_Compress
+ *    Compress rpc messages before sending them out
  *  SHUFFLE_Paranoid_checks
  *    Enable paranoid checks on rpc messages
  *  SHUFFLE_Force_sync_rpc
  *    Disallow async rpcs
  *  SHUFFLE_Num_outstanding_rpc
  *    Max num of outstanding rpcs allowed
+ *      Initial value when adaptive rpc is on
+ *  SHUFFLE_Adaptive_rpc
+ *    Tune rpc queue sizes and num of outstanding rpcs by rpc round-trip times
+ *      Ignored if rpc is forced to be sync
  *  SHUFFLE_Use_worker_thread
  *    Allocate a dedicated worker thread
  *  SHUFFLE_Subnet
@@ -69,6 +75,12 @@
  *    The max port number we can use
  *  SHUFFLE_Buffer_per_queue
  *    Memory allocated for each rpc queue
+ *      Max memory for each rpc queue when adaptive rpc is on
+ *  SHUFFLE_Buffer_budget
+ *    Max memory for all rpc queues
+ *      Queues get buffers on first use and others are flushed to free one
+ *  SHUFFLE_Buffer_evict_largest
+ *    Free up buffers by flushing the fullest queue instead of the lru one
  *  SHUFFLE_Random_flush
  *    Flush RPC queues out-of-order
  *  SHUFFLE_Timeout
@@ -93,12 +105,30 @@ extern int nn_shuffler_my_rank();
 extern void nn_shuffler_enqueue(char* req, unsigned char req_sz, int epoch,
                                 int peer_rank, int rank);
 
+/* nn_shuffler_reserve: lock an rpc queue and return room for a req_sz
+ * write that the caller encodes in place. */
+extern char* nn_shuffler_reserve(unsigned char req_sz, int epoch,
+                                 int peer_rank, int rank);
+
+/* nn_shuffler_commit: unlock the rpc queue after a reserved write. */
+extern void nn_shuffler_commit(int peer_rank);
+
 /* nn_shuffler_waitcb: wait for all outstanding rpcs to finish. */
 extern void nn_shuffler_waitcb();
 
 /* nn_shuffler_flushq: force flushing local rpc queues. */
 extern void nn_shuffler_flushq();
 
+/* nn_shuffler_mark: send a peer an end-of-epoch marker carrying the number of
+ * writes sent to it in an epoch. call after nn_shuffler_flushq(). */
+extern void nn_shuffler_mark(int peer_rank, int epoch,
+                             unsigned long long nwrites);
+
+/* nn_shuffler_progress: send out pending writes of rpc queues that are not
+ * in use or already being flushed, without waiting on any queue. no-op if the
+ * shuffler is not running. safe to call before init and after destroy. */
+extern void nn_shuffler_progress();
+
 /* nn_shuffler_bgwait: wait for all background rpc work to finish. */
 extern void nn_shuffler_bgwait();
 
@@ -129,6 +159,25 @@ extern void nn_shuffler_wakeup();
  */
 #define DEFAULT_BUFFER_PER_QUEUE 4096
 
+/*
+ * Default max amount of memory for each rpc queue in adaptive mode.
+ *
+ * Queues start with an even share of the total budget (which defaults
+ * to DEFAULT_BUFFER_PER_QUEUE per queue, up to DEFAULT_BUFFER_BUDGET)
+ * and may grow up to this size.
+ */
+#define DEFAULT_ADAPTIVE_MAX_BUFFER 65536
+
+/*
+ * Default cap on the total amount of memory for all rpc queues.
+ *
+ * Queue buffers are allocated on first use. Once the budget is hit,
+ * a queue is flushed to free up its buffer for another queue. While
+ * there is room, a queue being flushed gets a second buffer so writers
+ * do not have to wait for the rpc to be sent.
+ */
+#define DEFAULT_BUFFER_BUDGET (64 << 20)
+
 /*
  * Default num of outstanding rpc.
  *
@@ -165,6 +214,36 @@ extern void nn_shuffler_wakeup();
  */
 #define DEFAULT_VIRTUAL_FACTOR 1024
 
+/*
+ * Default number of particle names each rank samples per epoch
+ * for computing range placement pivots.
+ */
+#define DEFAULT_RANGE_SAMPLES 256
+
+/*
+ * Range placement pivots are recomputed once the most loaded receiver
+ * exceeds the mean receiver load by this much (in percent).
+ */
+#define DEFAULT_RANGE_REPIVOT 20
+
+/*
+ * Size (in MB) of the file receivers write to probe their write bandwidth
+ * for weighted placement.
+ */
+#define DEFAULT_WEIGHT_PROBE_SIZE 16
+
+/*
+ * Default percent of writes for a hot receiver that are redirected to its
+ * overflow partner.
+ */
+#define DEFAULT_REDIRECT_PCT 25
+
+/*
+ * A receiver is considered hot once this many incoming rpcs are pending
+ * at it.
+ */
+#define DEFAULT_REDIRECT_BACKLOG 8
+
 /*
  * If "mercury_proto" is not specified, we set it to the follows.
  *
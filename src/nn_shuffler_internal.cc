@@ -64,7 +64,7 @@ void nn_vector_random_shuffle(int seed, std::vector<int>* input) {
 namespace {
 /* nn_shuffler_hashsig: generates a 32-bits hash signature for a given input */
 hg_uint32_t nn_shuffler_hashsig(const write_in_t* in) {
-  char buf[20];
+  char buf[24];
   uint32_t tmp;
   assert(in != NULL);
 
@@ -73,12 +73,13 @@ hg_uint32_t nn_shuffler_hashsig(const write_in_t* in) {
   memcpy(buf + 1 * 4, &in->dst, 4);
   memcpy(buf + 2 * 4, &in->src, 4);
   memcpy(buf + 3 * 4, &in->epo, 4);
+  memcpy(buf + 4 * 4, &in->mark, 4);
 
   assert(in->msg != NULL);
   tmp = HASH(in->msg, in->sz);
-  memcpy(buf + 16, &tmp, 4);
+  memcpy(buf + 20, &tmp, 4);
 
-  return HASH(buf, 20);
+  return HASH(buf, 24);
 }
 }  // namespace
 
@@ -102,6 +103,8 @@ hg_return_t nn_shuffler_write_in_proc(hg_proc_t proc, void* data) {
     if (hret != HG_SUCCESS) return (hret);
     hret = hg_proc_hg_uint32_t(proc, &in->sz);
     if (hret != HG_SUCCESS) return (hret);
+    hret = hg_proc_hg_uint32_t(proc, &in->zsz);
+    if (hret != HG_SUCCESS) return (hret);
 
     hret = hg_proc_hg_int32_t(proc, &in->dst);
     if (hret != HG_SUCCESS) return (hret);
@@ -109,14 +112,22 @@ hg_return_t nn_shuffler_write_in_proc(hg_proc_t proc, void* data) {
     if (hret != HG_SUCCESS) return (hret);
     hret = hg_proc_hg_int32_t(proc, &in->epo);
     if (hret != HG_SUCCESS) return (hret);
+    hret = hg_proc_hg_uint32_t(proc, &in->mark);
+    if (hret != HG_SUCCESS) return (hret);
 
-    hret = hg_proc_memcpy(proc, in->msg, in->sz);
+    if (in->zsz != 0) {
+      hret = hg_proc_memcpy(proc, in->zmsg, in->zsz);
+    } else {
+      hret = hg_proc_memcpy(proc, in->msg, in->sz);
+    }
 
   } else if (op == HG_DECODE) {
     hret = hg_proc_hg_uint32_t(proc, &in->hash_sig);
     if (hret != HG_SUCCESS) return (hret);
     hret = hg_proc_hg_uint32_t(proc, &in->sz);
     if (hret != HG_SUCCESS) return (hret);
+    hret = hg_proc_hg_uint32_t(proc, &in->zsz);
+    if (hret != HG_SUCCESS) return (hret);
 
     hret = hg_proc_hg_int32_t(proc, &in->dst);
     if (hret != HG_SUCCESS) return (hret);
@@ -124,8 +135,16 @@ hg_return_t nn_shuffler_write_in_proc(hg_proc_t proc, void* data) {
     if (hret != HG_SUCCESS) return (hret);
     hret = hg_proc_hg_int32_t(proc, &in->epo);
     if (hret != HG_SUCCESS) return (hret);
+    hret = hg_proc_hg_uint32_t(proc, &in->mark);
+    if (hret != HG_SUCCESS) return (hret);
 
-    hret = hg_proc_memcpy(proc, in->msg, in->sz);
+    if (in->sz > MAX_RPC_MESSAGE || in->zsz > MAX_RPC_MESSAGE) {
+      return HG_SIZE_ERROR;
+    } else if (in->zsz != 0) {
+      hret = hg_proc_memcpy(proc, in->zmsg, in->zsz);
+    } else {
+      hret = hg_proc_memcpy(proc, in->msg, in->sz);
+    }
 
   } else {
     hret = HG_SUCCESS; /* noop */
@@ -140,10 +159,11 @@ hg_return_t nn_shuffler_write_out_proc(hg_proc_t proc, void* data) {
   write_out_t* const out = reinterpret_cast<write_out_t*>(data);
   hg_proc_op_t op = hg_proc_get_op(proc);
 
-  if (op == HG_ENCODE) {
-    hret = hg_proc_hg_int32_t(proc, &out->rv);
-  } else if (op == HG_DECODE) {
+  if (op == HG_ENCODE || op == HG_DECODE) {
     hret = hg_proc_hg_int32_t(proc, &out->rv);
+    if (hret == HG_SUCCESS) {
+      hret = hg_proc_hg_uint32_t(proc, &out->backlog);
+    }
   } else {
     hret = HG_SUCCESS; /* noop */
   }
@@ -59,6 +59,11 @@
  */
 #define MAX_RPC_MESSAGE (524288)
 
+/*
+ * The max number of decoded writes handed to the upper layer at once.
+ */
+#define MAX_HANDLE_BATCH 256
+
 #define RPC_FAILED_FILENAME \
   (strrchr(__FILE__, '/') ? strrchr(__FILE__, '/') + 1 : __FILE__)
 #define RPC_FAILED(msg, ret) \
@@ -98,6 +103,10 @@ typedef struct nn_ctx {
 
   /* hg_progress intervals */
   hstg_t hg_intvl;
+  /* time spent waiting for a busy rpc queue (us) */
+  hstg_t qu_wait;
+  /* time spent waiting for an rpc callback slot (us) */
+  hstg_t cb_wait;
 
   /* hg_timeouts (in ms) */
   int hg_max_interval;
@@ -108,6 +117,9 @@ typedef struct nn_ctx {
   int force_sync;   /* avoid async rpc */
   int cache_hlds;   /* cache mercury rpc handles */
   int hash_sig;     /* generate a hash signature for each rpc */
+  int compress;     /* compress rpc payloads (shufzip) */
+  int adaptive_rpc; /* tune rpc batch sizes and window by rpc rtts */
+  int evict_largest; /* take buffers from the fullest queue, not lru */
 
   int paranoid_checks;
 
@@ -131,15 +143,21 @@ extern nn_ctx_t nnctx;
 typedef struct write_in {
   hg_uint32_t hash_sig; /* hash signature of the entire payload */
   hg_uint32_t sz;       /* msg size */
+  hg_uint32_t zsz;      /* compressed msg size (0 if not compressed) */
 
   hg_int32_t dst;
   hg_int32_t src;
   hg_int32_t epo;
+  /* non-zero for end-of-epoch markers: 1 + number of writes sent in epo */
+  hg_uint32_t mark;
   void* msg;
+  void* zmsg; /* compressed msg, sent instead of msg if zsz != 0 */
 } write_in_t;
 
 typedef struct write_out {
   hg_int32_t rv; /* ret value of the write operation */
+  /* num of incoming rpcs pending at the receiver when it replied */
+  hg_uint32_t backlog;
 } write_out_t;
 
 typedef struct write_cb {
@@ -150,7 +168,10 @@ typedef struct write_cb {
 typedef struct write_async_cb {
   void* arg1;
   void* arg2;
-  int slot; /* cb slot used */
+  int slot;    /* cb slot used */
+  int peer;    /* rank the rpc was sent to */
+  uint32_t sz; /* msg size */
+  uint64_t t0; /* time the rpc was sent (adaptive rpc only) */
 } write_async_cb_t;
 
 typedef struct write_info {
@@ -46,13 +46,18 @@
 #include <string.h>
 #include <sys/stat.h>
 
+#include <algorithm>
+#include <deque>
 #include <map>
 #include <string>
 #include <vector>
 
+#include "hash_batch.h"
 #include "preload_internal.h"
 #include "pthreadtap.h"
 
+#include <pdlfs-common/xxhash.h>
+
 #ifdef PRELOAD_HAS_PAPI
 #include <papi.h>
 #endif
@@ -76,9 +81,84 @@ static int mon_dump_txt = 0;
 /* mutex to protect preload state */
 static pthread_mutex_t preload_mtx = PTHREAD_MUTEX_INITIALIZER;
 
-/* mutex to synchronize writes */
+/* mutex to protect particle name sampling */
+static pthread_mutex_t sample_mtx = PTHREAD_MUTEX_INITIALIZER;
+
+/*
+ * particle name sampler. during the first epoch we keep a reservoir of
+ * up to cap names picked uniformly from all names we see. once that epoch
+ * is over, the reservoir is indexed by a flat hash table and later epochs
+ * only look names up and bump their hit counts, without taking any lock.
+ */
+static struct sampler {
+  char* ids;       /* cap names, pctx.particle_id_size bytes each */
+  uint32_t* hits;  /* num of epochs each name was seen */
+  size_t cap;      /* max num of names */
+  size_t n;        /* num of names sampled */
+  uint64_t seen;   /* num of names seen during the first epoch */
+  uint32_t* table; /* sample index + 1, or 0 for empty slots */
+  size_t mask;     /* num of table slots - 1 */
+  volatile int indexed;
+} sampler;
+
+/*
+ * default size of the staging buffer for each write shard.
+ */
+#define DEFAULT_WRITE_SHARD_BUFSIZE (16 << 10)
+
+/*
+ * write shards: incoming particle writes are hashed by their names into a
+ * set of shards (as many as memtable partitions by default, though shards
+ * do not follow plfsdir's own partitioning). each shard has its own lock and
+ * a staging buffer where writes are batched. plfsdir writes themselves are
+ * still serialized by write_mtx, which is taken once per batch rather than
+ * once per write. a shard flushing a batch swaps in a spare buffer and drops
+ * its lock while the batch goes into plfsdir, so other writers can keep
+ * staging. with pipelined epochs, a shard staging writes of an epoch plfsdir
+ * does not take yet grows its buffer instead of waiting, and shrinks back
+ * once the batch is flushed. shards are cache aligned to avoid false sharing.
+ */
+#define WRITE_SHARD_ALIGN 64
+
+typedef struct write_shard {
+  pthread_mutex_t mtx;
+  pthread_cond_t cv; /* signaled on new plfsdir epochs and finished flushes */
+  char* buf;    /* staged writes */
+  char* spare;  /* buffer swapped in while buf is being flushed */
+  size_t cap;   /* size of buf */
+  size_t spcap; /* size of spare */
+  size_t off;   /* bytes staged */
+  int flushing; /* non-zero while a batch is going into plfsdir */
+  int epoch;  /* epoch of all staged writes */
+  int nrecs;  /* num writes staged */
+  /* per-shard stats, merged into mon stats at the end of an epoch */
+  unsigned long long nbatches; /* num batches flushed to plfsdir */
+  unsigned long long nwaits;   /* num times the shard lock was contended */
+} __attribute__((aligned(WRITE_SHARD_ALIGN))) write_shard_t;
+
+static write_shard_t* wshards = NULL;
+
+/*
+ * mutex to serialize writes into plfsdir. plfsdir appends, filter puts, and
+ * sideio appends are not known to be safe to call concurrently, so all of
+ * them go through this lock. shards take it once per batch.
+ */
 static pthread_mutex_t write_mtx = PTHREAD_MUTEX_INITIALIZER;
 
+/*
+ * the epoch plfsdir currently takes writes for. with pipelined epochs, this
+ * may lag behind num_eps - 1 while the previous epoch is being flushed in the
+ * background. only changes with all write shards locked in turn.
+ */
+static int plfs_epoch = 0;
+
+/*
+ * seed for hashing names into write shards. must differ from the seed used by
+ * shuffle placement, otherwise all names received by a rank may end up in
+ * the same few shards.
+ */
+#define WRITE_SHARD_SEED 0x9747b28c
+
 /* number of pthread created */
 static int num_pthreads = 0;
 
@@ -173,16 +253,18 @@ static void preload_init() {
 #endif
 
   pctx.isdeltafs = new std::set<FILE*>;
-  pctx.fnames = new std::set<std::string>;
-  pctx.smap = new std::map<std::string, int>;
+  pctx.fnames = new fname_set_t;
+  fname_set_init(pctx.fnames, 0); /* sized once we know the particle count */
 
   pctx.mpi_wait = DEFAULT_MPI_WAIT;
+  pctx.barrier_progress = 1;
   pctx.particle_id_size = DEFAULT_PARTICLE_ID_BYTES;
   pctx.particle_extra_size = DEFAULT_PARTICLE_EXTRA_BYTES;
   pctx.particle_size = DEFAULT_PARTICLE_BYTES;
   pctx.particle_buf_size = DEFAULT_PARTICLE_BUFSIZE;
   pctx.particle_count = 0;
   pctx.sthres = 100; /* 100 samples per 1 million input */
+  pctx.wshard_buf = DEFAULT_WRITE_SHARD_BUFSIZE;
 
   pctx.sampling = 1;
   pctx.paranoid_checks = 1;
@@ -308,6 +390,7 @@ static void preload_init() {
     if (pctx.particle_count < 0) {
       ABORT("bad particle count");
     }
+    fname_set_init(pctx.fnames, pctx.particle_count);
   }
 
   tmp = maybe_getenv("PRELOAD_Particle_buf_size");
@@ -358,6 +441,33 @@ static void preload_init() {
     }
   }
 
+  if (is_envset("PRELOAD_Mpi_ibarrier")) pctx.mpi_ibarrier = 1;
+  if (is_envset("PRELOAD_No_barrier_progress")) pctx.barrier_progress = 0;
+
+  tmp = maybe_getenv("PRELOAD_Write_shards");
+  if (tmp != NULL) {
+    pctx.wshards = atoi(tmp);
+    if (pctx.wshards < 0) {
+      pctx.wshards = 0;
+    }
+  }
+
+  tmp = maybe_getenv("PRELOAD_Write_shard_buf_size");
+  if (tmp != NULL) {
+    pctx.wshard_buf = atoi(tmp);
+    if (pctx.wshard_buf < 0) {
+      pctx.wshard_buf = 0;
+    }
+  }
+
+  tmp = maybe_getenv("PRELOAD_Pipelined_epochs");
+  if (tmp != NULL) {
+    pctx.epoch_pipeline = atoi(tmp);
+    if (pctx.epoch_pipeline < 0) {
+      pctx.epoch_pipeline = 0;
+    }
+  }
+
   if (is_envset("PRELOAD_Skip_sampling")) pctx.sampling = 0;
 
   tmp = maybe_getenv("PRELOAD_Sample_threshold");
@@ -368,6 +478,14 @@ static void preload_init() {
     }
   }
 
+  tmp = maybe_getenv("PRELOAD_Sample_size");
+  if (tmp != NULL) {
+    pctx.ssize = atoi(tmp);
+    if (pctx.ssize < 0) {
+      pctx.ssize = 0;
+    }
+  }
+
 #ifdef PRELOAD_HAS_PAPI
   tmp = maybe_getenv("PRELOAD_Papi_events");
   if (tmp == NULL || tmp[0] == 0) {
@@ -426,6 +544,12 @@ static void preload_init() {
   if (is_envset("PRELOAD_No_sys_probing")) pctx.noscan = 1;
   if (is_envset("PRELOAD_Testing")) pctx.testin = 1;
 
+  /* senders write bloomy and wisc-key side data into plfsdir directly, and
+   * that cannot run ahead of a background epoch flush */
+  if (pctx.sideft || pctx.sideio || IS_BYPASS_WRITE(pctx.mode) ||
+      !IS_BYPASS_DELTAFS_NAMESPACE(pctx.mode))
+    pctx.epoch_pipeline = 0;
+
   /* additional init can go here or MPI_Init() */
 }
 
@@ -488,7 +612,16 @@ class fake_file {
   size_t resid_;     /* residual */
 
  public:
-  fake_file() : dptr_(data_), resid_(sizeof(data_)) { path_.reserve(256); }
+  /* stock file state, only touched by the owning thread */
+  int busy;               /* non-zero while the file is open */
+  unsigned long long nw;  /* opens since last folded into pctx.mctx */
+  unsigned long long ncw; /* dup opens since last folded into pctx.mctx */
+  fname_set_t names;      /* names opened since last folded into pctx.fnames */
+
+  fake_file() : dptr_(data_), resid_(sizeof(data_)), busy(0), nw(0), ncw(0) {
+    fname_set_init(&names, 0);
+    path_.reserve(256);
+  }
 
   void reset(const char* path) {
     path_.assign(path);
@@ -497,7 +630,10 @@ class fake_file {
   }
 
   explicit fake_file(const char* path)
-      : path_(path), dptr_(data_), resid_(sizeof(data_)){};
+      : path_(path), dptr_(data_), resid_(sizeof(data_)), busy(0), nw(0),
+        ncw(0) {
+    fname_set_init(&names, 0);
+  }
 
   /* returns the actual number of bytes added. */
   size_t add_data(const void* toadd, size_t len) {
@@ -520,35 +656,342 @@ class fake_file {
   char* data() { return data_; }
 };
 
-/* avoids repeated malloc if vpic only opens one file a time */
-fake_file the_stock_file;
-fake_file* stock_file = &the_stock_file;
+/*
+ * each dumping thread gets a stock file so we avoid repeated malloc if a
+ * thread only opens one file a time. stock files are carved from a single
+ * array so telling whether we own a FILE* is a pointer range test. files
+ * opened beyond that (or by too many threads) are malloc'd and tracked in
+ * pctx.isdeltafs under preload_mtx.
+ */
+#define MAX_STOCK_FILES 256
+fake_file stock_files[MAX_STOCK_FILES];
+int num_stock_files = 0;     /* stock files handed out to threads */
+int num_heap_files = 0;      /* malloc'd files open (locked by preload_mtx) */
+__thread fake_file* my_stock_file = NULL;
+
+inline int is_stock_file(const void* ptr) {
+  const uintptr_t p = reinterpret_cast<uintptr_t>(ptr);
+  const uintptr_t base = reinterpret_cast<uintptr_t>(stock_files);
+  return p >= base && p < base + sizeof(stock_files);
+}
+
+/*
+ * stock_files_fold: fold per-thread open counts into pctx.mctx and check
+ * that no stock file is left open. with paranoid checks, per-thread name
+ * sets are also merged into pctx.fnames so names opened by more than one
+ * thread are counted as dups. called at the end of an epoch after all
+ * dumping threads are done. returns the number of stock files still open.
+ */
+int stock_files_fold() {
+  int nopen;
+  int n;
+  int i;
+
+  nopen = 0;
+  n = __sync_fetch_and_add(&num_stock_files, 0);
+  if (n > MAX_STOCK_FILES) n = MAX_STOCK_FILES;
+  for (i = 0; i < n; i++) {
+    pctx.mctx.min_nw += stock_files[i].nw;
+    pctx.mctx.max_nw += stock_files[i].nw;
+    pctx.mctx.nw += stock_files[i].nw;
+    pctx.mctx.ncw += stock_files[i].ncw;
+    if (pctx.paranoid_checks) {
+      pctx.mctx.ncw += fname_set_merge(pctx.fnames, &stock_files[i].names);
+      fname_set_clear(&stock_files[i].names);
+    }
+    stock_files[i].nw = 0;
+    stock_files[i].ncw = 0;
+    nopen += stock_files[i].busy;
+  }
+
+  return nopen;
+}
 
 }  // namespace
 
 /*
- * claim_FILE: look at FILE* and see if we claim it
+ * claim_FILE: look at FILE* and see if we claim it. stock files are
+ * claimed without taking any locks.
  */
 static int claim_FILE(FILE* stream) {
   std::set<FILE*>::iterator it;
   int rv;
 
+  if (is_stock_file(stream)) {
+    return 1;
+  } else if (num_heap_files == 0) {
+    /* a thread only passes us a malloc'd file it opened itself */
+    return 0;
+  }
+
   pthread_mtx_lock(&preload_mtx);
 
-  if (stream != reinterpret_cast<FILE*>(&the_stock_file)) {
-    assert(pctx.isdeltafs != NULL);
-    it = pctx.isdeltafs->find(stream);
-    rv = (it != pctx.isdeltafs->end());
+  assert(pctx.isdeltafs != NULL);
+  it = pctx.isdeltafs->find(stream);
+  rv = (it != pctx.isdeltafs->end());
+
+  pthread_mtx_unlock(&preload_mtx);
+
+  return rv;
+}
 
+/*
+ * write_shard_recsz: return the staged size of a write.
+ */
+inline size_t write_shard_recsz(unsigned char fname_len,
+                                unsigned char data_len) {
+  return 2 + sizeof(int) + fname_len + 1 + data_len;
+}
+
+/*
+ * write_shard_put: stage a write in a shard. caller must hold the shard lock.
+ * return 0 if the write has been staged, or -1 if the shard is out of space.
+ */
+static int write_shard_put(write_shard_t* ws, const char* fname,
+                           unsigned char fname_len, const char* data,
+                           unsigned char data_len, int epoch, int src) {
+  const size_t sz = write_shard_recsz(fname_len, data_len);
+  char* p;
+
+  if (ws->off + sz > ws->cap) return -1;
+  p = ws->buf + ws->off;
+  p[0] = static_cast<char>(fname_len);
+  p[1] = static_cast<char>(data_len);
+  p += 2;
+  memcpy(p, &src, sizeof(int));
+  p += sizeof(int);
+  memcpy(p, fname, fname_len);
+  p += fname_len;
+  p[0] = 0;
+  p += 1;
+  memcpy(p, data, data_len);
+
+  ws->off += sz;
+  ws->epoch = epoch;
+  ws->nrecs++;
+
+  return 0;
+}
+
+/*
+ * write_shard_grow: make room for at least sz more bytes in a shard's staging
+ * buffer. caller must hold the shard lock.
+ */
+static void write_shard_grow(write_shard_t* ws, size_t sz) {
+  size_t cap;
+  char* buf;
+
+  cap = (ws->cap != 0) ? 2 * ws->cap : 1024;
+  while (cap < ws->off + sz) cap <<= 1;
+  buf = static_cast<char*>(realloc(ws->buf, cap));
+  if (buf == NULL) ABORT("realloc");
+  ws->buf = buf;
+  ws->cap = cap;
+}
+
+/*
+ * write_shard_ready: return non-zero if writes of a given epoch may go into
+ * plfsdir now, that is, no earlier batch of the shard is still being flushed
+ * and plfsdir takes writes for that epoch. caller must hold the shard lock.
+ */
+inline int write_shard_ready(write_shard_t* ws, int epoch) {
+  return !ws->flushing && (pctx.epoch_pipeline <= 0 || epoch <= plfs_epoch);
+}
+
+/*
+ * write_shard_gate: wait until writes of a given epoch may go into plfsdir.
+ * caller must hold the shard lock, which is released while waiting.
+ */
+static void write_shard_gate(write_shard_t* ws, int epoch) {
+  while (!write_shard_ready(ws, epoch)) {
+    pthread_cv_wait(&ws->cv, &ws->mtx);
+  }
+}
+
+/*
+ * write_shard_append: insert a write into plfsdir. caller must hold
+ * write_mtx. return 0 on success, or EOF on errors.
+ */
+static int write_shard_append(const char* fname, unsigned char fname_len,
+                              const char* data, unsigned char data_len,
+                              int epoch, int src) {
+  ssize_t n;
+
+  if (pctx.sideft) { /* use the bloomy fmt */
+    if (deltafs_plfsdir_filter_put(pctx.plfshdl, fname, fname_len, src) != 0) {
+      return EOF;
+    }
   } else {
-    rv = 1;
+    n = deltafs_plfsdir_append(pctx.plfshdl, fname, epoch, data, data_len);
+    if (n != data_len) {
+      return EOF;
+    }
   }
 
-  pthread_mtx_unlock(&preload_mtx);
+  return 0;
+}
+
+/*
+ * write_shard_flush: hand all staged writes of a shard to plfsdir. the
+ * staged batch is swapped out for the spare buffer and the shard lock is
+ * dropped while the batch is written, so others may keep staging into the
+ * shard in the meantime. caller must hold the shard lock. return 0 on
+ * success, or EOF on errors.
+ */
+static int write_shard_flush(write_shard_t* ws) {
+  unsigned char fname_len;
+  unsigned char data_len;
+  char* batch;
+  size_t cap;
+  const char* p;
+  const char* limit;
+  int epoch;
+  int src;
+  int rv;
+
+  rv = 0;
+  while (ws->nrecs != 0 && !write_shard_ready(ws, ws->epoch)) {
+    pthread_cv_wait(&ws->cv, &ws->mtx);
+  }
+  if (ws->nrecs == 0) return rv; /* flushed by others while we waited */
+  batch = ws->buf;
+  cap = ws->cap;
+  limit = ws->buf + ws->off;
+  epoch = ws->epoch;
+  ws->buf = ws->spare;
+  ws->cap = ws->spcap;
+  ws->spare = NULL;
+  ws->spcap = 0;
+  ws->off = 0;
+  ws->nrecs = 0;
+  ws->flushing = 1;
+  ws->nbatches++;
+  pthread_mtx_unlock(&ws->mtx);
+
+  p = batch;
+  pthread_mtx_lock(&write_mtx);
+  while (p < limit) {
+    fname_len = static_cast<unsigned char>(p[0]);
+    data_len = static_cast<unsigned char>(p[1]);
+    p += 2;
+    memcpy(&src, p, sizeof(int));
+    p += sizeof(int);
+    if (write_shard_append(p, fname_len, p + fname_len + 1, data_len, epoch,
+                           src) != 0) {
+      rv = EOF;
+    }
+    p += fname_len + 1 + data_len;
+  }
+  pthread_mtx_unlock(&write_mtx);
+
+  if (cap != size_t(pctx.wshard_buf)) { /* shrink after a grow */
+    free(batch);
+    batch = NULL;
+    cap = pctx.wshard_buf;
+    if (cap != 0) {
+      batch = static_cast<char*>(malloc(cap));
+      if (batch == NULL) ABORT("malloc");
+    }
+  }
+
+  pthread_mtx_lock(&ws->mtx);
+  ws->spare = batch;
+  ws->spcap = cap;
+  ws->flushing = 0;
+  pthread_cv_notifyall(&ws->cv);
 
   return rv;
 }
 
+/*
+ * write_shards_init: allocate write shards. shards are only used by
+ * receivers writing directly to a plfsdir.
+ */
+static void write_shards_init() {
+  int i;
+
+  if (pctx.wshards <= 0) {
+    pctx.wshards = pctx.plfsparts > 0 ? pctx.plfsparts : 1;
+  }
+  if (posix_memalign(reinterpret_cast<void**>(&wshards), WRITE_SHARD_ALIGN,
+                     pctx.wshards * sizeof(write_shard_t)) != 0)
+    ABORT("posix_memalign");
+  for (i = 0; i < pctx.wshards; i++) {
+    if (pthread_mutex_init(&wshards[i].mtx, NULL) != 0) {
+      ABORT("pthread_mutex_init");
+    }
+    if (pthread_cond_init(&wshards[i].cv, NULL) != 0) {
+      ABORT("pthread_cond_init");
+    }
+    wshards[i].buf = NULL;
+    wshards[i].spare = NULL;
+    if (pctx.wshard_buf != 0) {
+      wshards[i].buf = static_cast<char*>(malloc(pctx.wshard_buf));
+      if (wshards[i].buf == NULL) ABORT("malloc");
+      wshards[i].spare = static_cast<char*>(malloc(pctx.wshard_buf));
+      if (wshards[i].spare == NULL) ABORT("malloc");
+    }
+    wshards[i].cap = pctx.wshard_buf;
+    wshards[i].spcap = pctx.wshard_buf;
+    wshards[i].off = 0;
+    wshards[i].flushing = 0;
+    wshards[i].epoch = 0;
+    wshards[i].nrecs = 0;
+    wshards[i].nbatches = 0;
+    wshards[i].nwaits = 0;
+  }
+}
+
+/*
+ * write_shards_flush: flush all write shards staging writes of a given epoch
+ * or earlier and merge shard stats into mon stats. called at the end of an
+ * epoch before plfsdir is flushed, so batches still being written by others
+ * are waited for as well. shards already staging writes of the next epoch
+ * are left alone. return 0 on success, or EOF on errors.
+ */
+static int write_shards_flush(int epoch, mon_ctx_t* mon) {
+  int rv;
+  int i;
+
+  rv = 0;
+  if (wshards == NULL) return rv;
+  for (i = 0; i < pctx.wshards; i++) {
+    pthread_mtx_lock(&wshards[i].mtx);
+    if (wshards[i].epoch <= epoch) {
+      if (write_shard_flush(&wshards[i]) != 0) rv = EOF;
+    }
+    while (wshards[i].flushing) {
+      pthread_cv_wait(&wshards[i].cv, &wshards[i].mtx);
+    }
+    mon->nwb += wshards[i].nbatches;
+    mon->nwc += wshards[i].nwaits;
+    wshards[i].nbatches = 0;
+    wshards[i].nwaits = 0;
+    pthread_mtx_unlock(&wshards[i].mtx);
+  }
+
+  return rv;
+}
+
+/*
+ * write_shards_destroy: free all write shards. all staged writes
+ * must have been flushed.
+ */
+static void write_shards_destroy() {
+  int i;
+
+  if (wshards == NULL) return;
+  for (i = 0; i < pctx.wshards; i++) {
+    assert(wshards[i].nrecs == 0);
+    pthread_mutex_destroy(&wshards[i].mtx);
+    pthread_cond_destroy(&wshards[i].cv);
+    free(wshards[i].buf);
+    free(wshards[i].spare);
+  }
+  free(wshards);
+  wshards = NULL;
+}
+
 /*
  * dump in-memory mon stats to files.
  */
@@ -558,6 +1001,13 @@ static void dump_mon(mon_ctx_t* mon, dir_stat_t* tmp_stat,
   uint64_t ts;
 
   if (!pctx.nomon) {
+    /* senders do not count towards per-receiver write stats */
+    if (pctx.recv_comm != MPI_COMM_NULL) {
+      mon->min_nrw = mon->max_nrw = mon->nfw + mon->nlw;
+    } else {
+      mon->min_nrw = ULLONG_MAX;
+      mon->max_nrw = 0;
+    }
     /* collect stats from deltafs */
     if (pctx.plfshdl != NULL) {
       mon_fetch_plfsdir_stat(pctx.plfshdl, tmp_stat);
@@ -602,6 +1052,147 @@ static void dump_mon(mon_ctx_t* mon, dir_stat_t* tmp_stat,
   }
 }
 
+/*
+ * write_shards_advance: let plfsdir take writes for a new epoch and wake up
+ * writers waiting for it.
+ */
+static void write_shards_advance(int epoch) {
+  int i;
+
+  for (i = 0; i < pctx.wshards; i++) {
+    pthread_mtx_lock(&wshards[i].mtx);
+    plfs_epoch = epoch;
+    pthread_cv_notifyall(&wshards[i].cv);
+    pthread_mtx_unlock(&wshards[i].mtx);
+  }
+  plfs_epoch = epoch;
+}
+
+/*
+ * epoch_flush: flush all writes of an epoch into plfsdir so plfsdir can move
+ * on to the next epoch. the flush time is recorded in mon stats.
+ */
+static void epoch_flush(int epoch, mon_ctx_t* mon) {
+  uint64_t start;
+
+  start = now_micros();
+  if (write_shards_flush(epoch, mon) != 0)
+    ABORT("fail to flush write shards");
+  if (pctx.sideft && deltafs_plfsdir_filter_flush(pctx.plfshdl) != 0)
+    ABORT("fail to flush plfsdir side filter");
+  if (pctx.sideio && deltafs_plfsdir_io_flush(pctx.plfshdl) != 0)
+    ABORT("fail to flush plfsdir side io");
+  if (deltafs_plfsdir_epoch_flush(pctx.plfshdl, epoch) != 0)
+    ABORT("fail to flush plfsdir");
+  write_shards_advance(epoch + 1);
+  mon->max_fdura = now_micros() - start;
+}
+
+namespace {
+void sample_index();
+}
+
+/*
+ * epoch flusher: with pipelined epochs, the receiver-side flush of an epoch
+ * and the dumping of its mon stats are handed to a background thread so the
+ * next epoch can begin right away. epochs are flushed in order. writes of the
+ * next epoch that reach plfsdir before the flush is done are staged in the
+ * write shards, which grow as needed so they do not wait for the flush.
+ */
+typedef struct epoch_flush_job {
+  int epoch;
+  int flush;     /* 0 if we are not a receiver and only dump mon stats */
+  mon_ctx_t mon; /* mon stats of the epoch */
+} epoch_flush_job_t;
+
+static pthread_mutex_t eflush_mtx = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t eflush_cv = PTHREAD_COND_INITIALIZER;
+static std::deque<epoch_flush_job_t*> eflush_q; /* queued or running jobs */
+static int eflush_shutdown = 0;
+static int eflush_running = 0;
+static pthread_t eflush_thread;
+
+static void* epoch_flush_main(void* arg) {
+  dir_stat_t tmp_dir_stat;
+  epoch_flush_job_t* job;
+
+  pthread_mtx_lock(&eflush_mtx);
+  while (true) {
+    if (eflush_q.empty()) {
+      if (eflush_shutdown) break;
+      pthread_cv_wait(&eflush_cv, &eflush_mtx);
+      continue;
+    }
+    job = eflush_q.front();
+    pthread_mtx_unlock(&eflush_mtx);
+
+    if (job->flush) {
+      epoch_flush(job->epoch, &job->mon);
+    }
+    /* index the name samples taken in the first epoch */
+    if (job->epoch == 0 && pctx.sampling) {
+      pthread_mtx_lock(&sample_mtx);
+      if (!sampler.indexed && sampler.n != 0) sample_index();
+      pthread_mtx_unlock(&sample_mtx);
+    }
+    memset(&tmp_dir_stat, 0, sizeof(dir_stat_t));
+    dump_mon(&job->mon, &tmp_dir_stat, &pctx.last_dir_stat);
+    if (!pctx.nomon) {
+      pctx.last_dir_stat = tmp_dir_stat;
+    }
+    delete job;
+
+    pthread_mtx_lock(&eflush_mtx);
+    eflush_q.pop_front();
+    pthread_cv_notifyall(&eflush_cv);
+  }
+  pthread_mtx_unlock(&eflush_mtx);
+
+  return NULL;
+}
+
+/*
+ * epoch_flusher_wait: wait until no more than max epochs are being flushed.
+ */
+static void epoch_flusher_wait(size_t max) {
+  pthread_mtx_lock(&eflush_mtx);
+  while (eflush_q.size() > max) {
+    pthread_cv_wait(&eflush_cv, &eflush_mtx);
+  }
+  pthread_mtx_unlock(&eflush_mtx);
+}
+
+/*
+ * epoch_flusher_add: queue an epoch for flushing in the background.
+ */
+static void epoch_flusher_add(epoch_flush_job_t* job) {
+  pthread_mtx_lock(&eflush_mtx);
+  if (!eflush_running) {
+    if (pthread_create(&eflush_thread, NULL, epoch_flush_main, NULL) != 0)
+      ABORT("pthread_create");
+    eflush_running = 1;
+  }
+  eflush_q.push_back(job);
+  pthread_cv_notifyall(&eflush_cv);
+  pthread_mtx_unlock(&eflush_mtx);
+}
+
+/*
+ * epoch_flusher_stop: wait for all queued flushes and stop the flusher.
+ */
+static void epoch_flusher_stop() {
+  pthread_mtx_lock(&eflush_mtx);
+  if (!eflush_running) {
+    pthread_mtx_unlock(&eflush_mtx);
+    return;
+  }
+  eflush_shutdown = 1;
+  pthread_cv_notifyall(&eflush_cv);
+  pthread_mtx_unlock(&eflush_mtx);
+  if (pthread_join(eflush_thread, NULL) != 0) ABORT("pthread_join");
+  eflush_running = 0;
+}
+
 /*
  * plfsdir_conf: plfsdir configurations.
  */
@@ -755,6 +1346,104 @@ static std::string& pretty_plfsdir_conf(std::string& conf) {
   return conf;
 }
 
+/*
+ * particle_write: ship a particle of the current epoch to plfsdir, either
+ * directly or through the shuffle. fname is the null-terminated particle
+ * id. dst is the shuffle destination if already known, or -1. shared by
+ * fclose and preload_write_particles. returns 0 on success.
+ */
+static int particle_write(const char* fname, size_t fname_len, char* pdata,
+                          size_t psz, int dst) {
+  static pthread_mutex_t off_mtx = PTHREAD_MUTEX_INITIALIZER;
+  static uint64_t off = 0;
+  uint64_t myoff;
+  ssize_t n;
+  char* data;
+  size_t data_len;
+  int rv;
+
+  n = 0;
+
+  if (pctx.paranoid_checks) {
+    if (pctx.particle_id_size != fname_len) {
+      ABORT("bad particle id size");
+    }
+    if (pctx.particle_size != psz) {
+      ABORT("bad particle size");
+    }
+  }
+
+  if (pctx.sideft) { /* switch to the bloomy fmt */
+    if (IS_BYPASS_WRITE(pctx.mode)) {
+      /* noop */
+
+    } else if (IS_BYPASS_DELTAFS_NAMESPACE(pctx.mode)) {
+      assert(pctx.plfshdl != NULL);
+      pthread_mtx_lock(&write_mtx);
+      n = deltafs_plfsdir_append(pctx.plfshdl, fname, num_eps - 1, pdata,
+                                 psz);
+      pthread_mtx_unlock(&write_mtx);
+      if (n != psz) {
+        ABORT("plfsdir write failed");
+      }
+    } else {
+      ABORT("not implemented");
+    }
+
+    data_len = 0;
+    data = NULL;
+
+  } else if (pctx.sideio) { /* switch to the wisc-key fmt */
+    if (IS_BYPASS_WRITE(pctx.mode)) {
+      myoff = off; /* noop */
+
+    } else if (IS_BYPASS_DELTAFS_NAMESPACE(pctx.mode)) {
+      assert(pctx.plfshdl != NULL);
+      /* keep off in step with the sideio log when threads dump at once */
+      pthread_mtx_lock(&off_mtx);
+      pthread_mtx_lock(&write_mtx);
+      n = deltafs_plfsdir_io_append(pctx.plfshdl, pdata, psz);
+      pthread_mtx_unlock(&write_mtx);
+      if (n != psz) {
+        ABORT("plfsdir sideio write failed");
+      }
+      off += n;
+      myoff = off;
+      pthread_mtx_unlock(&off_mtx);
+
+    } else {
+      ABORT("not implemented");
+    }
+
+    data_len = sizeof(myoff);
+    data = reinterpret_cast<char*>(&myoff);
+
+  } else { /* use the default fmt */
+    data_len = psz;
+    data = pdata;
+  }
+
+  if (!IS_BYPASS_SHUFFLE(pctx.mode)) {
+    if (dst != -1) {
+      rv = shuffle_write_to(&pctx.sctx, fname, fname_len, data, data_len,
+                            num_eps - 1, dst);
+    } else {
+      rv = shuffle_write(&pctx.sctx, fname, fname_len, data, data_len,
+                         num_eps - 1);
+    }
+    if (rv) {
+      ABORT("plfsdir shuffler write failed");
+    }
+  } else {
+    rv = native_write(fname, fname_len, data, data_len, num_eps - 1);
+    if (rv) {
+      ABORT("plfsdir write failed");
+    }
+  }
+
+  return rv;
+}
+
 /*
  * here are the actual override functions from libc...
  */
@@ -944,6 +1633,8 @@ int MPI_Init(int* argc, char*** argv) {
 #ifndef NDEBUG
     check_sse42();
 #endif
+    logf(LOG_INFO, "[sse] batched name hashing uses %s",
+         xxhash32_batch_impl());
   }
 
   if (pctx.my_rank == 0) {
@@ -1126,6 +1817,18 @@ int MPI_Init(int* argc, char*** argv) {
             }
           }
 
+          write_shards_init();
+          if (pctx.my_rank == 0) {
+            logf(LOG_INFO, "write shards: %d (%s staging buf per shard)",
+                 pctx.wshards, pretty_size(pctx.wshard_buf).c_str());
+            if (pctx.epoch_pipeline > 0) {
+              logf(LOG_INFO,
+                   "pipelined epochs: up to %d epoch flushes in the "
+                   "background",
+                   pctx.epoch_pipeline);
+            }
+          }
+
           if (pctx.my_rank == 0) {
             if (pctx.verbose) {
               pretty_plfsdir_conf(conf);
@@ -1377,6 +2080,25 @@ int MPI_Finalize(void) {
           fprintf(f0, "particle_size=%d\n", pctx.particle_size);
           fprintf(f0, "io_engine=%d\n", dirc.io_engine);
           fprintf(f0, "comm_sz=%d\n", pctx.recv_sz);
+          fprintf(f0, "world_sz=%d\n", pctx.comm_sz);
+          fprintf(f0, "recv_rate=%u\n", pctx.sctx.receiver_rate);
+          fprintf(f0, "redirect_stride=%d\n",
+                  pctx.sctx.redirect ? pctx.sctx.redirect_stride : 0);
+          /* one line per receiver, in partition order */
+          for (int i = 0; i < pctx.sctx.num_weights; i++)
+            fprintf(f0, "recv_weight=%.6g %llu\n", pctx.sctx.weights[i],
+                    pctx.sctx.wbounds[i]);
+          /* each set of range pivots, headed by the epoch it took effect */
+          for (int i = 0;; i++) {
+            const uint64_t* pivots;
+            int epoch;
+            int n = shuffle_range_pivots(&pctx.sctx, i, &epoch, &pivots);
+            if (n < 0) break;
+            fprintf(f0, "range_epoch=%d\n", epoch);
+            for (int j = 0; j < n; j++)
+              fprintf(f0, "range_pivot=%llu\n",
+                      static_cast<unsigned long long>(pivots[j]));
+          }
           if (pctx.sideft)
             fprintf(f0, "fmt=bloomy\n");
           else if (pctx.sideio)
@@ -1420,6 +2142,9 @@ int MPI_Finalize(void) {
       }
     }
 
+    /* wait for epochs still being flushed in the background */
+    epoch_flusher_stop();
+
     /* all writes are concluded, do the last flush, finish the directory,
      * retrieve final mon stats, and free the directory. note that the mon stats
      * must be retrieved before the directory is destroyed. */
@@ -1428,6 +2153,8 @@ int MPI_Finalize(void) {
       if (pctx.my_rank == 0) {
         logf(LOG_INFO, "finalizing plfsdir ... (rank 0)");
       }
+      if (write_shards_flush(num_eps - 1, &pctx.mctx) != 0)
+        ABORT("fail to flush write shards");
       if (pctx.sideft) deltafs_plfsdir_filter_finish(pctx.plfshdl);
       if (pctx.sideio) deltafs_plfsdir_io_finish(pctx.plfshdl);
       deltafs_plfsdir_finish(pctx.plfshdl);
@@ -1451,6 +2178,7 @@ int MPI_Finalize(void) {
           pctx.plfshdl, "io.total_bytes_read");
 
       deltafs_plfsdir_free_handle(pctx.plfshdl);
+      write_shards_destroy();
       if (pctx.plfsenv != NULL) {
         deltafs_env_close(pctx.plfsenv);
         pctx.plfsenv = NULL;
@@ -1491,11 +2219,10 @@ int MPI_Finalize(void) {
 
     /* conclude sampling */
     if (pctx.sampling && pctx.recv_comm != MPI_COMM_NULL) {
-      num_samples[0] = num_samples[1] = 0;
-      for (std::map<std::string, int>::const_iterator it = pctx.smap->begin();
-           it != pctx.smap->end(); ++it) {
-        num_samples[0]++; /* number samples */
-        if (it->second == num_eps) {
+      num_samples[0] = sampler.n; /* number samples */
+      num_samples[1] = 0;
+      for (size_t i = 0; i < sampler.n; i++) {
+        if (sampler.hits[i] == static_cast<uint32_t>(num_eps)) {
           num_samples[1]++; /* number valid samples */
         }
       }
@@ -1519,18 +2246,15 @@ int MPI_Finalize(void) {
         if (f0 != NULL) {
           if (pctx.my_rank == 0 && pctx.verbose)
             fputs("dumped names = (\n    ...\n", stderr);
-          for (std::map<std::string, int>::const_iterator it =
-                   pctx.smap->begin();
-               it != pctx.smap->end(); ++it) {
-            if (it->second == num_eps) {
-              fprintf(f0, "%s\n", it->first.c_str());
+          for (size_t i = 0; i < sampler.n; i++) {
+            if (sampler.hits[i] == static_cast<uint32_t>(num_eps)) {
+              const char* id = sampler.ids + i * pctx.particle_id_size;
+              fprintf(f0, "%.*s\n", pctx.particle_id_size, id);
 
               num_names++;
               if (pctx.my_rank == 0 && pctx.verbose) {
                 if (num_names <= 7) {
-                  fputs(" !! ", stderr);
-                  fputs(it->first.c_str(), stderr);
-                  fputc('\n', stderr);
+                  fprintf(stderr, " !! %.*s\n", pctx.particle_id_size, id);
                 }
               }
             }
@@ -1688,6 +2412,23 @@ int MPI_Finalize(void) {
                          .c_str(),
                      pretty_num(min_writes).c_str(),
                      pretty_num(max_writes).c_str());
+                if (glob.min_nrw != ULLONG_MAX && glob.min_nrw != 0) {
+                  logf(LOG_INFO,
+                       "               > per receiver: min %s, max %s "
+                       "(max/min: %.3f)",
+                       pretty_num(glob.min_nrw).c_str(),
+                       pretty_num(glob.max_nrw).c_str(),
+                       double(glob.max_nrw) / glob.min_nrw);
+                }
+                if (glob.nwb != 0) {
+                  logf(LOG_INFO,
+                       "               > %s write batches, %s writes per "
+                       "batch (%s lock contentions)",
+                       pretty_num(glob.nwb).c_str(),
+                       pretty_num(double(glob.nfw + glob.nlw) / glob.nwb)
+                           .c_str(),
+                       pretty_num(glob.nwc).c_str());
+                }
                 if (glob.dir_stat.num_sstables != 0) {
                   logf(LOG_INFO,
                        "     > %s sst data (+%.3f%%), %s sst indexes (+%.3f%%),"
@@ -1798,6 +2539,30 @@ int MPI_Finalize(void) {
                                    pctx.comm_sz)
                            .c_str());
                 }
+                if (glob.zrb != 0) {
+                  logf(LOG_INFO,
+                       "   > rpc compression: %s -> %s (%.3f%%), cpu: %s "
+                       "compress, %s decompress",
+                       pretty_size(glob.zrb).c_str(),
+                       pretty_size(glob.zcb).c_str(),
+                       100.0 * glob.zcb / glob.zrb,
+                       pretty_dura(glob.zcu).c_str(),
+                       pretty_dura(glob.zdu).c_str());
+                }
+                if (glob.nqm != 0) {
+                  logf(LOG_INFO,
+                       "   > rpc queue memory: %s per rank (max: %s), "
+                       "%s queues flushed early",
+                       pretty_size(double(glob.nqm) / pctx.comm_sz).c_str(),
+                       pretty_size(glob.max_nqm).c_str(),
+                       pretty_num(glob.nqe).c_str());
+                }
+                if (glob.nbar != 0) {
+                  logf(LOG_INFO,
+                       "   > barrier wait: %s per barrier (max: %s)",
+                       pretty_dura(double(glob.bar_wait) / glob.nbar).c_str(),
+                       pretty_dura(glob.max_bar_wait).c_str());
+                }
               }
             }
           } else {
@@ -1976,7 +2741,16 @@ int opendir_impl(const char* dir) {
     }
   }
 
-  if (pctx.paranoid_barrier) {
+  if (!IS_BYPASS_SHUFFLE(pctx.mode) && pctx.sctx.markers) {
+    if (num_eps != 0) {
+      /*
+       * end-of-epoch markers tell us when we have received all peer writes
+       * for the previous epoch so we can move on without waiting for
+       * peers that are still receiving theirs.
+       */
+      shuffle_epoch_wait(&pctx.sctx, num_eps - 1);
+    }
+  } else if (pctx.paranoid_barrier) {
     if (num_eps != 0) {
       /*
        * this ensures we have received all peer writes and no more
@@ -2012,7 +2786,26 @@ int opendir_impl(const char* dir) {
    * until shuffle finishes processing all data coming to it. now it's time to
    * flush writes.
    */
-  if (num_eps != 0 && pctx.recv_comm != MPI_COMM_NULL) {
+  if (num_eps != 0 && pctx.epoch_pipeline > 0) {
+    /*
+     * hand the flush of the previous epoch to the background and move on.
+     * we only block if too many epochs are still being flushed.
+     */
+    flush_start = now_micros();
+    epoch_flusher_wait(size_t(pctx.epoch_pipeline - 1));
+    flush_end = now_micros();
+    epoch_flush_job_t* const job = new epoch_flush_job_t;
+    job->epoch = num_eps - 1;
+    job->flush = pctx.recv_comm != MPI_COMM_NULL && pctx.plfshdl != NULL;
+    job->mon = pctx.mctx;
+    job->mon.max_fwait = flush_end - flush_start;
+    epoch_flusher_add(job);
+    if (pctx.my_rank == 0) {
+      logf(LOG_INFO, "epoch flush queued (waited %s)",
+           pretty_dura(flush_end - flush_start).c_str());
+    }
+
+  } else if (num_eps != 0 && pctx.recv_comm != MPI_COMM_NULL) {
     /*
      * the reason write flush is deferred from as early as closedir()
      * time until now is that i am likely to progress faster than
@@ -2030,12 +2823,7 @@ int opendir_impl(const char* dir) {
           logf(LOG_INFO, "flushing plfsdir ... (rank 0)");
         }
 
-        if (pctx.sideft && deltafs_plfsdir_filter_flush(pctx.plfshdl) != 0)
-          ABORT("fail to flush plfsdir side filter");
-        if (pctx.sideio && deltafs_plfsdir_io_flush(pctx.plfshdl) != 0)
-          ABORT("fail to flush plfsdir side io");
-        if (deltafs_plfsdir_epoch_flush(pctx.plfshdl, num_eps - 1) != 0)
-          ABORT("fail to flush plfsdir");
+        epoch_flush(num_eps - 1, &pctx.mctx);
         if (pctx.my_rank == 0) {
           flush_end = now_micros();
           logf(LOG_INFO, "flushing done %s",
@@ -2061,7 +2849,7 @@ int opendir_impl(const char* dir) {
     }
   }
 
-  if (num_eps != 0) {
+  if (num_eps != 0 && pctx.epoch_pipeline == 0) {
     /*
      * we delay dumping mon stats collected from the previous epoch
      * until the beginning of the next epoch. this allows us
@@ -2081,8 +2869,9 @@ int opendir_impl(const char* dir) {
 
     pctx.epoch_start = start; /* record epoch start */
 
-    /* take a snapshot of dir stats */
-    pctx.last_dir_stat = tmp_dir_stat;
+    /* take a snapshot of dir stats. with pipelined epochs, this is done by
+     * the epoch flusher */
+    if (pctx.epoch_pipeline == 0) pctx.last_dir_stat = tmp_dir_stat;
     /* take a snapshot of sys usage */
     pctx.last_sys_usage_snaptime = now_micros();
     rv = getrusage(RUSAGE_SELF, &pctx.last_sys_usage);
@@ -2107,7 +2896,13 @@ int opendir_impl(const char* dir) {
 #endif
 
   /* mon status resets and epoch increments must go before the barrier */
-  if (pctx.paranoid_post_barrier) {
+  if (!IS_BYPASS_SHUFFLE(pctx.mode) && pctx.sctx.markers) {
+    /*
+     * no barrier needed. writes peers sent ahead of us for the new epoch
+     * have been parked by the shuffle and are processed now.
+     */
+    shuffle_epoch_open(&pctx.sctx, num_eps - 1);
+  } else if (pctx.paranoid_post_barrier) {
     /*
      * this ensures that all data and mon status updates made
      * for the next epoch will go to that epoch.
@@ -2123,7 +2918,7 @@ int opendir_impl(const char* dir) {
    * restart paranoid checking status. this is sender-local status
    * so no need for any barrier synchronization.
    */
-  pctx.fnames->clear();
+  fname_set_clear(pctx.fnames);
 
   return 0;
 }
@@ -2157,6 +2952,7 @@ DIR* opendir(const char* dir) {
  */
 int closedir_impl(DIR* dirp) {
   uint64_t tmp_usage_snaptime;
+  int nopen;
   struct rusage tmp_usage;
   uint64_t flush_start;
   uint64_t flush_end;
@@ -2165,12 +2961,13 @@ int closedir_impl(DIR* dirp) {
 
   if (pctx.my_rank == 0) logf(LOG_INFO, "dumping done!!!");
 
+  nopen = stock_files_fold();
   if (pctx.paranoid_checks) {
     assert(pctx.isdeltafs != NULL);
-    if (!pctx.isdeltafs->empty()) {
+    if (!pctx.isdeltafs->empty() || nopen != 0) {
       ABORT("some plfsdir files still open!");
     }
-    pctx.fnames->clear();
+    fname_set_clear(pctx.fnames);
   }
 
   /*
@@ -2182,7 +2979,7 @@ int closedir_impl(DIR* dirp) {
       flush_start = now_micros();
       logf(LOG_INFO, "flushing shuffle senders ... (rank 0)");
     }
-    shuffle_epoch_end(&pctx.sctx); /* shuffle sender flush */
+    shuffle_epoch_end(&pctx.sctx, num_eps - 1); /* shuffle sender flush */
     if (pctx.my_rank == 0) {
       flush_end = now_micros();
       logf(LOG_INFO, "sender flushing done %s",
@@ -2194,9 +2991,11 @@ int closedir_impl(DIR* dirp) {
    * i'm a receiver (or a representative of a set of receivers). the barrier
    * below ensures that i have received all data belong to me (and the peers i
    * represent). the barrier below is required if bg pause is ON. the barrier
-   * below is rather useless if shuffle is OFF.
+   * below is rather useless if shuffle is OFF. with epoch markers, the next
+   * opendir() learns by itself when all data has arrived so we skip it.
    */
-  if (pctx.paranoid_pre_barrier ||
+  if ((pctx.paranoid_pre_barrier &&
+       (IS_BYPASS_SHUFFLE(pctx.mode) || !pctx.sctx.markers)) ||
       (!IS_BYPASS_SHUFFLE(pctx.mode) && pctx.bgpause)) {
     PRELOAD_Barrier(MPI_COMM_WORLD);
     /*
@@ -2236,6 +3035,9 @@ int closedir_impl(DIR* dirp) {
           logf(LOG_INFO, "pre-flushing plfsdir ... (rank 0)");
         }
 
+        if (pctx.epoch_pipeline > 0) epoch_flusher_wait(0);
+        if (write_shards_flush(num_eps - 1, &pctx.mctx) != 0)
+          ABORT("fail to flush write shards");
         if (pctx.sideio && deltafs_plfsdir_io_flush(pctx.plfshdl) != 0)
           ABORT("fail to flush plfsdir side io");
         if (deltafs_plfsdir_flush(pctx.plfshdl, num_eps - 1) != 0)
@@ -2399,29 +3201,41 @@ FILE* fopen(const char* fpath, const char* mode) {
     stripped = (exact) ? "/" : (fpath + pctx.len_deltafs_mntp);
   }
 
+  if (my_stock_file == NULL && num_stock_files < MAX_STOCK_FILES) {
+    int idx = __sync_fetch_and_add(&num_stock_files, 1);
+    if (idx < MAX_STOCK_FILES) {
+      my_stock_file = &stock_files[idx];
+    }
+  }
+
+  if (my_stock_file != NULL && !my_stock_file->busy) { /* fast path */
+    if (pctx.paranoid_checks) {
+      /* checked against other threads when stock files are folded */
+      fname = stripped + pctx.len_plfsdir + 1;
+      my_stock_file->ncw +=
+          fname_set_add(&my_stock_file->names, fname, strlen(fname));
+    }
+    my_stock_file->nw++;
+    my_stock_file->busy = 1;
+    my_stock_file->reset(stripped);
+    return reinterpret_cast<FILE*>(my_stock_file);
+  }
+
   pthread_mtx_lock(&preload_mtx);
   if (pctx.paranoid_checks) {
     fname = stripped + pctx.len_plfsdir + 1;
-    if (pctx.fnames->count(fname) == 0) {
-      pctx.fnames->insert(fname);
-    } else {
-      pctx.mctx.ncw++;
-    }
+    pctx.mctx.ncw += fname_set_add(pctx.fnames, fname, strlen(fname));
   }
   pctx.mctx.min_nw++;
   pctx.mctx.max_nw++;
   pctx.mctx.nw++;
-  if (stock_file == NULL) {
-    rv = reinterpret_cast<FILE*>(new fake_file(stripped));
+  rv = reinterpret_cast<FILE*>(new fake_file(stripped));
+  if (my_stock_file != NULL) {
     logf(LOG_WARN, "VPIS IS OPENING MULTIPLE PLFSDIR FILES SIMULTANEOUSLY!");
-    assert(pctx.isdeltafs != NULL);
-    pctx.isdeltafs->insert(rv);
-  } else {
-    assert(stock_file == &the_stock_file);
-    stock_file->reset(stripped);
-    rv = reinterpret_cast<FILE*>(stock_file);
-    stock_file = NULL;
   }
+  assert(pctx.isdeltafs != NULL);
+  pctx.isdeltafs->insert(rv);
+  num_heap_files++;
 
   pthread_mtx_unlock(&preload_mtx);
 
@@ -2477,12 +3291,8 @@ int fputc(int character, FILE* stream) {
  * fclose.   returns EOF on error.
  */
 int fclose(FILE* stream) {
-  static uint64_t off = 0;
-  ssize_t n;
   const char* fname;
   size_t fname_len;
-  char* data;
-  size_t data_len;
   int rv;
 
   rv = pthread_once(&init_once, preload_init);
@@ -2495,7 +3305,6 @@ int fclose(FILE* stream) {
   fake_file* const ff = reinterpret_cast<fake_file*>(stream);
   fname = ff->file_name();
   assert(fname != NULL);
-  n = 0;
 
   /* check file path and remove parent directories */
   assert(pctx.len_plfsdir != 0 && pctx.plfsdir != NULL);
@@ -2506,83 +3315,94 @@ int fclose(FILE* stream) {
   /* obtain filename length */
   fname_len = strlen(fname);
 
-  if (pctx.paranoid_checks) {
-    if (pctx.particle_id_size != fname_len) {
-      ABORT("bad particle id size");
-    }
-    if (pctx.particle_size != ff->size()) {
-      ABORT("bad particle size");
-    }
-  }
+  rv = particle_write(fname, fname_len, ff->data(), ff->size(), -1);
 
-  if (pctx.sideft) { /* switch to the bloomy fmt */
-    if (IS_BYPASS_WRITE(pctx.mode)) {
-      /* noop */
-
-    } else if (IS_BYPASS_DELTAFS_NAMESPACE(pctx.mode)) {
-      assert(pctx.plfshdl != NULL);
-      n = deltafs_plfsdir_append(pctx.plfshdl, fname, num_eps - 1, ff->data(),
-                                 ff->size());
-      if (n != ff->size()) {
-        ABORT("plfsdir write failed");
-      }
-    } else {
-      ABORT("not implemented");
-    }
-
-    data_len = 0;
-    data = NULL;
+  if (is_stock_file(ff)) {
+    ff->busy = 0; /* to be reused */
+  } else {
+    pthread_mtx_lock(&preload_mtx);
+    assert(pctx.isdeltafs != NULL);
+    pctx.isdeltafs->erase(stream);
+    num_heap_files--;
+    delete ff;
+    pthread_mtx_unlock(&preload_mtx);
+  }
 
-  } else if (pctx.sideio) { /* switch to the wisc-key fmt */
-    if (IS_BYPASS_WRITE(pctx.mode)) {
-      /* noop */
+  return rv;
+}
 
-    } else if (IS_BYPASS_DELTAFS_NAMESPACE(pctx.mode)) {
-      assert(pctx.plfshdl != NULL);
-      n = deltafs_plfsdir_io_append(pctx.plfshdl, ff->data(), ff->size());
-      if (n != ff->size()) {
-        ABORT("plfsdir sideio write failed");
-      }
+/*
+ * max number of particles placed at a time by preload_write_particles
+ */
+#define PARTICLE_BATCH_GROUP 256
 
-    } else {
-      ABORT("not implemented");
-    }
+/*
+ * preload_write_particles: the fopen/fwrite/fclose sequence for n
+ * particles at once. returns EOF on error.
+ */
+int preload_write_particles(const char* ids, unsigned char id_sz,
+                            const char* data, unsigned char data_len,
+                            size_t n, int epoch) {
+  char* names[PARTICLE_BATCH_GROUP];
+  int dsts[PARTICLE_BATCH_GROUP];
+  char fname[256];
+  size_t i;
+  size_t j;
+  size_t m;
+  int rv;
 
-    data_len = sizeof(off);
-    data = reinterpret_cast<char*>(&off);
-    off += n;
+  rv = pthread_once(&init_once, preload_init);
+  if (rv) ABORT("pthread_once");
 
-  } else { /* use the default fmt */
-    data_len = ff->size();
-    data = ff->data();
+  if (pctx.plfsdir == NULL || num_eps == 0 ||
+      (epoch != -1 && epoch != num_eps - 1)) {
+    errno = EINVAL;
+    return EOF;
   }
 
-  if (!IS_BYPASS_SHUFFLE(pctx.mode)) {
-    rv = shuffle_write(&pctx.sctx, fname, fname_len, data, data_len,
-                       num_eps - 1);
-    if (rv) {
-      ABORT("plfsdir shuffler write failed");
-    }
-  } else {
-    rv = native_write(fname, fname_len, data, data_len, num_eps - 1);
-    if (rv) {
-      ABORT("plfsdir write failed");
-    }
+  /* the particle format is fixed when the dir is opened */
+  if (id_sz != pctx.particle_id_size || data_len != pctx.particle_size) {
+    errno = EINVAL;
+    return EOF;
   }
 
   pthread_mtx_lock(&preload_mtx);
-
-  if (ff == &the_stock_file) {
-    stock_file = &the_stock_file; /* to be reused*/
-  } else {
-    assert(pctx.isdeltafs != NULL);
-    pctx.isdeltafs->erase(stream);
-    delete ff;
+  if (pctx.paranoid_checks) {
+    for (i = 0; i < n; i++) {
+      pctx.mctx.ncw += fname_set_add(pctx.fnames, ids + i * id_sz, id_sz);
+    }
   }
-
+  pctx.mctx.min_nw += n;
+  pctx.mctx.max_nw += n;
+  pctx.mctx.nw += n;
   pthread_mtx_unlock(&preload_mtx);
 
-  return rv;
+  /* place particles a group at a time so ids can be hashed in batches */
+  for (i = 0; i < n; i += m) {
+    m = std::min(n - i, size_t(PARTICLE_BATCH_GROUP));
+    if (!IS_BYPASS_SHUFFLE(pctx.mode) && id_sz == pctx.sctx.fname_len) {
+      for (j = 0; j < m; j++) {
+        names[j] = const_cast<char*>(ids) + (i + j) * id_sz;
+      }
+      shuffle_target_batch(&pctx.sctx, names, int(m), dsts);
+    } else {
+      for (j = 0; j < m; j++) {
+        dsts[j] = -1;
+      }
+    }
+    for (j = 0; j < m; j++) {
+      memcpy(fname, ids + (i + j) * id_sz, id_sz);
+      fname[id_sz] = 0;
+      rv = particle_write(fname, id_sz,
+                          const_cast<char*>(data) + (i + j) * data_len,
+                          data_len, dsts[j]);
+      if (rv) {
+        return EOF;
+      }
+    }
+  }
+
+  return 0;
 }
 
 /*
@@ -2734,44 +3554,245 @@ long ftell(FILE* stream) {
 
 } /* extern "C" */
 
+namespace {
+/*
+ * sample_index: build the hash index over the reservoir. caller must hold
+ * sample_mtx.
+ */
+void sample_index() {
+  size_t sz;
+  size_t i;
+  size_t j;
+
+  sz = 64;
+  while (sz < 2 * sampler.n) sz <<= 1;
+  sampler.table = static_cast<uint32_t*>(calloc(sz, sizeof(uint32_t)));
+  if (sampler.table == NULL) {
+    ABORT("malloc");
+  }
+  sampler.mask = sz - 1;
+  for (i = 0; i < sampler.n; i++) {
+    j = pdlfs::xxhash64(sampler.ids + i * pctx.particle_id_size,
+                        pctx.particle_id_size, 0) &
+        sampler.mask;
+    while (sampler.table[j] != 0) j = (j + 1) & sampler.mask;
+    sampler.table[j] = static_cast<uint32_t>(i + 1);
+  }
+  __sync_synchronize();
+  sampler.indexed = 1;
+}
+
+/*
+ * sample_name: sample a particle name.
+ */
+void sample_name(const char* fname, unsigned char fname_len) {
+  const size_t idsz = pctx.particle_id_size;
+  uint64_t r;
+  size_t i;
+
+  if (fname_len != idsz) {
+    return; /* not a particle name we know how to keep */
+  } else if (num_eps == 1) {
+    /* during the initial epoch, we pick names by reservoir sampling */
+    pthread_mtx_lock(&sample_mtx);
+    if (sampler.ids == NULL) {
+      sampler.cap = pctx.ssize;
+      if (sampler.cap == 0) { /* derive from the expected particle count */
+        sampler.cap = 1ULL * pctx.particle_count * pctx.sthres / 1000000;
+        if (sampler.cap == 0) sampler.cap = DEFAULT_SAMPLE_SIZE;
+      }
+      sampler.ids = static_cast<char*>(malloc(sampler.cap * idsz));
+      sampler.hits =
+          static_cast<uint32_t*>(malloc(sampler.cap * sizeof(uint32_t)));
+      if (sampler.ids == NULL || sampler.hits == NULL) {
+        ABORT("malloc");
+      }
+    }
+    i = sampler.n;
+    if (i == sampler.cap) {
+      r = fast_rand() % (sampler.seen + 1);
+      i = (r < sampler.cap) ? r : sampler.cap;
+    } else {
+      sampler.n++;
+    }
+    if (i < sampler.cap) {
+      memcpy(sampler.ids + i * idsz, fname, idsz);
+      sampler.hits[i] = 1;
+    }
+    sampler.seen++;
+    pthread_mtx_unlock(&sample_mtx);
+  } else if (sampler.n != 0) {
+    if (!sampler.indexed) {
+      pthread_mtx_lock(&sample_mtx);
+      if (!sampler.indexed) sample_index();
+      pthread_mtx_unlock(&sample_mtx);
+    }
+    i = pdlfs::xxhash64(fname, idsz, 0) & sampler.mask;
+    while (sampler.table[i] != 0) {
+      if (memcmp(sampler.ids + (sampler.table[i] - 1) * idsz, fname, idsz) ==
+          0) {
+        __sync_fetch_and_add(&sampler.hits[sampler.table[i] - 1], 1);
+        break;
+      }
+      i = (i + 1) & sampler.mask;
+    }
+  }
+}
+
+/*
+ * check_write: verify the format of an incoming write.
+ */
+void check_write(const char* fname, unsigned char fname_len,
+                 unsigned char data_len, int epoch) {
+  if (fname_len != strlen(fname)) {
+    ABORT("bad particle filename length");
+  }
+  if (fname_len != pctx.particle_id_size || data_len != pctx.particle_size) {
+    ABORT("bad particle format");
+  }
+  if (epoch != num_eps - 1) {
+    ABORT("bad epoch num");
+  }
+}
+
+/*
+ * write_shard_of: return the write shard a particle belongs to.
+ */
+inline int write_shard_of(const char* fname, unsigned char fname_len) {
+  return pdlfs::xxhash32(fname, fname_len, WRITE_SHARD_SEED) % pctx.wshards;
+}
+
+/*
+ * write_shard_add: add a write into a shard. caller must hold the shard lock.
+ * return 0 on success, or EOF on errors.
+ */
+int write_shard_add(write_shard_t* ws, const char* fname,
+                    unsigned char fname_len, char* data, unsigned char data_len,
+                    int epoch, int src) {
+  char buf[12];
+  int rv;
+
+  if (!pctx.sideft && pctx.sideio) { /* use the wisc-key fmt */
+    memcpy(buf, &src, 4);
+    assert(data_len == 8);
+    memcpy(buf + 4, data, 8);
+    data_len = 12;
+    data = buf;
+  }
+
+  rv = 0;
+  if (ws->nrecs != 0 && ws->epoch != epoch) {
+    rv = write_shard_flush(ws);
+  }
+  if (write_shard_put(ws, fname, fname_len, data, data_len, epoch, src) != 0) {
+    if (pctx.epoch_pipeline > 0 && epoch > plfs_epoch) {
+      /* plfsdir is still flushing the previous epoch. stage more rather
+       * than wait, as these may be parked writes replayed by the main
+       * thread when it opens the epoch */
+      write_shard_grow(ws, write_shard_recsz(fname_len, data_len));
+    } else if (write_shard_flush(ws) != 0) {
+      rv = EOF;
+    }
+    /* write through if staging is off or the shard filled up again */
+    if (write_shard_put(ws, fname, fname_len, data, data_len, epoch, src) !=
+        0) {
+      write_shard_gate(ws, epoch);
+      pthread_mtx_lock(&write_mtx);
+      if (write_shard_append(fname, fname_len, data, data_len, epoch, src) !=
+          0) {
+        rv = EOF;
+      }
+      pthread_mtx_unlock(&write_mtx);
+    }
+  }
+
+  return rv;
+}
+
+/*
+ * write_shard_lock: lock a write shard and count contentions.
+ */
+inline void write_shard_lock(write_shard_t* ws) {
+  if (pthread_mutex_trylock(&ws->mtx) != 0) {
+    pthread_mtx_lock(&ws->mtx);
+    ws->nwaits++;
+  }
+}
+}  // namespace
+
 /*
  * preload_write
  */
 int preload_write(const char* fname, unsigned char fname_len, char* data,
                   unsigned char data_len, int epoch, int src) {
-  ssize_t n;
-  char buf[12];
+  write_shard_t* ws;
   int rv;
 
   if (epoch == -1) {
     epoch = num_eps - 1;
   }
 
-  pthread_mtx_lock(&write_mtx);
+  if (pctx.paranoid_checks) {
+    check_write(fname, fname_len, data_len, epoch);
+  }
+
+  if (pctx.sampling) {
+    sample_name(fname, fname_len);
+  }
+
+  rv = 0;
+
+  if (IS_BYPASS_WRITE(pctx.mode)) {
+    /* noop */
+
+  } else if (IS_BYPASS_DELTAFS_NAMESPACE(pctx.mode)) {
+    assert(wshards != NULL);
+    ws = &wshards[write_shard_of(fname, fname_len)];
+    write_shard_lock(ws);
+    rv = write_shard_add(ws, fname, fname_len, data, data_len, epoch, src);
+    pthread_mtx_unlock(&ws->mtx);
+
+  } else {
+    ABORT("not implemented");
+  }
+
+  return rv;
+}
+
+/*
+ * max number of writes grouped by shards at a time
+ */
+#define WRITE_BATCH_GROUP 256
+
+/*
+ * preload_write_batch
+ */
+int preload_write_batch(char* const* recs, const int* srcs, int n,
+                        unsigned char fname_len, unsigned char data_len,
+                        int epoch) {
+  uint32_t hash[WRITE_BATCH_GROUP];
+  int shard[WRITE_BATCH_GROUP];
+  char done[WRITE_BATCH_GROUP];
+  write_shard_t* ws;
+  int rv;
+  int i;
+  int j;
+  int k;
+  int m;
+
+  if (epoch == -1) {
+    epoch = num_eps - 1;
+  }
 
   if (pctx.paranoid_checks) {
-    if (fname_len != strlen(fname)) {
-      ABORT("bad particle filename length");
-    }
-    if (fname_len != pctx.particle_id_size || data_len != pctx.particle_size) {
-      ABORT("bad particle format");
-    }
-    if (epoch != num_eps - 1) {
-      ABORT("bad epoch num");
+    for (i = 0; i < n; i++) {
+      check_write(recs[i], fname_len, data_len, epoch);
     }
   }
 
   if (pctx.sampling) {
-    assert(pctx.smap != NULL);
-    if (num_eps == 1) {
-      /* during the initial epoch, we accept as many names as possible */
-      if (getr(0, 1000000 - 1) < pctx.sthres) {
-        pctx.smap->insert(std::make_pair(fname, 1));
-      }
-    } else {
-      if (pctx.smap->count(fname) != 0) {
-        pctx.smap->at(fname)++;
-      }
+    for (i = 0; i < n; i++) {
+      sample_name(recs[i], fname_len);
     }
   }
 
@@ -2781,20 +3802,29 @@ int preload_write(const char* fname, unsigned char fname_len, char* data,
     /* noop */
 
   } else if (IS_BYPASS_DELTAFS_NAMESPACE(pctx.mode)) {
-    if (pctx.sideft) { /* use the bloomy fmt */
-      rv = deltafs_plfsdir_filter_put(pctx.plfshdl, fname, fname_len, src);
-    } else {
-      if (pctx.sideio) { /* use the wisc-key fmt */
-        memcpy(buf, &src, 4);
-        assert(data_len == 8);
-        memcpy(buf + 4, data, 8);
-        data_len = 12;
-        data = buf;
+    assert(wshards != NULL);
+    /* group writes by shards so each shard is locked once per group */
+    for (i = 0; i < n; i += WRITE_BATCH_GROUP) {
+      m = std::min(n - i, WRITE_BATCH_GROUP);
+      xxhash32_batch(recs + i, m, fname_len, WRITE_SHARD_SEED, hash);
+      for (j = 0; j < m; j++) {
+        shard[j] = hash[j] % pctx.wshards;
+        done[j] = 0;
       }
-
-      n = deltafs_plfsdir_append(pctx.plfshdl, fname, epoch, data, data_len);
-      if (n != data_len) {
-        rv = EOF;
+      for (j = 0; j < m; j++) {
+        if (done[j]) continue;
+        ws = &wshards[shard[j]];
+        write_shard_lock(ws);
+        for (k = j; k < m; k++) {
+          if (done[k] || shard[k] != shard[j]) continue;
+          if (write_shard_add(ws, recs[i + k], fname_len,
+                              recs[i + k] + fname_len + 1, data_len, epoch,
+                              srcs[i + k]) != 0) {
+            rv = EOF;
+          }
+          done[k] = 1;
+        }
+        pthread_mtx_unlock(&ws->mtx);
       }
     }
 
@@ -2802,7 +3832,5 @@ int preload_write(const char* fname, unsigned char fname_len, char* data,
     ABORT("not implemented");
   }
 
-  pthread_mtx_unlock(&write_mtx);
-
   return rv;
 }
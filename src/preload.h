@@ -106,9 +106,24 @@
  *  PRELOAD_Testing
  *    Used by developers to debug code
  *  PRELOAD_Sample_threshold
+ *  PRELOAD_Sample_size
  *    Num samples per 1 million input particles
  *  PRELOAD_Skip_sampling
  *    Disable particle sampling
+ *  PRELOAD_Write_shards
+ *    Number of write shards (default: num of memtable partitions)
+ *  PRELOAD_Write_shard_buf_size
+ *    Bytes of staging buffer per write shard (0 to disable staging)
+ *  PRELOAD_Pipelined_epochs
+ *    Max num of epochs whose receiver flush may run in the background
+ *      while the next epoch is dumped (0 to flush at the epoch boundary)
+ *  PRELOAD_Mpi_wait
+ *    Max millisecs to sleep between polls of a pending barrier
+ *      (-1 to block in MPI instead of polling)
+ *  PRELOAD_Mpi_ibarrier
+ *    Use MPI_Ibarrier for barriers (no report on the slowest rank)
+ *  PRELOAD_No_barrier_progress
+ *    Do not drive shuffle progress while waiting in barriers
  *  PLFSDIR_Key_size
  *    Hash key size for encoding file names
  *  PLFSDIR_Filter_bits_per_key
@@ -144,6 +159,8 @@
 
 #pragma once
 
+#include <stddef.h>
+
 /*
  * Default tmp directory
  */
@@ -177,6 +194,35 @@
 extern int preload_write(const char* id, unsigned char id_sz, char* data,
                          unsigned char data_len, int epoch, int src);
 
+/*
+ * preload_write_batch: ship a batch of data to fs. each record is
+ * an id, a '\0', and data_len bytes of data. srcs[i] is the rank
+ * that originally wrote recs[i].
+ */
+extern int preload_write_batch(char* const* recs, const int* srcs, int n,
+                               unsigned char id_sz, unsigned char data_len,
+                               int epoch);
+
+/*
+ * preload_write_particles: write n particles to the plfsdir opened by
+ * the current epoch without going through fopen/fwrite/fclose. ids holds
+ * n packed id_sz byte particle ids and data n packed data_len byte
+ * particles. epoch must be -1 or the current epoch, and id_sz and data_len
+ * must match the particle format the dir was opened with. returns 0 on
+ * success, or EOF on errors (errno is EINVAL on bad args). the runner
+ * finds it with dlsym so it is kept extern C.
+ */
+extern "C" int preload_write_particles(const char* ids, unsigned char id_sz,
+                                       const char* data,
+                                       unsigned char data_len, size_t n,
+                                       int epoch);
+
+/*
+ * Default max number of particle names sampled per rank, used when
+ * neither PRELOAD_Sample_size nor PRELOAD_Number_particles_per_rank is set.
+ */
+#define DEFAULT_SAMPLE_SIZE 4096
+
 /*
  * Default hash key size for encoding file names.
  * Specified as a string.
@@ -36,10 +36,104 @@
 #include "preload_internal.h"
 
 #include <mpi.h>
+#include <pdlfs-common/xxhash.h>
+#include <sched.h>
+#include <stdlib.h>
+#include <string.h>
 
 /* The global preload context */
 preload_ctx_t pctx = {0};
 
+void fname_set_init(fname_set_t* set, size_t hint) {
+  set->slots = NULL;
+  set->mask = 0;
+  set->n = 0;
+  set->hint = hint;
+}
+
+namespace {
+/* keep the table at most 3/4 full */
+void fname_set_resize(fname_set_t* set, size_t sz) {
+  uint64_t* old = set->slots;
+  size_t oldsz = set->mask + 1;
+  size_t i;
+  size_t j;
+
+  set->slots = static_cast<uint64_t*>(calloc(sz, sizeof(uint64_t)));
+  if (set->slots == NULL) {
+    ABORT("malloc");
+  }
+  set->mask = sz - 1;
+  if (old != NULL) {
+    for (i = 0; i < oldsz; i++) {
+      if (old[i] != 0) {
+        j = old[i] & set->mask;
+        while (set->slots[j] != 0) j = (j + 1) & set->mask;
+        set->slots[j] = old[i];
+      }
+    }
+    free(old);
+  }
+}
+}  // namespace
+
+namespace {
+/* add a name hash, return 1 if it was already in the set */
+int fname_set_add_hash(fname_set_t* set, uint64_t h) {
+  size_t sz;
+  size_t i;
+
+  if (set->slots == NULL || 4 * (set->n + 1) > 3 * (set->mask + 1)) {
+    sz = (set->slots == NULL) ? 1024 : 2 * (set->mask + 1);
+    while (3 * sz < 4 * set->hint) sz <<= 1;
+    fname_set_resize(set, sz);
+  }
+
+  i = h & set->mask;
+  while (set->slots[i] != 0) {
+    if (set->slots[i] == h) {
+      return 1;
+    }
+    i = (i + 1) & set->mask;
+  }
+  set->slots[i] = h;
+  set->n++;
+
+  return 0;
+}
+}  // namespace
+
+int fname_set_add(fname_set_t* set, const char* name, size_t len) {
+  uint64_t h;
+
+  h = pdlfs::xxhash64(name, len, 0);
+  if (h == 0) h = 1; /* 0 marks empty slots */
+
+  return fname_set_add_hash(set, h);
+}
+
+size_t fname_set_merge(fname_set_t* dst, const fname_set_t* src) {
+  size_t ndups;
+  size_t i;
+
+  ndups = 0;
+  if (src->slots == NULL || src->n == 0) return ndups;
+  for (i = 0; i <= src->mask; i++) {
+    if (src->slots[i] != 0) {
+      ndups += fname_set_add_hash(dst, src->slots[i]);
+    }
+  }
+
+  return ndups;
+}
+
+void fname_set_clear(fname_set_t* set) {
+  if (set->slots != NULL && set->n != 0) {
+    memset(set->slots, 0, (set->mask + 1) * sizeof(uint64_t));
+  }
+  set->n = 0;
+}
+
 int exotic_write(const char* fname, unsigned char fname_len, char* data,
                  unsigned char data_len, int epoch, int src) {
   int rv;
@@ -51,13 +145,26 @@ int exotic_write(const char* fname, unsigned char fname_len, char* data,
   return rv;
 }
 
+int exotic_write_batch(char* const* recs, const int* srcs, int n,
+                       unsigned char fname_len, unsigned char data_len,
+                       int epoch) {
+  int rv;
+
+  rv = preload_write_batch(recs, srcs, n, fname_len, data_len, epoch);
+
+  pctx.mctx.nfw += n;
+
+  return rv;
+}
+
 int native_write(const char* fname, unsigned char fname_len, char* data,
                  unsigned char data_len, int epoch) {
   int rv;
 
   rv = preload_write(fname, fname_len, data, data_len, epoch, pctx.my_rank);
 
-  pctx.mctx.nlw++;
+  /* may be called by several dumping threads at once */
+  __sync_fetch_and_add(&pctx.mctx.nlw, 1);
 
   return rv;
 }
@@ -67,32 +174,96 @@ struct barrier_state {
   double time;
   int rank;
 };
+
+/* num of MPI_Test calls before we start to yield the cpu */
+#define BARRIER_SPINS 64
+/* num of sched_yield() calls before we start to sleep */
+#define BARRIER_YIELDS 64
+/* initial sleep in micros. doubled after each sleep up to mpi_wait ms */
+#define BARRIER_MIN_SLEEP 100
+
+/*
+ * barrier_wait: wait for a pending collective with an adaptive backoff. we
+ * spin on MPI_Test first, then yield the cpu, and finally sleep for
+ * increasingly longer periods. each sleep is preceded by a round of shuffle
+ * progress so the main thread still does useful work while it waits.
+ */
+void barrier_wait(MPI_Request* req) {
+  MPI_Status status;
+  useconds_t max_delay;
+  useconds_t delay;
+  int ok;
+  int i;
+
+  for (i = 0; i < BARRIER_SPINS; i++) {
+    MPI_Test(req, &ok, &status);
+    if (ok) return;
+  }
+  for (i = 0; i < BARRIER_YIELDS; i++) {
+    sched_yield();
+    MPI_Test(req, &ok, &status);
+    if (ok) return;
+  }
+  max_delay = useconds_t(pctx.mpi_wait) * 1000;
+  delay = BARRIER_MIN_SLEEP;
+  for (ok = 0; !ok;) {
+    if (pctx.barrier_progress) shuffle_progress(&pctx.sctx);
+    usleep(delay < max_delay ? delay : max_delay);
+    if (delay < max_delay) delay <<= 1;
+    MPI_Test(req, &ok, &status);
+  }
+}
+
+/* barrier_account: add a barrier wait into mon stats */
+void barrier_account(unsigned long long micros) {
+  unsigned long long limit;
+  int i;
+
+  pctx.mctx.nbar++;
+  pctx.mctx.bar_wait += micros;
+  if (micros > pctx.mctx.max_bar_wait) {
+    pctx.mctx.max_bar_wait = micros;
+  }
+  limit = 100;
+  for (i = 0; i < MON_BAR_BUCKETS - 1; i++) {
+    if (micros < limit) break;
+    limit *= 10;
+  }
+  pctx.mctx.bar_hstg[i]++;
+}
 }  // namespace
 
 void PRELOAD_Barrier(MPI_Comm comm) {
   struct barrier_state start;
   struct barrier_state min;
+  MPI_Request req;
   double dura;
-  int ok;
 
   if (pctx.my_rank == 0) {
     logf(LOG_INFO, "barrier ...\n   MPI Barrier");
   }
   start.time = MPI_Wtime();
   start.rank = pctx.my_rank;
-  if (pctx.mpi_wait >= 0) {
-    MPI_Status status;
-    MPI_Request req;
-    MPI_Iallreduce(&start, &min, 1, MPI_DOUBLE_INT, MPI_MINLOC, comm, &req);
-    for (ok = 0; !ok;) {
-      usleep(pctx.mpi_wait * 1000);
-      MPI_Test(&req, &ok, &status);
+  min = start;
+  if (pctx.mpi_wait < 0) {
+    if (pctx.mpi_ibarrier) {
+      PMPI_Barrier(comm); /* skip the app barrier counting in preload.cc */
+    } else {
+      MPI_Allreduce(&start, &min, 1, MPI_DOUBLE_INT, MPI_MINLOC, comm);
     }
   } else {
-    MPI_Allreduce(&start, &min, 1, MPI_DOUBLE_INT, MPI_MINLOC, comm);
+    if (pctx.mpi_ibarrier) {
+      MPI_Ibarrier(comm, &req);
+    } else {
+      MPI_Iallreduce(&start, &min, 1, MPI_DOUBLE_INT, MPI_MINLOC, comm, &req);
+    }
+    barrier_wait(&req);
   }
 
+  barrier_account((MPI_Wtime() - start.time) * 1000000);
+
   if (pctx.my_rank == 0) {
+    /* w/o the allreduce, min is our own start time */
     dura = MPI_Wtime() - min.time;
 #ifdef PRELOAD_BARRIER_VERBOSE
     logf(LOG_INFO, "barrier ok (\n /* rank %d waited longest */\n %s+\n)",
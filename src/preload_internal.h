@@ -52,6 +52,32 @@
 #include <set>
 #include <vector>
 
+/*
+ * fname_set: a compact set of particle names for spotting duplicate names.
+ * names are kept as 64-bit hashes in an open-addressing table, so memory is
+ * 8 bytes per slot and two different names are mistaken for each other with
+ * a probability of about n^2/2^65. the table is sized for the expected
+ * number of names and doubles if that is exceeded.
+ */
+typedef struct fname_set {
+  uint64_t* slots; /* 0 means empty */
+  size_t mask;     /* num of slots - 1 */
+  size_t n;        /* num of names in the set */
+  size_t hint;     /* expected num of names */
+} fname_set_t;
+
+/* fname_set_init: init an empty set sized for hint names on first use */
+extern void fname_set_init(fname_set_t* set, size_t hint);
+
+/* fname_set_add: add a name, return 1 if it was already in the set */
+extern int fname_set_add(fname_set_t* set, const char* name, size_t len);
+
+/* fname_set_merge: add all names of src to dst, return num already in dst */
+extern size_t fname_set_merge(fname_set_t* dst, const fname_set_t* src);
+
+/* fname_set_clear: remove all names but keep the memory */
+extern void fname_set_clear(fname_set_t* set);
+
 /*
  * preload context:
  *   - run-time state of the preload layer
@@ -71,6 +97,8 @@ typedef struct preload_ctx {
   size_t len_log_home;  /* strlen */
 
   int mpi_wait; /* number of millisecs to wait for MPI async operations */
+  int mpi_ibarrier;     /* use MPI_Ibarrier rather than MPI_Iallreduce */
+  int barrier_progress; /* drive shuffle progress while in barriers */
   int mode;     /* operating mode */
 
   int paranoid_checks; /* various checks on vpic writes */
@@ -121,15 +149,19 @@ typedef struct preload_ctx {
 #endif
 
   std::set<FILE*>* isdeltafs;    /* open files owned by deltafs */
-  std::set<std::string>* fnames; /* used for checking unique file names */
-
-  std::map<std::string, int>* smap; /* sampled particle names */
+  fname_set_t* fnames;        /* used for checking unique file names */
 
   int sthres;   /* sample threshold (num samples per 1 million input names) */
+  int ssize;    /* max num of sampled names (0 to derive from sthres) */
   int sampling; /* enable particle name sampling */
   int sideft;   /* use the bloomy format */
   int sideio;   /* use the wisc-key format */
 
+  int wshards;    /* num of write shards (0 for num of memtable partitions) */
+  int wshard_buf; /* bytes of staging buffer per write shard */
+  /* max num of epochs flushed in the background (0 for no pipelining) */
+  int epoch_pipeline;
+
   shuffle_ctx_t sctx; /* shuffle context */
 
   int testin;    /* developer mode - for debug use only */
@@ -169,6 +201,14 @@ extern preload_ctx_t pctx;
 extern int exotic_write(const char* fname, unsigned char fname_len, char* data,
                         unsigned char data_len, int epoch, int src);
 
+/*
+ * exotic_write_batch: perform a batch of writes on behalf of remote ranks.
+ * return 0 on success, or EOF on errors.
+ */
+extern int exotic_write_batch(char* const* recs, const int* srcs, int n,
+                              unsigned char fname_len, unsigned char data_len,
+                              int epoch);
+
 /*
  * native_write: perform a direct local write.
  * return 0 on success, or EOF on errors.
@@ -170,6 +170,47 @@ void mon_reduce(const mon_ctx_t* src, mon_ctx_t* sum) {
              MPI_UNSIGNED_LONG_LONG, MPI_MIN, 0, MPI_COMM_WORLD);
   MPI_Reduce(const_cast<unsigned long long*>(&src->max_nw), &sum->max_nw, 1,
              MPI_UNSIGNED_LONG_LONG, MPI_MAX, 0, MPI_COMM_WORLD);
+  MPI_Reduce(const_cast<unsigned long long*>(&src->min_nrw), &sum->min_nrw, 1,
+             MPI_UNSIGNED_LONG_LONG, MPI_MIN, 0, MPI_COMM_WORLD);
+  MPI_Reduce(const_cast<unsigned long long*>(&src->max_nrw), &sum->max_nrw, 1,
+             MPI_UNSIGNED_LONG_LONG, MPI_MAX, 0, MPI_COMM_WORLD);
+
+  MPI_Reduce(const_cast<unsigned long long*>(&src->nwb), &sum->nwb, 1,
+             MPI_UNSIGNED_LONG_LONG, MPI_SUM, 0, MPI_COMM_WORLD);
+  MPI_Reduce(const_cast<unsigned long long*>(&src->nwc), &sum->nwc, 1,
+             MPI_UNSIGNED_LONG_LONG, MPI_SUM, 0, MPI_COMM_WORLD);
+
+  MPI_Reduce(const_cast<unsigned long long*>(&src->zrb), &sum->zrb, 1,
+             MPI_UNSIGNED_LONG_LONG, MPI_SUM, 0, MPI_COMM_WORLD);
+  MPI_Reduce(const_cast<unsigned long long*>(&src->zcb), &sum->zcb, 1,
+             MPI_UNSIGNED_LONG_LONG, MPI_SUM, 0, MPI_COMM_WORLD);
+  MPI_Reduce(const_cast<unsigned long long*>(&src->zcu), &sum->zcu, 1,
+             MPI_UNSIGNED_LONG_LONG, MPI_SUM, 0, MPI_COMM_WORLD);
+  MPI_Reduce(const_cast<unsigned long long*>(&src->zdu), &sum->zdu, 1,
+             MPI_UNSIGNED_LONG_LONG, MPI_SUM, 0, MPI_COMM_WORLD);
+
+  MPI_Reduce(const_cast<unsigned long long*>(&src->max_nqm), &sum->max_nqm, 1,
+             MPI_UNSIGNED_LONG_LONG, MPI_MAX, 0, MPI_COMM_WORLD);
+  MPI_Reduce(const_cast<unsigned long long*>(&src->nqm), &sum->nqm, 1,
+             MPI_UNSIGNED_LONG_LONG, MPI_SUM, 0, MPI_COMM_WORLD);
+  MPI_Reduce(const_cast<unsigned long long*>(&src->nqe), &sum->nqe, 1,
+             MPI_UNSIGNED_LONG_LONG, MPI_SUM, 0, MPI_COMM_WORLD);
+
+  MPI_Reduce(const_cast<unsigned long long*>(&src->max_fdura), &sum->max_fdura,
+             1, MPI_UNSIGNED_LONG_LONG, MPI_MAX, 0, MPI_COMM_WORLD);
+  MPI_Reduce(const_cast<unsigned long long*>(&src->max_fwait), &sum->max_fwait,
+             1, MPI_UNSIGNED_LONG_LONG, MPI_MAX, 0, MPI_COMM_WORLD);
+
+  MPI_Reduce(const_cast<unsigned long long*>(&src->nbar), &sum->nbar, 1,
+             MPI_UNSIGNED_LONG_LONG, MPI_SUM, 0, MPI_COMM_WORLD);
+  MPI_Reduce(const_cast<unsigned long long*>(&src->bar_wait), &sum->bar_wait,
+             1, MPI_UNSIGNED_LONG_LONG, MPI_SUM, 0, MPI_COMM_WORLD);
+  MPI_Reduce(const_cast<unsigned long long*>(&src->max_bar_wait),
+             &sum->max_bar_wait, 1, MPI_UNSIGNED_LONG_LONG, MPI_MAX, 0,
+             MPI_COMM_WORLD);
+  MPI_Reduce(const_cast<unsigned long long*>(src->bar_hstg), sum->bar_hstg,
+             MON_BAR_BUCKETS, MPI_UNSIGNED_LONG_LONG, MPI_SUM, 0,
+             MPI_COMM_WORLD);
 
   dir_stat_reduce(&src->dir_stat, &sum->dir_stat);
   cpu_stat_reduce(&src->cpu_stat, &sum->cpu_stat);
@@ -210,6 +251,27 @@ void mon_dumpstate(int fd, const mon_ctx_t* ctx) {
   DUMP(fd, buf, "[M] min num writes per rank: %llu", ctx->min_nw);
   DUMP(fd, buf, "[M] max num writes per rank: %llu", ctx->max_nw);
   DUMP(fd, buf, "[M] total writes: %llu", ctx->nw);
+  DUMP(fd, buf, "[M] min num writes per receiver: %llu", ctx->min_nrw);
+  DUMP(fd, buf, "[M] max num writes per receiver: %llu", ctx->max_nrw);
+  DUMP(fd, buf, "[M] total write batches: %llu", ctx->nwb);
+  DUMP(fd, buf, "[M] total write lock contentions: %llu", ctx->nwc);
+  DUMP(fd, buf, "[M] total rpc bytes before compression: %llu", ctx->zrb);
+  DUMP(fd, buf, "[M] total rpc bytes after compression: %llu", ctx->zcb);
+  DUMP(fd, buf, "[M] total compression cpu: %llu us", ctx->zcu);
+  DUMP(fd, buf, "[M] total decompression cpu: %llu us", ctx->zdu);
+  DUMP(fd, buf, "[M] max rpc queue memory per rank: %llu bytes", ctx->max_nqm);
+  DUMP(fd, buf, "[M] total rpc queue memory: %llu bytes", ctx->nqm);
+  DUMP(fd, buf, "[M] total rpc queue evictions: %llu", ctx->nqe);
+  DUMP(fd, buf, "[M] max epoch flush time per rank: %llu us", ctx->max_fdura);
+  DUMP(fd, buf, "[M] max epoch flush wait per rank: %llu us", ctx->max_fwait);
+  DUMP(fd, buf, "[M] total barriers: %llu", ctx->nbar);
+  DUMP(fd, buf, "[M] total barrier wait: %llu us", ctx->bar_wait);
+  DUMP(fd, buf, "[M] max barrier wait per rank: %llu us", ctx->max_bar_wait);
+  DUMP(fd, buf,
+       "[M] barrier waits: %llu <100us, %llu <1ms, %llu <10ms, %llu <100ms, "
+       "%llu <1s, %llu >=1s",
+       ctx->bar_hstg[0], ctx->bar_hstg[1], ctx->bar_hstg[2], ctx->bar_hstg[3],
+       ctx->bar_hstg[4], ctx->bar_hstg[5]);
   if (!ctx->global) DUMP(fd, buf, "!!! NON GLOBAL !!!");
   DUMP(fd, buf, "--- end ---\n");
 }
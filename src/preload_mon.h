@@ -137,6 +137,42 @@ typedef struct mon_ctx {
   unsigned long long max_nw;
   /* total num of particle writes */
   unsigned long long nw;
+  /* num of writes handled per receiver */
+  unsigned long long min_nrw;
+  unsigned long long max_nrw;
+
+  /* total num of write batches flushed from write shards */
+  unsigned long long nwb;
+  /* total num of writes that found their write shard locked */
+  unsigned long long nwc;
+
+  /* total rpc payload bytes before and after compression */
+  unsigned long long zrb;
+  unsigned long long zcb;
+  /* total cpu time spent compressing and decompressing rpc payloads */
+  unsigned long long zcu;
+  unsigned long long zdu;
+
+  /* peak rpc queue buffer memory in use per rank */
+  unsigned long long max_nqm;
+  /* total of the per-rank peaks above */
+  unsigned long long nqm;
+  /* total num of rpc queues flushed early to free up their buffers */
+  unsigned long long nqe;
+
+  /* max time per rank spent flushing the epoch at the receiver side */
+  unsigned long long max_fdura;
+  /* max time per rank the next epoch waited on in-flight epoch flushes */
+  unsigned long long max_fwait;
+
+  /* total num of barriers and total time spent waiting in them */
+  unsigned long long nbar;
+  unsigned long long bar_wait;
+  /* max time per rank spent waiting in a single barrier */
+  unsigned long long max_bar_wait;
+  /* num of barriers by wait time: <100us, <1ms, <10ms, <100ms, <1s, >=1s */
+#define MON_BAR_BUCKETS 6
+  unsigned long long bar_hstg[MON_BAR_BUCKETS];
 
   /* !!! collected by deltafs !!! */
   dir_stat_t dir_stat;
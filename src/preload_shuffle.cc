@@ -35,12 +35,19 @@
 
 #include <arpa/inet.h>
 #include <assert.h>
+#include <fcntl.h>
 #include <ifaddrs.h>
+#include <limits.h>
+
+#include <algorithm>
+#include <string>
+#include <vector>
 
 #include "preload_internal.h"
 #include "preload_mon.h"
 #include "preload_shuffle.h"
 
+#include "hash_batch.h"
 #include "nn_shuffler.h"
 #include "nn_shuffler_internal.h"
 #include "xn_shuffler.h"
@@ -280,6 +287,147 @@ void shuffle_prepare_uri(char* buf) {
 #endif
 }
 
+namespace {
+/*
+ * Epoch completion with in-band markers. At the end of an epoch every sender
+ * sends each receiver a marker carrying the number of writes it has shuffled
+ * to that receiver in the epoch. A receiver is done with an epoch once it has
+ * got a marker from every sender and has processed as many writes as those
+ * markers add up to. Senders may move on to the next epoch before a receiver
+ * is done, so writes for an epoch a receiver has yet to open are parked and
+ * replayed when it opens that epoch.
+ */
+#define EPOCH_SLOTS 4 /* senders are at most 1 epoch ahead of a receiver */
+
+typedef struct epoch_slot {
+  int epoch;
+  int nmarks;                 /* markers received */
+  unsigned long long nexpect; /* writes announced by markers */
+  unsigned long long nrecv;   /* writes processed */
+} epoch_slot_t;
+
+typedef struct parked_write {
+  int epoch;
+  int src;
+  int dst;
+  std::string req;
+} parked_write_t;
+
+struct epoch_track {
+  pthread_mutex_t mtx;
+  pthread_cond_t cv;
+  int cur; /* latest epoch opened by us (-1 if none) */
+  /* writes shuffled to each rank in the current epoch (sender side) */
+  unsigned long long* nsent;
+  epoch_slot_t slots[EPOCH_SLOTS];
+  std::vector<parked_write_t> parked;
+} et = {PTHREAD_MUTEX_INITIALIZER, PTHREAD_COND_INITIALIZER, -1, NULL};
+
+/* epoch_slot_of: return the slot of an epoch. caller must hold et.mtx. */
+epoch_slot_t* epoch_slot_of(int epoch) {
+  epoch_slot_t* const slot = &et.slots[epoch % EPOCH_SLOTS];
+  if (slot->epoch != epoch) {
+    memset(slot, 0, sizeof(epoch_slot_t));
+    slot->epoch = epoch;
+  }
+  return slot;
+}
+
+/* epoch_done: return 1 if all writes of a slot's epoch have been processed */
+inline int epoch_done(shuffle_ctx_t* ctx, const epoch_slot_t* slot) {
+  return slot->nmarks == shuffle_world_sz(ctx) && slot->nrecv == slot->nexpect;
+}
+
+/* epoch_park: park writes of an epoch we have yet to open. return 1 if the
+ * writes are parked, or 0 if they should be processed now. */
+int epoch_park(char* const* bufs, int n, unsigned int buf_sz, int epoch,
+               const int* srcs, int dst) {
+  parked_write_t w;
+  int i;
+
+  pthread_mtx_lock(&et.mtx);
+  if (epoch <= et.cur) {
+    pthread_mtx_unlock(&et.mtx);
+    return 0;
+  }
+  w.epoch = epoch;
+  w.dst = dst;
+  for (i = 0; i < n; i++) {
+    w.src = srcs[i];
+    w.req.assign(bufs[i], buf_sz);
+    et.parked.push_back(w);
+  }
+  pthread_mtx_unlock(&et.mtx);
+  return 1;
+}
+
+/* epoch_count: account for writes of an epoch we have processed */
+void epoch_count(shuffle_ctx_t* ctx, int epoch, int n) {
+  epoch_slot_t* slot;
+
+  pthread_mtx_lock(&et.mtx);
+  slot = epoch_slot_of(epoch);
+  slot->nrecv += n;
+  if (epoch_done(ctx, slot)) {
+    pthread_cv_notifyall(&et.cv);
+  }
+  pthread_mtx_unlock(&et.mtx);
+}
+}  // namespace
+
+void shuffle_epoch_marker(shuffle_ctx_t* ctx, int src, int epoch,
+                          unsigned long long nwrites) {
+  epoch_slot_t* slot;
+
+  ctx = &pctx.sctx;
+  if (!ctx->markers) ABORT("unexpected epoch marker");
+  if (pctx.testin && pctx.trace != NULL) {
+    fprintf(pctx.trace, "[MK] %llu writes (ep=%d) << r%d\n", nwrites, epoch,
+            src);
+  }
+  pthread_mtx_lock(&et.mtx);
+  slot = epoch_slot_of(epoch);
+  slot->nmarks++;
+  slot->nexpect += nwrites;
+  if (epoch_done(ctx, slot)) {
+    pthread_cv_notifyall(&et.cv);
+  }
+  pthread_mtx_unlock(&et.mtx);
+}
+
+void shuffle_epoch_wait(shuffle_ctx_t* ctx, int epoch) {
+  assert(ctx != NULL);
+  assert(ctx->markers);
+  if (!ctx->is_receiver) return; /* no one sends us anything */
+  pthread_mtx_lock(&et.mtx);
+  while (!epoch_done(ctx, epoch_slot_of(epoch))) {
+    pthread_cv_wait(&et.cv, &et.mtx);
+  }
+  pthread_mtx_unlock(&et.mtx);
+}
+
+void shuffle_epoch_open(shuffle_ctx_t* ctx, int epoch) {
+  std::vector<parked_write_t> parked;
+  std::vector<parked_write_t>::iterator it;
+  int rv;
+
+  assert(ctx != NULL);
+  assert(ctx->markers);
+  pthread_mtx_lock(&et.mtx);
+  et.cur = epoch;
+  parked.swap(et.parked);
+  pthread_mtx_unlock(&et.mtx);
+
+  for (it = parked.begin(); it != parked.end(); ++it) {
+    if (it->epoch != epoch) ABORT("parked write from a future epoch");
+    rv = shuffle_handle(ctx, &it->req[0], it->req.size(), it->epoch, it->src,
+                        it->dst);
+    if (rv != 0) {
+      ABORT("plfsdir write failed");
+    }
+  }
+}
+
 void shuffle_epoch_pre_start(shuffle_ctx_t* ctx) {
   assert(ctx != NULL);
   if (ctx->type == SHUFFLE_XN) {
@@ -296,6 +444,230 @@ void shuffle_epoch_pre_start(shuffle_ctx_t* ctx) {
  * and dumped. Therefore, this is a good time for us to copy xn_shuffler's
  * internal stats counters into preload's global mon context.
  */
+namespace {
+/*
+ * range placement: receivers own contiguous ranges of particle names, ordered
+ * as big-endian byte strings over their first 8 bytes. pivots are chosen from
+ * names sampled by senders as they shuffle writes out. the first epoch uses
+ * hash placement as there is nothing to sample from yet. every set of pivots
+ * ever computed is kept so readers can be told which one each epoch used.
+ */
+struct range_placement {
+  /* pivots[i] is the first key owned by receiver i + 1 */
+  std::vector<uint64_t> pivots;
+  /* history[j] took effect at epoch epochs[j] and stayed in use until
+   * epochs[j + 1]; epochs before epochs[0] used hash placement */
+  std::vector<std::vector<uint64_t> > history;
+  std::vector<int> epochs;
+  int epoch; /* the epoch about to start */
+  int nrecv; /* num of receivers */
+  int ready; /* 1 once pivots are in place */
+  /* reservoir of keys shuffled out by us in the current epoch */
+  uint64_t* samples;
+  unsigned long long seen;
+  int cap;
+  int thres; /* re-pivot when max load exceeds mean by this much (percent) */
+  int npivots; /* num of times we computed pivots */
+} rp;
+
+/*
+ * redirection of writes away from hot receivers. receivers report their
+ * backlog of incoming rpcs in every rpc reply. once a receiver's backlog
+ * reaches ctx->redirect_backlog and is at least twice that of its overflow
+ * partner, ctx->redirect percent of its writes, picked by name, go to the
+ * partner instead. the partner of the i-th receiver is the (i + stride)-th
+ * receiver, which is what readers use to find redirected writes.
+ */
+struct redirect_state {
+  unsigned int* backlog; /* last backlog reported by each rank */
+  int* partner;          /* overflow partner of each receiver, -1 if none */
+  unsigned long long nredirected; /* num writes we redirected */
+} rd;
+
+/* seed for picking the writes to redirect. must differ from the seed used by
+ * placement, otherwise a receiver's writes would either all be redirected
+ * or none would. */
+#define REDIRECT_SEED 0x1b873593
+
+/* range_key: return the ordering key of a particle name */
+inline uint64_t range_key(const char* fname, unsigned char fname_len) {
+  uint64_t k = 0;
+  for (int i = 0; i < 8; i++) {
+    k <<= 8;
+    if (i < fname_len) k |= static_cast<unsigned char>(fname[i]);
+  }
+  return k;
+}
+
+/* range_sample: add a key into the reservoir. may be called by several
+ * dumping threads at once: a racing thread may overwrite a slot, which is
+ * harmless for sampling purposes. */
+inline void range_sample(uint64_t k) {
+  unsigned long long n = __sync_fetch_and_add(&rp.seen, 1);
+  uint64_t r;
+  if (n < static_cast<unsigned long long>(rp.cap)) {
+    rp.samples[n] = k;
+  } else {
+    /* splitmix64 on n gives a cheap per-write random number */
+    r = (n + 1) * 0x9e3779b97f4a7c15ULL;
+    r = (r ^ (r >> 30)) * 0xbf58476d1ce4e5b9ULL;
+    r = (r ^ (r >> 27)) * 0x94d049bb133111ebULL;
+    r = (r ^ (r >> 31)) % (n + 1);
+    if (r < static_cast<uint64_t>(rp.cap)) rp.samples[r] = k;
+  }
+}
+
+/* receiver_at: return the rank of the i-th receiver */
+inline int receiver_at(shuffle_ctx_t* ctx, int i) {
+  if (ctx->receivers != NULL) return ctx->receivers[i];
+  return i * static_cast<int>(ctx->receiver_rate);
+}
+
+/* range_target: return the receiver that owns a key */
+inline int range_target(shuffle_ctx_t* ctx, uint64_t k) {
+  const int i = static_cast<int>(
+      std::upper_bound(rp.pivots.begin(), rp.pivots.end(), k) -
+      rp.pivots.begin());
+  return receiver_at(ctx, i);
+}
+
+/*
+ * range_repivot: collectively decide if pivots should be recomputed based on
+ * the receiver load of the epoch that just ended, and if so, recompute them
+ * from the keys sampled by all ranks. each sample is weighted by the number
+ * of writes it stands for so ranks that wrote more count more. must be called
+ * by all ranks between epochs.
+ */
+void range_repivot(shuffle_ctx_t* ctx) {
+  unsigned long long load[2];
+  unsigned long long max_load;
+  unsigned long long sum_load;
+  std::vector<std::pair<uint64_t, double> > all;
+  std::vector<uint64_t> keys;
+  std::vector<double> seen;
+  std::vector<int> cnts;
+  std::vector<int> offs;
+  double myseen;
+  double total;
+  double acc;
+  int world_sz;
+  int n;
+  int i;
+  int j;
+
+  rp.epoch++; /* we are called once before each epoch but the first */
+  load[0] = load[1] = 0;
+  if (ctx->is_receiver) load[0] = load[1] = pctx.mctx.nfw + pctx.mctx.nlw;
+  MPI_Allreduce(&load[0], &max_load, 1, MPI_UNSIGNED_LONG_LONG, MPI_MAX,
+                MPI_COMM_WORLD);
+  MPI_Allreduce(&load[1], &sum_load, 1, MPI_UNSIGNED_LONG_LONG, MPI_SUM,
+                MPI_COMM_WORLD);
+  /* max > mean * (1 + thres) */
+  if (rp.ready && 100.0 * max_load * rp.nrecv <=
+                      (100.0 + rp.thres) * sum_load) {
+    rp.seen = 0;
+    return;
+  }
+
+  world_sz = shuffle_world_sz(ctx);
+  n = static_cast<int>(std::min<unsigned long long>(rp.seen, rp.cap));
+  cnts.resize(world_sz);
+  offs.resize(world_sz);
+  seen.resize(world_sz);
+  myseen = static_cast<double>(rp.seen);
+  MPI_Allgather(&n, 1, MPI_INT, &cnts[0], 1, MPI_INT, MPI_COMM_WORLD);
+  MPI_Allgather(&myseen, 1, MPI_DOUBLE, &seen[0], 1, MPI_DOUBLE,
+                MPI_COMM_WORLD);
+  for (i = 0, j = 0; i < world_sz; i++) {
+    offs[i] = j;
+    j += cnts[i];
+  }
+  rp.seen = 0;
+  if (j == 0) return; /* nothing was written */
+  keys.resize(j);
+  MPI_Allgatherv(rp.samples, n, MPI_UINT64_T, &keys[0], &cnts[0], &offs[0],
+                 MPI_UINT64_T, MPI_COMM_WORLD);
+
+  all.reserve(j);
+  total = 0;
+  for (i = 0; i < world_sz; i++) {
+    for (n = 0; n < cnts[i]; n++) {
+      all.push_back(std::make_pair(keys[offs[i] + n], seen[i] / cnts[i]));
+    }
+    if (cnts[i] != 0) total += seen[i];
+  }
+  std::sort(all.begin(), all.end());
+
+  /* receiver i + 1 starts where the cumulative weight reaches
+   * (i + 1) / nrecv of the total, or the share of the hash space owned by
+   * receivers 0 to i under weighted placement */
+  rp.pivots.clear();
+  acc = 0;
+  for (i = 0, j = 0; i < rp.nrecv - 1; i++) {
+    const double share = ctx->wbounds != NULL
+                             ? double(ctx->wbounds[i]) / 4294967296.0
+                             : double(i + 1) / rp.nrecv;
+    while (j < static_cast<int>(all.size()) &&
+           acc + all[j].second <= total * share) {
+      acc += all[j].second;
+      j++;
+    }
+    rp.pivots.push_back(j < static_cast<int>(all.size()) ? all[j].first
+                                                          : ~uint64_t(0));
+  }
+
+  if (pctx.my_rank == 0) {
+    logf(LOG_INFO,
+         "[range] %s pivots from %s samples (max receiver load: %s, "
+         "mean: %s)",
+         rp.ready ? "recomputed" : "computed",
+         pretty_num(all.size()).c_str(), pretty_num(max_load).c_str(),
+         pretty_num(double(sum_load) / rp.nrecv).c_str());
+  }
+
+  rp.history.push_back(rp.pivots);
+  rp.epochs.push_back(rp.epoch);
+  rp.npivots++;
+  rp.ready = 1;
+}
+
+void range_init(shuffle_ctx_t* ctx, int world_sz) {
+  const char* env;
+
+  if (ctx->receivers != NULL) {
+    rp.nrecv = ctx->num_receivers;
+  } else {
+    rp.nrecv = (world_sz + ctx->receiver_rate - 1) / ctx->receiver_rate;
+  }
+  rp.cap = DEFAULT_RANGE_SAMPLES;
+  env = maybe_getenv("SHUFFLE_Range_samples");
+  if (env != NULL) {
+    rp.cap = atoi(env);
+    if (rp.cap < 1) {
+      rp.cap = 1;
+    }
+  }
+  rp.thres = DEFAULT_RANGE_REPIVOT;
+  env = maybe_getenv("SHUFFLE_Range_repivot");
+  if (env != NULL) {
+    rp.thres = atoi(env);
+    if (rp.thres < 0) {
+      rp.thres = 0;
+    }
+  }
+  rp.samples = static_cast<uint64_t*>(malloc(rp.cap * sizeof(uint64_t)));
+  if (rp.samples == NULL) {
+    ABORT("malloc");
+  }
+  if (pctx.my_rank == 0) {
+    logf(LOG_INFO,
+         "shuffle range placement ON: %d receivers, %d samples per rank\n>>> "
+         "re-pivot when a receiver exceeds mean load by %d%%",
+         rp.nrecv, rp.cap, rp.thres);
+  }
+}
+}  // namespace
+
 void shuffle_epoch_start(shuffle_ctx_t* ctx) {
   assert(ctx != NULL);
   if (ctx->type == SHUFFLE_XN) {
@@ -311,17 +683,55 @@ void shuffle_epoch_start(shuffle_ctx_t* ctx) {
     pctx.mctx.nms = rep->stat.remote.sends - rep->last_stat.remote.sends;
     pctx.mctx.min_nms = pctx.mctx.max_nms = pctx.mctx.nms;
     pctx.mctx.nmd = pctx.mctx.nms;
+    pctx.mctx.zrb = rep->stat.zip.raw - rep->last_stat.zip.raw;
+    pctx.mctx.zcb = rep->stat.zip.zip - rep->last_stat.zip.zip;
+    pctx.mctx.zcu = rep->stat.zip.zusec - rep->last_stat.zip.zusec;
+    pctx.mctx.zdu = rep->stat.zip.uzusec - rep->last_stat.zip.uzusec;
   } else {
     nn_shuffler_bgwait();
   }
+  /* all writes of the previous epoch have been delivered by now */
+  if (ctx->range) range_repivot(ctx);
+  /* start each epoch w/o any receiver considered hot */
+  if (ctx->redirect)
+    memset(rd.backlog, 0, sizeof(unsigned int) * shuffle_world_sz(ctx));
+}
+
+namespace {
+/* shuffle_mark: send every receiver an end-of-epoch marker and reset our
+ * per-receiver write counters for the next epoch */
+void shuffle_mark(shuffle_ctx_t* ctx, int epoch) {
+  unsigned long long n;
+  int world_sz;
+  int rank;
+  int i;
+
+  world_sz = shuffle_world_sz(ctx);
+  rank = shuffle_rank(ctx);
+  for (i = 0; i < world_sz; i++) {
+    if (!shuffle_is_rank_receiver(ctx, i)) continue;
+    n = et.nsent[i];
+    et.nsent[i] = 0;
+    if (i == rank) {
+      shuffle_epoch_marker(ctx, rank, epoch, n);
+    } else if (ctx->type == SHUFFLE_XN) {
+      xn_shuffler_mark(static_cast<xn_ctx_t*>(ctx->rep), i, epoch, n);
+    } else {
+      nn_shuffler_mark(i, epoch, n);
+    }
+  }
 }
+}  // namespace
 
-void shuffle_epoch_end(shuffle_ctx_t* ctx) {
+void shuffle_epoch_end(shuffle_ctx_t* ctx, int epoch) {
   assert(ctx != NULL);
   if (ctx->type == SHUFFLE_XN) {
+    /* markers are pushed through the queues ahead of the flush */
+    if (ctx->markers) shuffle_mark(ctx, epoch);
     xn_shuffler_epoch_end(static_cast<xn_ctx_t*>(ctx->rep));
   } else {
     nn_shuffler_flushq(); /* flush rpc queues */
+    if (ctx->markers) shuffle_mark(ctx, epoch);
     if (!nnctx.force_sync) {
       /* wait for rpc replies */
       nn_shuffler_waitcb();
@@ -329,9 +739,281 @@ void shuffle_epoch_end(shuffle_ctx_t* ctx) {
   }
 }
 
+namespace {
+/*
+ * hash placement. names are hashed to 64 bits and mapped to a rank by one of
+ * the following: plain modulo, ch-placement, jump consistent hash, or
+ * rendezvous hashing. for ch-placement, we precompute a flat table mapping the
+ * top bits of a hash to the rank ch-placement would return for it so most
+ * names are placed with a single memory load instead of a search over
+ * world_sz * vf virtual nodes. table entries whose hash range covers more than
+ * one rank are -1 and are resolved by ch-placement itself. for rendezvous
+ * hashing, the table is the placement: ranks compete for table slots rather
+ * than for individual names.
+ */
+struct placement_table {
+  int* table;
+  int bits;
+  int shift; /* 64 - bits */
+  unsigned long long nexact; /* num of entries mapping to a single rank */
+} pt;
+
+/* mix64: splitmix64 finalizer */
+inline uint64_t mix64(uint64_t x) {
+  x = (x ^ (x >> 30)) * 0xbf58476d1ce4e5b9ULL;
+  x = (x ^ (x >> 27)) * 0x94d049bb133111ebULL;
+  return x ^ (x >> 31);
+}
+
+/* jump_hash: Lamping and Veach's jump consistent hash */
+inline int jump_hash(uint64_t k, int n) {
+  int64_t b = -1;
+  int64_t j = 0;
+  while (j < n) {
+    b = j;
+    k = k * 2862933555777941757ULL + 1;
+    j = static_cast<int64_t>(double(b + 1) * (double(1LL << 31) /
+                                              double((k >> 33) + 1)));
+  }
+  return static_cast<int>(b);
+}
+
+#ifdef PRELOAD_HAS_CH_PLACEMENT
+inline int ch_place(shuffle_ctx_t* ctx, uint64_t h) {
+  unsigned long target;
+  ch_placement_find_closest(ctx->chp, h, 1, &target);
+  return static_cast<int>(target);
+}
+#endif
+
+/* weighted_index: return the receiver owning a 32-bit hash under weighted
+ * placement */
+inline int weighted_index(shuffle_ctx_t* ctx, uint32_t h) {
+  return static_cast<int>(std::upper_bound(ctx->wbounds,
+                                           ctx->wbounds + ctx->num_weights,
+                                           static_cast<unsigned long long>(h)) -
+                          ctx->wbounds);
+}
+
+/* hash_place: return the rank a name is hashed to. for weighted placement,
+ * return the index of the receiver instead */
+inline int hash_place(shuffle_ctx_t* ctx, const char* buf, int world_sz) {
+  switch (ctx->placement) {
+    case SHUFFLE_PLACE_WEIGHTED:
+      return weighted_index(ctx, pdlfs::xxhash32(buf, ctx->fname_len, 0));
+    case SHUFFLE_PLACE_JUMP:
+      return jump_hash(pdlfs::xxhash64(buf, ctx->fname_len, 0), world_sz);
+    case SHUFFLE_PLACE_HRW:
+      return pt.table[pdlfs::xxhash64(buf, ctx->fname_len, 0) >> pt.shift];
+#ifdef PRELOAD_HAS_CH_PLACEMENT
+    case SHUFFLE_PLACE_CH: {
+      const uint64_t h = pdlfs::xxhash64(buf, ctx->fname_len, 0);
+      if (pt.table != NULL) {
+        const int rv = pt.table[h >> pt.shift];
+        if (rv >= 0) return rv;
+      }
+      return ch_place(ctx, h);
+    }
+#endif
+    default:
+      return pdlfs::xxhash32(buf, ctx->fname_len, 0) % world_sz;
+  }
+}
+
+/* ceil_log2: return the smallest b such that (1 << b) >= n */
+int ceil_log2(unsigned long long n) {
+  int b = 0;
+  while ((1ULL << b) < n) b++;
+  return b;
+}
+
+/* placement_bits: return the table size (in bits) to use */
+int placement_bits(int dflt) {
+  const char* env = maybe_getenv("SHUFFLE_Placement_table_bits");
+  int b = dflt;
+  if (env != NULL) {
+    b = atoi(env);
+    if (b < 0) b = 0;
+    if (b > 26) b = 26;
+  }
+  return b;
+}
+
+void placement_table_alloc(int bits) {
+  pt.bits = bits;
+  pt.shift = 64 - bits;
+  pt.nexact = 0;
+  pt.table = static_cast<int*>(malloc(sizeof(int) << bits));
+  if (pt.table == NULL) {
+    ABORT("malloc");
+  }
+}
+
+void placement_table_free() {
+  free(pt.table);
+  pt.table = NULL;
+}
+
+/* placement_hrw_init: assign each table slot to the rank with the highest
+ * score for it. each rank scores an even share of the slots and the shares
+ * are then allgathered, so per-rank work stays at about 2**bits scores no
+ * matter how many ranks there are. identical on all ranks. must be called by
+ * all ranks. */
+void placement_hrw_init(int world_sz) {
+  std::vector<int> cnts;
+  std::vector<int> offs;
+  int b = placement_bits(0);
+  uint64_t best;
+  uint64_t s;
+  size_t n;
+  size_t lo;
+  size_t hi;
+  int r;
+  int i;
+
+  /* aim for at least 64 slots per rank */
+  if (b == 0) b = std::min(std::max(ceil_log2(world_sz) + 6, 12), 22);
+  placement_table_alloc(b);
+  n = size_t(1) << b;
+  cnts.resize(pctx.comm_sz);
+  offs.resize(pctx.comm_sz);
+  for (r = 0; r < pctx.comm_sz; r++) {
+    lo = n * r / pctx.comm_sz;
+    hi = n * (r + 1) / pctx.comm_sz;
+    offs[r] = static_cast<int>(lo);
+    cnts[r] = static_cast<int>(hi - lo);
+  }
+  lo = offs[pctx.my_rank];
+  hi = lo + cnts[pctx.my_rank];
+  for (size_t slot = lo; slot < hi; slot++) {
+    best = 0;
+    pt.table[slot] = 0;
+    for (i = 0; i < world_sz; i++) {
+      s = mix64((uint64_t(slot) << 32) ^ uint64_t(i) ^ 0x9e3779b97f4a7c15ULL);
+      if (s > best) {
+        best = s;
+        pt.table[slot] = i;
+      }
+    }
+  }
+  MPI_Allgatherv(MPI_IN_PLACE, 0, MPI_DATATYPE_NULL, pt.table, &cnts[0],
+                 &offs[0], MPI_INT, MPI_COMM_WORLD);
+  pt.nexact = n;
+}
+
+#ifdef PRELOAD_HAS_CH_PLACEMENT
+/* placement_ch_init: build the flat lookup table for ch-placement. an entry
+ * is filled in only if ch-placement agrees on the first, middle, and last
+ * hash of its range. ch-placement does not expose its ring, so this cannot
+ * rule out a virtual node of the same rank hidden inside the range and the
+ * match is only approximate. to keep such ranges rare, the table must have
+ * at least 256 entries per virtual node or it is not used. the table is then
+ * checked against ch-placement on a set of random hashes and discarded on
+ * any mismatch. identical on all ranks. */
+void placement_ch_init(shuffle_ctx_t* ctx, int world_sz, int vf) {
+  const uint64_t seed = 0x6a09e667f3bcc908ULL;
+  int need;
+  int b;
+  uint64_t lo;
+  uint64_t hi;
+  uint64_t h;
+  size_t n;
+  int r;
+  int i;
+
+  /* with 256 entries per virtual node, about 1 in 256 ranges holds one */
+  need = ceil_log2(uint64_t(world_sz) * std::max(vf, 1)) + 8;
+  b = placement_bits(std::min(std::max(need, 12), 22));
+  if (b == 0) return;
+  if (b < need) {
+    if (pctx.my_rank == 0) {
+      logf(LOG_WARN,
+           "%d bits are too few for a ch-placement table of %d virtual "
+           "nodes\n>>> placement table disabled",
+           b, world_sz * std::max(vf, 1));
+    }
+    return;
+  }
+  placement_table_alloc(b);
+  n = size_t(1) << b;
+  for (size_t e = 0; e < n; e++) {
+    lo = uint64_t(e) << pt.shift;
+    hi = lo | (~uint64_t(0) >> b);
+    r = ch_place(ctx, lo);
+    if (r == ch_place(ctx, lo + (hi - lo) / 2) && r == ch_place(ctx, hi)) {
+      pt.table[e] = r;
+      pt.nexact++;
+    } else {
+      pt.table[e] = -1;
+    }
+  }
+
+  for (i = 0; i < (1 << 16); i++) {
+    h = mix64(seed + uint64_t(i) * 0x9e3779b97f4a7c15ULL);
+    r = pt.table[h >> pt.shift];
+    if (r >= 0 && r != ch_place(ctx, h)) {
+      if (pctx.my_rank == 0) {
+        logf(LOG_WARN,
+             "ch-placement table disagrees with ch-placement on %016llx "
+             "(%d bits)\n>>> placement table disabled",
+             static_cast<unsigned long long>(h), b);
+      }
+      placement_table_free();
+      return;
+    }
+  }
+
+  if (pt.nexact < n / 2) {
+    if (pctx.my_rank == 0) {
+      logf(LOG_WARN,
+           "only %.2f%% of ch-placement table entries are exact "
+           "(%d bits)\n>>> placement table disabled",
+           100.0 * double(pt.nexact) / double(n), b);
+    }
+    placement_table_free();
+  }
+}
+#endif
+
+/* placement_bench: return the avg time in ns to place a random name */
+double placement_bench(shuffle_ctx_t* ctx, int group_sz, int n) {
+  char buf[256];
+  uint64_t t;
+  uint64_t x;
+  int sink;
+  int i;
+
+  memset(buf, 0, sizeof(buf));
+  sink = 0;
+  t = now_micros();
+  for (i = 0; i < n; i++) {
+    x = mix64(uint64_t(i) + 1);
+    memcpy(buf, &x, std::min(sizeof(x), size_t(ctx->fname_len)));
+    sink += hash_place(ctx, buf, group_sz);
+  }
+  t = now_micros() - t;
+  if (sink == -1) abort(); /* keep the loop from being optimized away */
+  return 1000.0 * double(t) / double(n);
+}
+
+const char* placement_name(int placement) {
+  switch (placement) {
+    case SHUFFLE_PLACE_CH:
+      return "ch-placement";
+    case SHUFFLE_PLACE_JUMP:
+      return "jump";
+    case SHUFFLE_PLACE_HRW:
+      return "rendezvous";
+    case SHUFFLE_PLACE_WEIGHTED:
+      return "weighted";
+    default:
+      return "modulo";
+  }
+}
+}  // namespace
+
 int shuffle_target(shuffle_ctx_t* ctx, char* buf, unsigned int buf_sz) {
   int world_sz;
-  unsigned long target;
   int rv;
 
   assert(ctx != NULL);
@@ -339,19 +1021,16 @@ int shuffle_target(shuffle_ctx_t* ctx, char* buf, unsigned int buf_sz) {
 
   world_sz = shuffle_world_sz(ctx);
 
-  if (world_sz != 1) {
-#ifdef PRELOAD_HAS_CH_PLACEMENT
-    if (!IS_BYPASS_PLACEMENT(pctx.mode)) {
-      assert(ctx->chp != NULL);
-      ch_placement_find_closest(
-          ctx->chp, pdlfs::xxhash64(buf, ctx->fname_len, 0), 1, &target);
-      rv = static_cast<int>(target);
+  if (ctx->range && rp.ready) {
+    rv = range_target(ctx, range_key(buf, ctx->fname_len));
+  } else if (world_sz != 1) {
+    if (ctx->receivers != NULL) {
+      rv = ctx->receivers[hash_place(ctx, buf, ctx->num_receivers)];
+    } else if (ctx->placement == SHUFFLE_PLACE_WEIGHTED) {
+      rv = receiver_at(ctx, hash_place(ctx, buf, world_sz));
     } else {
-#endif
-      rv = pdlfs::xxhash32(buf, ctx->fname_len, 0) % world_sz;
-#ifdef PRELOAD_HAS_CH_PLACEMENT
+      rv = hash_place(ctx, buf, world_sz);
     }
-#endif
   } else {
     rv = shuffle_rank(ctx);
   }
@@ -359,6 +1038,62 @@ int shuffle_target(shuffle_ctx_t* ctx, char* buf, unsigned int buf_sz) {
   return (rv & ctx->receiver_mask);
 }
 
+void shuffle_target_batch(shuffle_ctx_t* ctx, char* const* bufs, int n,
+                          int* targets) {
+  uint32_t h[256];
+  int world_sz;
+  int rank;
+  int m;
+  int i;
+  int j;
+
+  assert(ctx != NULL);
+
+  world_sz = shuffle_world_sz(ctx);
+
+  if (ctx->range && rp.ready) {
+    for (i = 0; i < n; i++) {
+      targets[i] = range_target(ctx, range_key(bufs[i], ctx->fname_len));
+    }
+  } else if (world_sz != 1) {
+    if (ctx->placement != SHUFFLE_PLACE_MODULO &&
+        ctx->placement != SHUFFLE_PLACE_WEIGHTED) {
+      /* these want 64-bit hashes, which do not vectorize well w/o
+       * avx-512, so we do those one at a time */
+      for (i = 0; i < n; i++) {
+        targets[i] = shuffle_target(ctx, bufs[i], ctx->fname_len);
+      }
+      return;
+    }
+    for (i = 0; i < n; i += m) {
+      m = std::min(n - i, int(sizeof(h) / sizeof(h[0])));
+      xxhash32_batch(bufs + i, m, ctx->fname_len, 0, h);
+      if (ctx->placement == SHUFFLE_PLACE_WEIGHTED) {
+        for (j = 0; j < m; j++) {
+          targets[i + j] = receiver_at(ctx, weighted_index(ctx, h[j]));
+        }
+      } else if (ctx->receivers != NULL) {
+        for (j = 0; j < m; j++) {
+          targets[i + j] = ctx->receivers[h[j] % ctx->num_receivers];
+        }
+      } else {
+        for (j = 0; j < m; j++) {
+          targets[i + j] = h[j] % world_sz;
+        }
+      }
+    }
+  } else {
+    rank = shuffle_rank(ctx);
+    for (i = 0; i < n; i++) {
+      targets[i] = rank;
+    }
+  }
+
+  for (i = 0; i < n; i++) {
+    targets[i] &= ctx->receiver_mask;
+  }
+}
+
 namespace {
 void shuffle_write_debug(shuffle_ctx_t* ctx, char* buf, unsigned char buf_sz,
                          int epoch, int src, int dst) {
@@ -374,13 +1109,56 @@ void shuffle_write_debug(shuffle_ctx_t* ctx, char* buf, unsigned char buf_sz,
             buf_sz, epoch, h);
   }
 }
+
+/* shuffle_encode: lay a write out as the shuffle wire format expects:
+ * the filename, a 0 byte, the data, and zero padding for extra data. */
+void shuffle_encode(shuffle_ctx_t* ctx, char* buf, const char* fname,
+                    unsigned char fname_len, const char* data,
+                    unsigned char data_len) {
+  unsigned char base_sz = 1 + fname_len + data_len;
+  memcpy(buf, fname, fname_len);
+  buf[fname_len] = 0;
+  memcpy(buf + fname_len + 1, data, data_len);
+  if (ctx->extra_data_len != 0) memset(buf + base_sz, 0, ctx->extra_data_len);
+}
+}  // namespace
+
+namespace {
+/* redirect_target: return where a write for peer_rank should go */
+inline int redirect_target(shuffle_ctx_t* ctx, const char* fname,
+                           unsigned char fname_len, int peer_rank) {
+  const unsigned int b = rd.backlog[peer_rank];
+  const int p = rd.partner[peer_rank];
+  if (p < 0 || b < ctx->redirect_backlog || b < 2 * rd.backlog[p])
+    return peer_rank;
+  if (pdlfs::xxhash32(fname, fname_len, REDIRECT_SEED) % 100 >=
+      static_cast<unsigned int>(ctx->redirect))
+    return peer_rank;
+  __sync_fetch_and_add(&rd.nredirected, 1);
+  return p;
+}
 }  // namespace
 
 int shuffle_write(shuffle_ctx_t* ctx, const char* fname,
                   unsigned char fname_len, char* data, unsigned char data_len,
                   int epoch) {
-  char buf[255];
   int peer_rank;
+
+  assert(ctx == &pctx.sctx);
+  if (ctx->fname_len != fname_len) ABORT("bad filename len");
+
+  /* placement only looks at the filename */
+  peer_rank = shuffle_target(ctx, const_cast<char*>(fname), fname_len);
+
+  return shuffle_write_to(ctx, fname, fname_len, data, data_len, epoch,
+                          peer_rank);
+}
+
+int shuffle_write_to(shuffle_ctx_t* ctx, const char* fname,
+                     unsigned char fname_len, char* data,
+                     unsigned char data_len, int epoch, int peer_rank) {
+  char buf[255];
+  char* req;
   int rank;
   int rv;
 
@@ -391,31 +1169,47 @@ int shuffle_write(shuffle_ctx_t* ctx, const char* fname,
 
   unsigned char base_sz = 1 + fname_len + data_len;
   unsigned char buf_sz = base_sz + ctx->extra_data_len;
-  memcpy(buf, fname, fname_len);
-  buf[fname_len] = 0;
-  memcpy(buf + fname_len + 1, data, data_len);
-  if (buf_sz != base_sz) memset(buf + base_sz, 0, buf_sz - base_sz);
 
-  peer_rank = shuffle_target(ctx, buf, buf_sz);
-  rank = shuffle_rank(ctx);
+  if (ctx->range) range_sample(range_key(fname, fname_len));
+  if (ctx->redirect)
+    peer_rank = redirect_target(ctx, fname, fname_len, peer_rank);
 
-  /* write trace if we are in testing mode */
-  if (pctx.testin && pctx.trace != NULL)
-    shuffle_write_debug(ctx, buf, buf_sz, epoch, rank, peer_rank);
+  rank = shuffle_rank(ctx);
 
   /* bypass rpc if target is local */
   if (peer_rank == rank && !ctx->force_rpc) {
+    /* write trace if we are in testing mode */
+    if (pctx.testin && pctx.trace != NULL) {
+      shuffle_encode(ctx, buf, fname, fname_len, data, data_len);
+      shuffle_write_debug(ctx, buf, buf_sz, epoch, rank, peer_rank);
+    }
     rv = native_write(fname, fname_len, data, data_len, epoch);
     return rv;
   }
 
+  /* encode the write directly into the outgoing rpc buffer */
+  if (ctx->type == SHUFFLE_XN) {
+    req = static_cast<char*>(
+        xn_shuffler_reserve(static_cast<xn_ctx_t*>(ctx->rep), buf_sz));
+  } else {
+    req = nn_shuffler_reserve(buf_sz, epoch, peer_rank, rank);
+  }
+  shuffle_encode(ctx, req, fname, fname_len, data, data_len);
+
+  /* write trace if we are in testing mode */
+  if (pctx.testin && pctx.trace != NULL)
+    shuffle_write_debug(ctx, req, buf_sz, epoch, rank, peer_rank);
+
   if (ctx->type == SHUFFLE_XN) {
-    xn_shuffler_enqueue(static_cast<xn_ctx_t*>(ctx->rep), buf, buf_sz, epoch,
-                        peer_rank, rank);
+    xn_shuffler_commit(static_cast<xn_ctx_t*>(ctx->rep), req, epoch,
+                       peer_rank, rank);
   } else {
-    nn_shuffler_enqueue(buf, buf_sz, epoch, peer_rank, rank);
+    nn_shuffler_commit(peer_rank);
   }
 
+  /* may be called by several dumping threads at once */
+  if (ctx->markers) __sync_fetch_and_add(&et.nsent[peer_rank], 1);
+
   return 0;
 }
 
@@ -438,12 +1232,37 @@ int shuffle_handle(shuffle_ctx_t* ctx, char* buf, unsigned int buf_sz,
   ctx = &pctx.sctx;
   if (buf_sz != ctx->extra_data_len + ctx->data_len + ctx->fname_len + 1)
     ABORT("unexpected incoming shuffle request size");
+  if (ctx->markers && epoch_park(&buf, 1, buf_sz, epoch, &src, dst)) return 0;
   rv = exotic_write(buf, ctx->fname_len, buf + ctx->fname_len + 1,
                     ctx->data_len, epoch, src);
 
   if (pctx.testin && pctx.trace != NULL)
     shuffle_handle_debug(ctx, buf, buf_sz, epoch, src, dst);
 
+  if (ctx->markers) epoch_count(ctx, epoch, 1);
+
+  return rv;
+}
+
+int shuffle_handle_batch(shuffle_ctx_t* ctx, char* const* bufs, int n,
+                         unsigned int buf_sz, int epoch, const int* peer_ranks,
+                         int rank) {
+  int rv;
+
+  ctx = &pctx.sctx;
+  if (buf_sz != ctx->extra_data_len + ctx->data_len + ctx->fname_len + 1)
+    ABORT("unexpected incoming shuffle request size");
+  if (ctx->markers && epoch_park(bufs, n, buf_sz, epoch, peer_ranks, rank))
+    return 0;
+  rv = exotic_write_batch(bufs, peer_ranks, n, ctx->fname_len, ctx->data_len,
+                          epoch);
+
+  if (pctx.testin && pctx.trace != NULL)
+    for (int i = 0; i < n; i++)
+      shuffle_handle_debug(ctx, bufs[i], buf_sz, epoch, peer_ranks[i], rank);
+
+  if (ctx->markers) epoch_count(ctx, epoch, n);
+
   return rv;
 }
 
@@ -567,6 +1386,24 @@ void shuffle_finalize(shuffle_ctx_t* ctx) {
         }
       }
     }
+    for (size_t w = 0; w < 2; w++) {
+      const char* what[] = {"rpc queue wait", "rpc slot wait"};
+      hstg_t* src[] = {&nnctx.qu_wait, &nnctx.cb_wait};
+      hstg_t wt;
+      memset(&wt, 0, sizeof(hstg_t));
+      hstg_reset_min(wt);
+      hstg_reduce(*src[w], wt, MPI_COMM_WORLD);
+      if (pctx.my_rank == 0 && hstg_num(wt) >= 1.0) {
+        logf(LOG_INFO, "[nn] %s ... (us)", what[w]);
+        logf(LOG_INFO, "  %s samples, avg: %.3f (min: %.0f, max: %.0f)",
+             pretty_num(hstg_num(wt)).c_str(), hstg_avg(wt), hstg_min(wt),
+             hstg_max(wt));
+        for (size_t i = 0; i < sizeof(p) / sizeof(int); i++) {
+          logf(LOG_INFO, "    - %d%% %-12.2f %.4f%% %.2f", p[i],
+               hstg_ptile(wt, p[i]), d[i], hstg_ptile(wt, d[i]));
+        }
+      }
+    }
     if (pctx.recv_comm != MPI_COMM_NULL) {
       memset(&hg_intvl, 0, sizeof(hstg_t));
       hstg_reset_min(hg_intvl);
@@ -606,6 +1443,35 @@ void shuffle_finalize(shuffle_ctx_t* ctx) {
     }
 #undef NUM_RUSAGE
   }
+  if (ctx->redirect) {
+    unsigned long long nredirected;
+    MPI_Reduce(&rd.nredirected, &nredirected, 1, MPI_UNSIGNED_LONG_LONG,
+               MPI_SUM, 0, MPI_COMM_WORLD);
+    if (pctx.my_rank == 0) {
+      logf(LOG_INFO, "[redirect] %s writes sent to overflow partners",
+           pretty_num(nredirected).c_str());
+    }
+  }
+  free(rd.backlog);
+  rd.backlog = NULL;
+  free(rd.partner);
+  rd.partner = NULL;
+  free(et.nsent);
+  et.nsent = NULL;
+  free(rp.samples);
+  rp.samples = NULL;
+  rp.history.clear();
+  rp.epochs.clear();
+  rp.pivots.clear();
+  placement_table_free();
+  free(ctx->receivers);
+  ctx->receivers = NULL;
+  ctx->num_receivers = 0;
+  free(ctx->weights);
+  ctx->weights = NULL;
+  free(ctx->wbounds);
+  ctx->wbounds = NULL;
+  ctx->num_weights = 0;
 #ifdef PRELOAD_HAS_CH_PLACEMENT
   if (ctx->chp != NULL) {
     ch_placement_finalize(ctx->chp);
@@ -621,11 +1487,256 @@ unsigned char TOUCHAR(int input) {
   unsigned char rv = static_cast<unsigned char>(input);
   return rv;
 }
+
+/*
+ * recv_topo_init: pick "k" receivers out of the ranks of each node-local
+ * domain. a node is found through the ranks sharing its memory and may be
+ * further cut into "d" domains, such as one per numa node. domains are cut
+ * by node-local rank, which matches the common practice of binding
+ * consecutive ranks to the same socket. receivers are spread evenly inside
+ * each domain, and the first rank of each domain is always one, so world
+ * rank 0 is a receiver. must be called by all ranks.
+ */
+void recv_topo_init(shuffle_ctx_t* ctx, int k, int d) {
+  std::vector<int> all;
+  MPI_Comm node;
+  int local_rank;
+  int local_sz;
+  int dom;
+  int lo;
+  int hi;
+  int p;
+  int me;
+  int nnodes;
+  int i;
+
+  if (MPI_Comm_split_type(MPI_COMM_WORLD, MPI_COMM_TYPE_SHARED, pctx.my_rank,
+                          MPI_INFO_NULL, &node) != MPI_SUCCESS) {
+    ABORT("MPI_Comm_split_type");
+  }
+  MPI_Comm_rank(node, &local_rank);
+  MPI_Comm_size(node, &local_sz);
+  MPI_Comm_free(&node);
+
+  d = std::max(1, std::min(d, local_sz));
+  dom = static_cast<int>(int64_t(local_rank) * d / local_sz);
+  lo = static_cast<int>((int64_t(dom) * local_sz + d - 1) / d);
+  hi = static_cast<int>((int64_t(dom + 1) * local_sz + d - 1) / d);
+  k = std::min(k, hi - lo);
+  p = local_rank - lo;
+  /* bit 0: receiver, bit 1: first rank of the node */
+  me = (p == 0 || (p * k) / (hi - lo) != ((p - 1) * k) / (hi - lo)) ? 1 : 0;
+  if (local_rank == 0) me |= 2;
+
+  all.resize(pctx.comm_sz);
+  MPI_Allgather(&me, 1, MPI_INT, &all[0], 1, MPI_INT, MPI_COMM_WORLD);
+  ctx->num_receivers = 0;
+  nnodes = 0;
+  for (i = 0; i < pctx.comm_sz; i++) {
+    if (all[i] & 1) ctx->num_receivers++;
+    if (all[i] & 2) nnodes++;
+  }
+
+  if (pctx.my_rank == 0) {
+    logf(LOG_INFO,
+         "%d shuffle receivers over %d nodes\n>>> "
+         "up to %d receivers per domain, %d domains per node",
+         ctx->num_receivers, nnodes, k, d);
+  }
+  if (ctx->num_receivers == pctx.comm_sz) {
+    ctx->num_receivers = 0;
+    return; /* everyone is a receiver */
+  }
+
+  ctx->receivers = static_cast<int*>(malloc(sizeof(int) * ctx->num_receivers));
+  if (ctx->receivers == NULL) {
+    ABORT("malloc");
+  }
+  for (i = 0, p = 0; i < pctx.comm_sz; i++) {
+    if (all[i] & 1) ctx->receivers[p++] = i;
+  }
+}
+
+/*
+ * weight_probe: return the write bandwidth (in MB/s) of a directory as seen
+ * by us, measured by writing and syncing a small file into it. ranks sharing
+ * a device probe it at the same time and so see their share of it.
+ */
+double weight_probe(const char* dir) {
+  const size_t chunk = 1 << 20;
+  char path[PATH_MAX];
+  uint64_t t;
+  char* buf;
+  int fd;
+  int i;
+
+  snprintf(path, sizeof(path), "%s/.weight-probe-%d", dir, pctx.my_rank);
+  fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+  if (fd == -1) {
+    ABORT("open");
+  }
+  buf = static_cast<char*>(malloc(chunk));
+  if (buf == NULL) {
+    ABORT("malloc");
+  }
+  memset(buf, 0, chunk);
+  t = now_micros();
+  for (i = 0; i < DEFAULT_WEIGHT_PROBE_SIZE; i++) {
+    if (write(fd, buf, chunk) != ssize_t(chunk)) {
+      ABORT("write");
+    }
+  }
+  if (fsync(fd) != 0) {
+    ABORT("fsync");
+  }
+  t = now_micros() - t;
+  close(fd);
+  unlink(path);
+  free(buf);
+
+  return double(DEFAULT_WEIGHT_PROBE_SIZE * chunk) /
+         double(std::max<uint64_t>(t, 1));
+}
+
+/*
+ * weights_init: collect a capacity weight from each receiver and split the
+ * 32-bit hash space among receivers in proportion to their weights. return 0
+ * and leave placement unweighted if no rank has a weight configured or all
+ * receivers end up with the same weight. must be called by all ranks.
+ */
+int weights_init(shuffle_ctx_t* ctx) {
+  std::vector<double> all;
+  const char* env;
+  double total;
+  double acc;
+  double w;
+  int probed;
+  int any;
+  int on;
+  int n;
+  int i;
+
+  w = 1.0;
+  on = probed = 0;
+  env = maybe_getenv("SHUFFLE_Recv_weight_probe");
+  if (env != NULL) {
+    on = probed = 1;
+    if (ctx->is_receiver) w = weight_probe(env);
+  } else {
+    env = maybe_getenv("SHUFFLE_Recv_weight");
+    if (env != NULL) {
+      on = 1;
+      w = std::max(atof(env), 0.0);
+    }
+  }
+  MPI_Allreduce(&on, &any, 1, MPI_INT, MPI_MAX, MPI_COMM_WORLD);
+  if (!any) return 0;
+
+  all.resize(pctx.comm_sz);
+  MPI_Allgather(&w, 1, MPI_DOUBLE, &all[0], 1, MPI_DOUBLE, MPI_COMM_WORLD);
+  if (ctx->receivers != NULL) {
+    n = ctx->num_receivers;
+  } else {
+    n = (pctx.comm_sz + ctx->receiver_rate - 1) / ctx->receiver_rate;
+  }
+  total = 0;
+  for (i = 0; i < n; i++) total += all[receiver_at(ctx, i)];
+  for (i = 1; i < n; i++) {
+    if (all[receiver_at(ctx, i)] != all[receiver_at(ctx, 0)]) break;
+  }
+  if (i == n || total <= 0) {
+    if (pctx.my_rank == 0) {
+      logf(LOG_WARN, "receiver weights are all the same or all zero\n>>> "
+                     "weighted placement OFF");
+    }
+    return 0;
+  }
+
+  ctx->num_weights = n;
+  ctx->weights = static_cast<double*>(malloc(sizeof(double) * n));
+  ctx->wbounds = static_cast<unsigned long long*>(
+      malloc(sizeof(unsigned long long) * n));
+  if (ctx->weights == NULL || ctx->wbounds == NULL) {
+    ABORT("malloc");
+  }
+  acc = 0;
+  for (i = 0; i < n; i++) {
+    ctx->weights[i] = all[receiver_at(ctx, i)];
+    acc += ctx->weights[i];
+    ctx->wbounds[i] =
+        static_cast<unsigned long long>(acc / total * 4294967296.0);
+  }
+  ctx->wbounds[n - 1] = 1ULL << 32;
+
+  if (pctx.my_rank == 0) {
+    logf(LOG_INFO,
+         "weighted placement over %d receivers (%s)\n>>> "
+         "min weight: %.3f, max weight: %.3f, mean: %.3f",
+         n, probed ? "probed" : "configured",
+         *std::min_element(ctx->weights, ctx->weights + n),
+         *std::max_element(ctx->weights, ctx->weights + n), total / n);
+  }
+
+  return 1;
+}
+
+/*
+ * redirect_init: pair each receiver with the receiver half way across the
+ * list of receivers as its overflow partner, which is likely on a different
+ * node. must be called by all ranks.
+ */
+void redirect_init(shuffle_ctx_t* ctx) {
+  const char* env;
+  int n;
+  int i;
+
+  ctx->redirect = DEFAULT_REDIRECT_PCT;
+  env = maybe_getenv("SHUFFLE_Redirect_pct");
+  if (env != NULL) {
+    ctx->redirect = std::min(std::max(atoi(env), 0), 100);
+  }
+  ctx->redirect_backlog = DEFAULT_REDIRECT_BACKLOG;
+  env = maybe_getenv("SHUFFLE_Redirect_backlog");
+  if (env != NULL) {
+    ctx->redirect_backlog = std::max(atoi(env), 1);
+  }
+  if (ctx->receivers != NULL) {
+    n = ctx->num_receivers;
+  } else {
+    n = (pctx.comm_sz + ctx->receiver_rate - 1) / ctx->receiver_rate;
+  }
+  if (n < 2 || ctx->redirect == 0) {
+    ctx->redirect = 0;
+    return;
+  }
+  ctx->redirect_stride = n / 2;
+
+  rd.backlog = static_cast<unsigned int*>(
+      calloc(pctx.comm_sz, sizeof(unsigned int)));
+  rd.partner = static_cast<int*>(malloc(sizeof(int) * pctx.comm_sz));
+  if (rd.backlog == NULL || rd.partner == NULL) {
+    ABORT("malloc");
+  }
+  for (i = 0; i < pctx.comm_sz; i++) rd.partner[i] = -1;
+  for (i = 0; i < n; i++) {
+    rd.partner[receiver_at(ctx, i)] =
+        receiver_at(ctx, (i + ctx->redirect_stride) % n);
+  }
+  rd.nredirected = 0;
+
+  if (pctx.my_rank == 0) {
+    logf(LOG_INFO,
+         "shuffle redirect ON (%d%% of writes at a backlog of %u rpcs)\n>>> "
+         "receiver i overflows to receiver i + %d",
+         ctx->redirect, ctx->redirect_backlog, ctx->redirect_stride);
+  }
+}
 }  // namespace
 
 void shuffle_init(shuffle_ctx_t* ctx) {
   const char* proto;
   const char* env;
+  int group_sz;
   int world_sz;
   int vf;
   int n;
@@ -654,17 +1765,24 @@ void shuffle_init(shuffle_ctx_t* ctx) {
 
   ctx->receiver_rate = 1;
   ctx->receiver_mask = ~static_cast<unsigned int>(0);
-  env = maybe_getenv("SHUFFLE_Recv_radix");
-  if (env != NULL) {
+  env = maybe_getenv("SHUFFLE_Recv_per_node");
+  if (env != NULL && atoi(env) > 0) {
     n = atoi(env);
-    if (n > 8) n = 8;
-    if (n > 0) {
-      ctx->receiver_rate <<= n;
-      ctx->receiver_mask <<= n;
+    env = maybe_getenv("SHUFFLE_Recv_domains");
+    recv_topo_init(ctx, n, env != NULL ? atoi(env) : 1);
+  } else {
+    env = maybe_getenv("SHUFFLE_Recv_radix");
+    if (env != NULL) {
+      n = atoi(env);
+      if (n > 8) n = 8;
+      if (n > 0) {
+        ctx->receiver_rate <<= n;
+        ctx->receiver_mask <<= n;
+      }
     }
   }
   ctx->is_receiver = shuffle_is_rank_receiver(ctx, pctx.my_rank);
-  if (pctx.my_rank == 0) {
+  if (pctx.my_rank == 0 && ctx->receivers == NULL) {
     logf(LOG_INFO, "%u shuffle senders per receiver\n>>> receiver mask is %#x",
          ctx->receiver_rate, ctx->receiver_mask);
   }
@@ -696,6 +1814,26 @@ void shuffle_init(shuffle_ctx_t* ctx) {
            "will always invoke shuffle even addr is local");
     }
   }
+  if (is_envset("SHUFFLE_Epoch_markers")) {
+    ctx->markers = 1;
+    /* sender-only ranks never wait for markers so they could run ahead of
+     * receivers by any number of epochs */
+    if (!shuffle_is_everyone_receiver(ctx)) {
+      ctx->markers = 0;
+      if (pctx.my_rank == 0) {
+        logf(LOG_WARN,
+             "shuffle epoch markers require every rank to be a receiver\n>>> "
+             "falling back to barriers");
+      }
+    }
+  }
+  if (ctx->markers) {
+    if (pctx.my_rank == 0) {
+      logf(LOG_INFO,
+           "shuffle epoch markers ON\n>>> "
+           "receivers end epochs w/o waiting on global barriers");
+    }
+  }
   if (is_envset("SHUFFLE_Use_multihop")) {
     ctx->type = SHUFFLE_XN;
     if (pctx.my_rank == 0) {
@@ -712,47 +1850,137 @@ void shuffle_init(shuffle_ctx_t* ctx) {
   if (ctx->type == SHUFFLE_XN) {
     xn_ctx_t* rep = static_cast<xn_ctx_t*>(malloc(sizeof(xn_ctx_t)));
     memset(rep, 0, sizeof(xn_ctx_t));
-    xn_shuffler_init(rep);
+    rep->markers = ctx->markers;
+    xn_shuffler_init(rep, 1 + ctx->fname_len + ctx->data_len +
+                              ctx->extra_data_len);
     world_sz = xn_shuffler_world_size(rep);
     ctx->rep = rep;
   } else {
     nn_shuffler_init(ctx);
     world_sz = nn_shuffler_world_size();
   }
-
-#ifdef PRELOAD_HAS_CH_PLACEMENT
-  if (!IS_BYPASS_PLACEMENT(pctx.mode)) {
-    env = maybe_getenv("SHUFFLE_Virtual_factor");
-    if (env == NULL) {
-      vf = DEFAULT_VIRTUAL_FACTOR;
-    } else {
-      vf = atoi(env);
+  if (ctx->markers) {
+    et.nsent = static_cast<unsigned long long*>(
+        calloc(world_sz, sizeof(unsigned long long)));
+    if (et.nsent == NULL) {
+      ABORT("malloc");
     }
+  }
+  if (is_envset("SHUFFLE_Range_placement")) {
+    ctx->range = 1;
+    range_init(ctx, world_sz);
+  }
 
+  /* names are placed over receivers when those are picked by topology, or
+   * over all ranks and then masked down to receivers otherwise */
+  group_sz = ctx->receivers != NULL ? ctx->num_receivers : world_sz;
+  ctx->placement = SHUFFLE_PLACE_MODULO;
+  vf = 0;
+  proto = NULL;
+  if (weights_init(ctx)) {
+    ctx->placement = SHUFFLE_PLACE_WEIGHTED;
+  } else if (!IS_BYPASS_PLACEMENT(pctx.mode)) {
     proto = maybe_getenv("SHUFFLE_Placement_protocol");
     if (proto == NULL) {
       proto = DEFAULT_PLACEMENT_PROTO;
     }
 
-    ctx->chp = ch_placement_initialize(proto, world_sz, vf /* vir factor */,
-                                       0 /* hash seed */);
-    if (ctx->chp == NULL) {
-      ABORT("ch_init");
+    if (strcmp(proto, "jump") == 0) {
+      ctx->placement = SHUFFLE_PLACE_JUMP;
+    } else if (strcmp(proto, "rendezvous") == 0) {
+      ctx->placement = SHUFFLE_PLACE_HRW;
+      placement_hrw_init(group_sz);
+    } else {
+#ifdef PRELOAD_HAS_CH_PLACEMENT
+      env = maybe_getenv("SHUFFLE_Virtual_factor");
+      if (env == NULL) {
+        vf = DEFAULT_VIRTUAL_FACTOR;
+      } else {
+        vf = atoi(env);
+      }
+
+      ctx->chp = ch_placement_initialize(proto, group_sz, vf /* vir factor */,
+                                         0 /* hash seed */);
+      if (ctx->chp == NULL) {
+        ABORT("ch_init");
+      }
+
+      ctx->placement = SHUFFLE_PLACE_CH;
+      if (world_sz != 1) {
+        placement_ch_init(ctx, group_sz, vf);
+      }
+#endif
     }
   }
 
   if (pctx.my_rank == 0) {
-    if (!IS_BYPASS_PLACEMENT(pctx.mode)) {
+    if (ctx->placement == SHUFFLE_PLACE_CH) {
       logf(LOG_INFO,
            "ch-placement group size: %s (vir-factor: %s, proto: %s)\n>>> "
            "possible protocols are: "
            "static_modulo, hash_lookup3, xor, and ring",
-           pretty_num(world_sz).c_str(), pretty_num(vf).c_str(), proto);
-    } else {
+           pretty_num(group_sz).c_str(), pretty_num(vf).c_str(), proto);
+      if (pt.table != NULL) {
+        logf(LOG_INFO,
+             "ch-placement table: %s entries (%d bits, %.2f%% exact)",
+             pretty_num(double(1ULL << pt.bits)).c_str(), pt.bits,
+             100.0 * double(pt.nexact) / double(1ULL << pt.bits));
+      }
+    } else if (ctx->placement == SHUFFLE_PLACE_JUMP ||
+               ctx->placement == SHUFFLE_PLACE_HRW) {
+      logf(LOG_INFO, "%s placement group size: %s (table: %s slots)",
+           placement_name(ctx->placement), pretty_num(group_sz).c_str(),
+           pt.table != NULL ? pretty_num(double(1ULL << pt.bits)).c_str()
+                            : "none");
+    } else if (ctx->placement == SHUFFLE_PLACE_MODULO) {
+#ifdef PRELOAD_HAS_CH_PLACEMENT
       logf(LOG_INFO, "ch-placement bypassed");
+#endif
+    }
+  }
+
+  if (is_envset("SHUFFLE_Redirect")) {
+    if (ctx->type == SHUFFLE_XN) {
+      if (pctx.my_rank == 0) {
+        logf(LOG_WARN,
+             "shuffle redirect requires the NN shuffler\n>>> "
+             "redirect OFF");
+      }
+    } else if (pctx.sideft) {
+      /* receivers put names into the filter of their own partition, so
+       * redirected names would be missing from the filter readers consult */
+      if (pctx.my_rank == 0) {
+        logf(LOG_WARN,
+             "shuffle redirect does not work with bloomy dirs\n>>> "
+             "redirect OFF");
+      }
+    } else if (!is_envset("SHUFFLE_Use_worker_thread")) {
+      /* receivers only know their rpc backlog when rpcs are handled by a
+       * worker thread, so there would be nothing to redirect on */
+      if (pctx.my_rank == 0) {
+        logf(LOG_WARN,
+             "shuffle redirect requires SHUFFLE_Use_worker_thread\n>>> "
+             "redirect OFF");
+      }
+    } else {
+      redirect_init(ctx);
+    }
+  }
+
+  if (pctx.my_rank == 0 && pctx.verbose && world_sz != 1) {
+    const double ns = placement_bench(ctx, group_sz, 1 << 20);
+    if (pt.table != NULL && ctx->placement == SHUFFLE_PLACE_CH) {
+      int* const table = pt.table;
+      pt.table = NULL; /* time ch-placement alone */
+      const double ns0 = placement_bench(ctx, group_sz, 1 << 20);
+      pt.table = table;
+      logf(LOG_INFO, "[place] %s: %.1f ns/op (w/o table: %.1f ns/op)",
+           placement_name(ctx->placement), ns, ns0);
+    } else {
+      logf(LOG_INFO, "[place] %s: %.1f ns/op",
+           placement_name(ctx->placement), ns);
     }
   }
-#endif
 
   if (pctx.my_rank == 0 && pctx.verbose) {
     logf(LOG_INFO, "HG is configured as follows ...");
@@ -784,11 +2012,14 @@ void shuffle_init(shuffle_ctx_t* ctx) {
 
 int shuffle_is_everyone_receiver(shuffle_ctx_t* ctx) {
   assert(ctx != NULL);
-  return ctx->receiver_rate == 1;
+  return ctx->receiver_rate == 1 && ctx->receivers == NULL;
 }
 
 int shuffle_is_rank_receiver(shuffle_ctx_t* ctx, int rank) {
   assert(ctx != NULL);
+  if (ctx->receivers != NULL)
+    return std::binary_search(ctx->receivers,
+                              ctx->receivers + ctx->num_receivers, rank);
   if (ctx->receiver_rate == 1) return 1;
   return (rank & ctx->receiver_mask) == rank;
 }
@@ -829,16 +2060,50 @@ void shuffle_pause(shuffle_ctx_t* ctx) {
   }
 }
 
+void shuffle_progress(shuffle_ctx_t* ctx) {
+  assert(ctx != NULL);
+  if (ctx->type == SHUFFLE_XN) {
+    if (ctx->rep != NULL) {
+      xn_shuffler_progress(static_cast<xn_ctx_t*>(ctx->rep));
+    }
+  } else {
+    nn_shuffler_progress();
+  }
+}
+
 void shuffle_msg_sent(size_t n, void** arg1, void** arg2) {
-  pctx.mctx.min_nms++;
-  pctx.mctx.max_nms++;
-  pctx.mctx.nms++;
+  /* may be called by several dumping threads at once */
+  __sync_fetch_and_add(&pctx.mctx.min_nms, 1);
+  __sync_fetch_and_add(&pctx.mctx.max_nms, 1);
+  __sync_fetch_and_add(&pctx.mctx.nms, 1);
 }
 
 void shuffle_msg_replied(void* arg1, void* arg2) {
   pctx.mctx.nmd++; /* delivered */
 }
 
+void shuffle_backlog(shuffle_ctx_t* ctx, int peer_rank,
+                     unsigned int backlog) {
+  assert(ctx != NULL);
+  if (!ctx->redirect) return;
+  rd.backlog[peer_rank] = backlog;
+}
+
+int shuffle_overflow_partner(shuffle_ctx_t* ctx, int rank) {
+  assert(ctx != NULL);
+  if (!ctx->redirect) return -1;
+  return rd.partner[rank];
+}
+
+int shuffle_range_pivots(shuffle_ctx_t* ctx, int i, int* epoch,
+                         const uint64_t** pivots) {
+  assert(ctx != NULL);
+  if (!ctx->range || i >= static_cast<int>(rp.history.size())) return -1;
+  *epoch = rp.epochs[i];
+  *pivots = rp.history[i].empty() ? NULL : &rp.history[i][0];
+  return static_cast<int>(rp.history[i].size());
+}
+
 void shuffle_msg_received() {
   pctx.mctx.min_nmr++;
   pctx.mctx.max_nmr++;
@@ -45,10 +45,47 @@
  *  SHUFFLE_Placement_protocol
  *    Protocol name for initializing placement groups
  *      such as static_modulo, hash_spooky, hash_lookup3, xor, as well as ring
+ *      Also jump (jump consistent hash) and rendezvous, which are native
+ *      and do not require ch-placement
+ *  SHUFFLE_Placement_table_bits
+ *    Size (in bits) of the flat hash-prefix-to-rank table used to speed up
+ *      ch-placement or to implement rendezvous placement; 0 disables the
+ *      table for ch-placement
  *  SHUFFLE_Virtual_factor
  *    Virtual factor used by nodes in a placement group
+ *  SHUFFLE_Range_placement
+ *    Place particles by name ranges instead of by hash
+ *      Pivots are picked from names sampled in the previous epoch
+ *  SHUFFLE_Range_samples
+ *    Number of names each rank samples per epoch for range pivots
+ *  SHUFFLE_Range_repivot
+ *    Recompute range pivots once a receiver exceeds the mean load by
+ *      this much (in percent)
  *  SHUFFLE_Recv_radix
  *    Number of senders (1**radix) per receiver
+ *  SHUFFLE_Recv_per_node
+ *    Number of receivers per node (or per node domain), picked by
+ *      node-local rank; overrides SHUFFLE_Recv_radix
+ *  SHUFFLE_Recv_domains
+ *    Number of domains (such as numa nodes) each node is cut into
+ *      for picking receivers, by node-local rank
+ *  SHUFFLE_Recv_weight
+ *    Capacity weight of a receiver; receivers get shares of the hash
+ *      space in proportion to their weights
+ *  SHUFFLE_Recv_weight_probe
+ *    Directory to probe for write bandwidth; receivers use the measured
+ *      bandwidth as their weight (overrides SHUFFLE_Recv_weight)
+ *  SHUFFLE_Redirect
+ *    Redirect part of the writes for hot receivers to overflow partners
+ *      Receivers report their backlog in rpc replies (NN shuffler only,
+ *      not with bloomy dirs)
+ *  SHUFFLE_Redirect_pct
+ *    Percent of writes for a hot receiver to redirect
+ *  SHUFFLE_Redirect_backlog
+ *    Number of incoming rpcs pending at a receiver for it to be hot
+ *  SHUFFLE_Epoch_markers
+ *    End epochs with per-receiver end-of-epoch markers instead of barriers
+ *      Each receiver flushes an epoch once all its inbound writes arrived
  *  SHUFFLE_Finalize_pause
  *    Number of secs to sleep after releasing the shuffle instance
  *      for shuffle bg threads to complete shutdown
@@ -77,7 +114,38 @@ typedef struct shuffle_ctx {
   unsigned int receiver_rate; /* only 1/receiver_rate ranks are receivers */
   /* (rank & receiver_mask) -> receiver_rank */
   unsigned int receiver_mask;
+  /* ranks of all receivers, in rank order, when receivers are picked by
+   * node topology instead of by receiver_mask. names are placed over
+   * receivers[0 .. num_receivers). NULL if not in use. */
+  int* receivers;
+  int num_receivers;
+  /* capacity weights of receivers and the hash space split they imply:
+   * the i-th receiver owns 32-bit name hashes in [wbounds[i - 1], wbounds[i]).
+   * NULL unless placement is weighted. */
+  double* weights;
+  unsigned long long* wbounds;
+  int num_weights;
   int is_receiver;
+  /* end epochs with in-band markers rather than global barriers. senders
+   * tell each receiver how many writes they sent it in an epoch, so a
+   * receiver knows by itself when all writes of an epoch have arrived. */
+  int markers;
+  /* place writes by name ranges whose pivots are sampled from the data */
+  int range;
+  /* percent of writes for a hot receiver to send to its overflow partner
+   * instead, or 0 if off. a receiver is hot once its backlog reaches
+   * redirect_backlog. the partner of the i-th receiver is the
+   * (i + redirect_stride)-th one. */
+  int redirect;
+  unsigned int redirect_backlog;
+  int redirect_stride;
+  /* how names are hashed to ranks when not placed by range */
+  int placement;
+#define SHUFFLE_PLACE_MODULO 0   /* xxhash32 % world_sz */
+#define SHUFFLE_PLACE_CH 1       /* ch-placement */
+#define SHUFFLE_PLACE_JUMP 2     /* jump consistent hash */
+#define SHUFFLE_PLACE_HRW 3      /* rendezvous hashing */
+#define SHUFFLE_PLACE_WEIGHTED 4 /* xxhash32 over capacity-weighted shares */
   unsigned char fname_len;
   unsigned char extra_data_len;
   unsigned char data_len;
@@ -120,6 +188,14 @@ int shuffle_write(shuffle_ctx_t* ctx, const char* fname,
                   unsigned char fname_len, char* data, unsigned char data_len,
                   int epoch);
 
+/*
+ * shuffle_write_to: same as shuffle_write() but with the destination already
+ * known, such as from an earlier call to shuffle_target_batch().
+ */
+int shuffle_write_to(shuffle_ctx_t* ctx, const char* fname,
+                     unsigned char fname_len, char* data,
+                     unsigned char data_len, int epoch, int peer_rank);
+
 /*
  * shuffle_epoch_start: perform necessary flushes at the
  * beginning of an epoch.
@@ -138,11 +214,36 @@ void shuffle_epoch_pre_start(shuffle_ctx_t* ctx);
 
 /*
  * shuffle_epoch_end: perform necessary flushes at the
- * end of an epoch.
+ * end of an epoch. if epoch markers are on, also tell each receiver
+ * how many writes we have sent it in the epoch.
+ *
+ * abort on errors.
+ */
+void shuffle_epoch_end(shuffle_ctx_t* ctx, int epoch);
+
+/*
+ * shuffle_epoch_wait: wait until we have received and processed all writes
+ * sent to us in a given epoch. requires epoch markers.
+ *
+ * abort on errors.
+ */
+void shuffle_epoch_wait(shuffle_ctx_t* ctx, int epoch);
+
+/*
+ * shuffle_epoch_open: mark the beginning of a new epoch at the receiver side
+ * and process writes that peers sent ahead of us for that epoch. requires
+ * epoch markers.
  *
  * abort on errors.
  */
-void shuffle_epoch_end(shuffle_ctx_t* ctx);
+void shuffle_epoch_open(shuffle_ctx_t* ctx, int epoch);
+
+/*
+ * shuffle_epoch_marker: process an incoming end-of-epoch marker telling us
+ * that "peer_rank" has sent us "nwrites" writes in "epoch".
+ */
+void shuffle_epoch_marker(shuffle_ctx_t* ctx, int peer_rank, int epoch,
+                          unsigned long long nwrites);
 
 /*
  * shuffle_finalize: shutdown the shuffle service and release resources.
@@ -164,11 +265,26 @@ void shuffle_pause(shuffle_ctx_t* ctx);
  */
 void shuffle_resume(shuffle_ctx_t* ctx);
 
+/*
+ * shuffle_progress: push out whatever the shuffle has buffered. meant to be
+ * called by the main thread while it waits on other ranks so that the wait
+ * is not wasted. no-op if shuffle is not running.
+ */
+void shuffle_progress(shuffle_ctx_t* ctx);
+
 /*
  * shuffle_target: return the shuffle destination for a given req.
  */
 int shuffle_target(shuffle_ctx_t* ctx, char* buf, unsigned int buf_sz);
 
+/*
+ * shuffle_target_batch: same as shuffle_target() but for n reqs at once.
+ * targets[i] is set to the destination of bufs[i]. reqs are hashed several
+ * at a time using simd instructions when possible.
+ */
+void shuffle_target_batch(shuffle_ctx_t* ctx, char* const* bufs, int n,
+                          int* targets);
+
 /*
  * shuffle_handle: process an incoming shuffled write. here "peer_rank" refers
  * to the original sender, and "rank" refers to us.
@@ -178,6 +294,38 @@ int shuffle_target(shuffle_ctx_t* ctx, char* buf, unsigned int buf_sz);
 int shuffle_handle(shuffle_ctx_t* ctx, char* buf, unsigned int buf_sz,
                    int epoch, int peer_rank, int rank);
 
+/*
+ * shuffle_handle_batch: process a batch of incoming shuffled writes. all
+ * writes must be of the same size. "peer_ranks" holds the original sender of
+ * each write, and "rank" refers to us.
+ *
+ * return 0 on success, or EOF on errors.
+ */
+int shuffle_handle_batch(shuffle_ctx_t* ctx, char* const* bufs, int n,
+                         unsigned int buf_sz, int epoch, const int* peer_ranks,
+                         int rank);
+
+/*
+ * shuffle_backlog: callback for a shuffle sender to report the backlog
+ * a receiver piggybacked on an rpc reply.
+ */
+void shuffle_backlog(shuffle_ctx_t* ctx, int peer_rank, unsigned int backlog);
+
+/*
+ * shuffle_overflow_partner: return the rank that may take writes redirected
+ * from a given receiver, or -1 if writes are never redirected.
+ */
+int shuffle_overflow_partner(shuffle_ctx_t* ctx, int rank);
+
+/*
+ * shuffle_range_pivots: return the i-th set of pivots computed under range
+ * placement through *pivots and the epoch from which it was used through
+ * *epoch. pivots[k] is the first name key owned by receiver k + 1. return
+ * the number of pivots in the set, or -1 if there is no i-th set.
+ */
+int shuffle_range_pivots(shuffle_ctx_t* ctx, int i, int* epoch,
+                         const uint64_t** pivots);
+
 /*
  * shuffle_msg_sent: callback for a shuffle sender to
  * notify the main system of the sending of an rpc request.
@@ -66,6 +66,7 @@
  *  -c count     number of shuffle send ops to perform
  *  -e           exclude sending to ourself (skip those sends)
  *  -f rate      do a flush (collective) every 'rate' sends
+ *  -k           compress reqs in network RPCs (remote hop only)
  *  -l           loop through dsts rather than random sends
  *  -n minsndr   rank must be >= minsndr to send requests
  *  -o m         add 'm' msec output delay to delivery
@@ -76,6 +77,8 @@
  *  -s maxsndr   rank must be <= maxsndr to send requests
  *  -T           report extra time/usage stats info for instance thread
  *  -t secs      timeout (alarm)
+ *  -w           use the fixed-record RPC format (all reqs are -i bytes)
+ *  -x           zero-copy decode of inbound RPCs (reqs point into RPC buf)
  *
  * shuffler queue config:
  *  -B bytes     batch buffer target for network output queues
@@ -98,6 +101,9 @@
  *
  * (so 3*sizeof(int) == 12, assuming 32 bit ints).  the "-i" flag can
  * be used to add additional un-used data to the payload if desired.
+ * use it with "-x" to see how the payload size affects the cost of
+ * copying reqs out of inbound RPCs, and run with and without "-w" to
+ * compare the fixed-record and variable RPC encodings.
  *
  * logging related options (rank <= max can have xtra logging, use -X):
  *  -C mask      mask cfg for non-extra rank procs
@@ -318,6 +324,9 @@ struct gs {
     int maxsndr;             /* rank must be <= maxsndr to send requests */
     int timestats;           /* report extra time/usage stats for instance */
     int timeout;             /* alarm timeout */
+    int zerocopy;            /* decode inbound RPCs in place */
+    int fixedrec;            /* use fixed-record RPC format */
+    int compress;            /* compress network RPCs */
 
     char tagsuffix[64];      /* tag suffix: ninst-count-mode-limit-run# */
 
@@ -404,6 +413,7 @@ static void usage(const char *msg) {
     fprintf(stderr, "\t-c count    number of shuffle send ops to perform\n");
     fprintf(stderr, "\t-e          exclude sending to self (skip sends)\n");
     fprintf(stderr, "\t-f rate     do a flush every 'rate' sends\n");
+    fprintf(stderr, "\t-k          compress network RPCs\n");
     fprintf(stderr, "\t-l          loop through dsts (no random sends)\n");
     fprintf(stderr, "\t-n minsndr  rank must be >= minsndr to send requests\n");
     fprintf(stderr, "\t-o m        add 'm' msec output delay to delivery\n");
@@ -414,6 +424,8 @@ static void usage(const char *msg) {
     fprintf(stderr, "\t-s maxsndr  rank must be <= maxsndr to send requests\n");
     fprintf(stderr, "\t-T          extra time/usage stats for instance\n");
     fprintf(stderr, "\t-t sec      timeout (alarm), in seconds\n");
+    fprintf(stderr, "\t-w          use fixed-record RPC format\n");
+    fprintf(stderr, "\t-x          zero-copy decode of inbound RPCs\n");
 
     fprintf(stderr, "shuffler queue config:\n");
     fprintf(stderr, "\t-B bytes    batch buf target for network\n");
@@ -507,7 +519,7 @@ int main(int argc, char **argv) {
     g.max_xtra = g.size;
 
     while ((ch = getopt(argc, argv,
-    "a:B:b:C:c:D:d:E:eF:f:h:I:i:LlM:m:n:O:o:p:qR:r:S:s:Tt:X:y:Z:z:")) != -1) {
+    "a:B:b:C:c:D:d:E:eF:f:h:I:i:kLlM:m:n:O:o:p:qR:r:S:s:Tt:wX:xy:Z:z:")) != -1) {
         switch (ch) {
             case 'a':
                 g.buftarg_origin = atoi(optarg);
@@ -560,6 +572,9 @@ int main(int argc, char **argv) {
                 g.inreqsz = getsize(optarg);
                 if (g.inreqsz <= 12) usage("bad inreqsz (must be > 12)");
                 break;
+            case 'k':
+                g.compress = 1;
+                break;
             case 'L':
                 g.lenable = 1;
                 break;
@@ -621,9 +636,15 @@ int main(int argc, char **argv) {
                 g.timeout = atoi(optarg);
                 if (g.timeout < 0) usage("bad timeout");
                 break;
+            case 'w':
+                g.fixedrec = 1;
+                break;
             case 'X':
                 g.max_xtra = atoi(optarg);
                 break;
+            case 'x':
+                g.zerocopy = 1;
+                break;
             case 'y':
                 g.maxrpcs_relay = atoi(optarg);
                 if (g.maxrpcs_relay < 1) usage("bad maxrpc relay");
@@ -674,6 +695,9 @@ int main(int argc, char **argv) {
         printf("\tmaxsndr    = %d\n", g.maxsndr);
         printf("\ttimestats  = %s\n", (g.timestats) ? "on" : "off");
         printf("\ttimeout    = %d\n", g.timeout);
+        printf("\tzerocopy   = %s\n", (g.zerocopy) ? "on" : "off");
+        printf("\trpcformat  = %s\n", (g.fixedrec) ? "fixed" : "variable");
+        printf("\tcompress   = %s\n", (g.compress) ? "on" : "off");
         printf("sizes:\n");
         printf("\tbuftarget  = %d / %d / %d (net/origin/relay)\n",
                g.buftarg_net, g.buftarg_origin, g.buftarg_relay);
@@ -801,7 +825,12 @@ void *run_instance(void *arg) {
                    g.remoterpclim, g.maxrpcs_origin,
                    g.buftarg_origin, g.maxrpcs_relay, g.buftarg_relay,
                    g.maxrpcs_net, g.buftarg_net, g.deliverq_max,
-                   g.deliverq_thold, do_delivery);
+                   g.deliverq_thold, (g.fixedrec) ? mylen : 0,
+                   do_delivery);
+    if (g.zerocopy)
+        shuffler_set_zerocopy(isa[n].shand, 1);
+    if (g.compress)
+        shuffler_set_compress(isa[n].shand, 1);
     flcnt = 0;
 
     if (myrank >= g.minsndr && myrank <= g.maxsndr) {   /* are we a sender? */
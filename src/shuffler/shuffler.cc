@@ -51,6 +51,7 @@
 #include <deltafs-nexus/deltafs-nexus_api.h>
 
 #include "shuffler.h"
+#include "shufzip.h"
 
 #define SHUFFLER_COUNT           /* enable/disable internal counters */
 #define SHUFFLER_TIMEOUT 300     /* API blocking timeout, in seconds */
@@ -424,6 +425,18 @@ static int do_cond_timedwait(struct shuffler *sh, pthread_cond_t *ccv,
 #define shufzero(X)    /* nothing */
 #endif
 
+/*
+ * cputime_usec: cpu time used by the calling thread, in usec
+ * (used to charge compression costs)
+ */
+static uint64_t cputime_usec() {
+  struct timespec ts;
+
+  if (clock_gettime(CLOCK_THREAD_CPUTIME_ID, &ts) < 0)
+    return(0);
+  return((uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000);
+}
+
 /*
  * RPC handler registered with mercury
  */
@@ -456,7 +469,8 @@ static hg_return_t forward_reqs_now(struct request_queue *tosendq,
                                     struct shuffler *sh, struct outset *oset,
                                     struct outqueue *oq, struct output *oput);
 static int purge_reqs(struct shuffler *sh);
-static int purge_reqs_outset(struct shuffler *sh, struct outset *oset);
+static int purge_reqs_outset(struct shuffler *sh, struct outset *oset,
+                             std::vector<hg_handle_t> *dhands);
 static hg_return_t req_parent_init(struct shuffler *sh,
                                    struct req_parent **parentp,
                                    struct request *req, hg_handle_t input,
@@ -479,6 +493,349 @@ static void stop_threads(struct shuffler *sh);
 static void start_qflush(struct shuffler *sh, struct outset *oset,
                          struct outqueue *oq);
 
+/*
+ * request allocation.  malloc/free of a small request for every
+ * message on every hop is expensive, so requests from shuffler_send()
+ * come from a set of size-classed slabs with free lists, and requests
+ * decoded from an inbound RPC are carved out of reqblks (one or more
+ * per RPC).   in zero-copy mode (shuffler_set_zerocopy) decoded requests
+ * point into the RPC's input buffer rather than having their data
+ * copied into the reqblk.   requests larger than the largest slab class fall back
+ * to malloc.   the pool is shared by all shufflers in the process
+ * since decoded requests are not tied to any one shuffler and may be
+ * freed by any of our threads.   each thread keeps a small cache of
+ * free slab chunks (see struct reqcache) so that the shared free
+ * lists (and reqpool_lock) are only touched once per REQPOOL_BATCH
+ * allocs or frees.
+ */
+static pthread_mutex_t reqpool_lock = PTHREAD_MUTEX_INITIALIZER;
+static struct reqpool reqpool;
+static __thread struct reqcache reqcache;
+
+/* reqpool_addbytes: atomically adjust byte count and peak */
+#define reqpool_addbytes(N) do {                                 \
+    uint64_t _nb = __sync_add_and_fetch(&reqpool.bytes, (N));    \
+    uint64_t _pk;                                                \
+    while (_nb > (_pk = reqpool.peakbytes) &&                    \
+           !__sync_bool_compare_and_swap(&reqpool.peakbytes, _pk, _nb)) \
+      ;                                                          \
+} while (0)
+
+/* reqpool_subbytes: atomically drop byte count */
+#define reqpool_subbytes(N) (void)__sync_sub_and_fetch(&reqpool.bytes, (N))
+
+/* reqpool_count: atomically bump a counter */
+#define reqpool_count(X, N) (void)__sync_fetch_and_add(&reqpool.X, (N))
+
+/* reqpool_chunksz: size of a chunk in slab class "c" */
+#define reqpool_chunksz(C) \
+    (sizeof(struct request) + (REQPOOL_MINDATA << (C)))
+
+/*
+ * reqpool_attach: attach a new shuffler to the request pool
+ */
+static void reqpool_attach() {
+  int lcv;
+
+  pthread_mutex_lock(&reqpool_lock);
+  if (reqpool.users++ == 0) {
+    reqpool.gen++;              /* invalidates all old reqcaches */
+    for (lcv = 0 ; lcv < REQPOOL_NCLASS ; lcv++) {
+      reqpool.cls[lcv].maxdata = REQPOOL_MINDATA << lcv;
+      reqpool.cls[lcv].freelist = NULL;
+    }
+  }
+  pthread_mutex_unlock(&reqpool_lock);
+}
+
+/*
+ * reqpool_detach: detach a shuffler from the request pool.   the
+ * last one out releases the slabs (all requests must have been freed).
+ */
+static void reqpool_detach() {
+  std::vector<void *>::iterator it;
+  int lcv;
+
+  pthread_mutex_lock(&reqpool_lock);
+  if (--reqpool.users == 0) {
+    for (lcv = 0 ; lcv < REQPOOL_NCLASS ; lcv++) {
+      for (it = reqpool.cls[lcv].slabs.begin() ;
+           it != reqpool.cls[lcv].slabs.end() ; it++) {
+        free(*it);
+        reqpool_subbytes(REQPOOL_SLABSZ);
+      }
+      reqpool.cls[lcv].slabs.clear();
+      reqpool.cls[lcv].freelist = NULL;
+    }
+  }
+  pthread_mutex_unlock(&reqpool_lock);
+}
+
+/*
+ * reqcache_get: return this thread's reqcache, emptying it if it
+ * holds chunks of slabs that have since been released.
+ */
+static struct reqcache *reqcache_get() {
+  struct reqcache *rc = &reqcache;
+
+  if (rc->gen != reqpool.gen) {
+    memset(rc, 0, sizeof(*rc));
+    rc->gen = reqpool.gen;
+  }
+  return(rc);
+}
+
+/*
+ * reqcache_fill: move up to REQPOOL_BATCH free chunks of class "c"
+ * from the shared free list into a thread's cache, growing the class
+ * by a slab if the shared list is empty.
+ *
+ * @param rc the thread's cache
+ * @param c the slab class
+ * @return 0 on success, -1 on malloc failure
+ */
+static int reqcache_fill(struct reqcache *rc, int c) {
+  struct reqslab_class *cls = &reqpool.cls[c];
+  size_t chunksz;
+  char *slab;
+  void *chunk;
+  int lcv;
+
+  pthread_mutex_lock(&reqpool_lock);
+  reqpool.hits += rc->hits;
+  rc->hits = 0;
+  if (cls->freelist == NULL) {    /* need to grow */
+    slab = (char *) malloc(REQPOOL_SLABSZ);
+    if (slab == NULL) {
+      pthread_mutex_unlock(&reqpool_lock);
+      return(-1);
+    }
+    chunksz = reqpool_chunksz(c);
+    for (lcv = REQPOOL_SLABSZ / chunksz - 1 ; lcv >= 0 ; lcv--) {
+      *(void **)(slab + lcv * chunksz) = cls->freelist;
+      cls->freelist = slab + lcv * chunksz;
+    }
+    cls->slabs.push_back(slab);
+    reqpool.grows++;
+    reqpool_addbytes(REQPOOL_SLABSZ);
+  }
+  for (lcv = 0 ; lcv < REQPOOL_BATCH && cls->freelist ; lcv++) {
+    chunk = cls->freelist;
+    cls->freelist = *(void **)chunk;
+    *(void **)chunk = rc->freelist[c];
+    rc->freelist[c] = chunk;
+    rc->nfree[c]++;
+  }
+  pthread_mutex_unlock(&reqpool_lock);
+  return(0);
+}
+
+/*
+ * reqcache_drain: return REQPOOL_BATCH free chunks of class "c"
+ * from a thread's cache to the shared free list.
+ *
+ * @param rc the thread's cache
+ * @param c the slab class
+ */
+static void reqcache_drain(struct reqcache *rc, int c) {
+  struct reqslab_class *cls = &reqpool.cls[c];
+  void *chunk;
+  int lcv;
+
+  pthread_mutex_lock(&reqpool_lock);
+  for (lcv = 0 ; lcv < REQPOOL_BATCH && rc->freelist[c] ; lcv++) {
+    chunk = rc->freelist[c];
+    rc->freelist[c] = *(void **)chunk;
+    rc->nfree[c]--;
+    *(void **)chunk = cls->freelist;
+    cls->freelist = chunk;
+  }
+  pthread_mutex_unlock(&reqpool_lock);
+}
+
+/*
+ * req_alloc: allocate a request with room for "datalen" bytes of data.
+ * the data pointer is set, all other fields are left for the caller.
+ *
+ * @param datalen the size of the data
+ * @return the new request or NULL on malloc failure
+ */
+static struct request *req_alloc(uint32_t datalen) {
+  struct reqcache *rc;
+  struct request *req;
+  int c;
+
+  for (c = 0 ; c < REQPOOL_NCLASS ; c++) {
+    if (datalen <= (uint32_t)(REQPOOL_MINDATA << c))
+      break;
+  }
+
+  if (c == REQPOOL_NCLASS) {      /* too big, fall back to malloc */
+    req = (struct request *) malloc(sizeof(*req) + datalen);
+    if (req == NULL)
+      return(NULL);
+    req->rclass = REQ_CLASS_MALLOC;
+    reqpool_count(mallocs, 1);
+    reqpool_addbytes(sizeof(*req) + datalen);
+  } else {
+    rc = reqcache_get();
+    if (rc->freelist[c] == NULL && reqcache_fill(rc, c) != 0)
+      return(NULL);
+    req = (struct request *) rc->freelist[c];
+    rc->freelist[c] = *(void **)req;
+    rc->nfree[c]--;
+    rc->hits++;
+    req->rclass = c;
+  }
+
+  req->blk = NULL;
+  req->data = (char *)req + sizeof(*req);
+  return(req);
+}
+
+/*
+ * reqblk_dref: drop a reference to a reqblk, freeing it if it
+ * was the last one.   if "dhands" is not NULL, the RPC handle
+ * holding the input buffer is appended to it rather than destroyed
+ * here.  callers holding a shuffler lock use this to defer the
+ * HG_Destroy() until after they have dropped the lock (see
+ * delivery_main()).
+ *
+ * @param blk the reqblk to drop
+ * @param dhands list of handles for the caller to destroy (or NULL)
+ */
+static void reqblk_dref(struct reqblk *blk,
+                        std::vector<hg_handle_t> *dhands) {
+  hg_handle_t hand;
+
+  if (acnt32_decr(blk->nrefs) != 0)
+    return;
+  reqpool_subbytes(sizeof(*blk) + blk->size);
+  hand = blk->hand;
+  acnt32_free(&blk->nrefs);
+  free(blk);
+  if (hand == NULL)
+    return;
+  if (dhands)
+    dhands->push_back(hand);    /* caller releases it after unlocking */
+  else
+    HG_Destroy(hand);           /* release the RPC's input buffer */
+}
+
+/*
+ * destroy_hands: destroy RPC handles deferred by reqblk_dref().
+ * must be called without holding any shuffler locks.
+ *
+ * @param dhands the list of handles (cleared on return)
+ */
+static void destroy_hands(std::vector<hg_handle_t> *dhands) {
+  size_t lcv;
+
+  for (lcv = 0 ; lcv < dhands->size() ; lcv++)
+    HG_Destroy((*dhands)[lcv]);
+  dhands->clear();
+}
+
+/*
+ * reqblk_carve: carve a request with room for "datalen" bytes out
+ * of a decoder's current reqblk.  if the current reqblk is full (or
+ * NULL) we drop the decoder's reference to it and start a new one.
+ * the decoder must drop its reference to the final reqblk when done.
+ * if "hand" is set we are decoding in place: no room for data is
+ * carved (the caller sets req->data) and each new reqblk takes a
+ * reference on "hand" to keep its input buffer alive.
+ *
+ * @param blkp ptr to the decoder's current reqblk (may be updated)
+ * @param datalen the size of the data
+ * @param hand the RPC handle for zero-copy decode (NULL if copying)
+ * @return the new request or NULL on malloc failure
+ */
+static struct request *reqblk_carve(struct reqblk **blkp, uint32_t datalen,
+                                    hg_handle_t hand) {
+  struct reqblk *blk;
+  struct request *req;
+  uint32_t need, blksz;
+
+  /* keep requests 8 byte aligned */
+  if (hand)
+    datalen = 0;
+  need = (sizeof(*req) + datalen + 7) & ~((uint32_t)7);
+  blk = *blkp;
+  if (blk == NULL || blk->size - blk->used < need) {
+    if (blk)
+      reqblk_dref(blk, NULL);   /* decoder is done with it */
+    *blkp = NULL;
+    blksz = (need > REQPOOL_BLKSZ) ? need : REQPOOL_BLKSZ;
+    blk = (struct reqblk *) malloc(sizeof(*blk) + blksz);
+    if (blk == NULL)
+      return(NULL);
+    blk->nrefs = acnt32_alloc();
+    if (blk->nrefs == NULL) {
+      free(blk);
+      return(NULL);
+    }
+    acnt32_set(blk->nrefs, 1);  /* decoder's reference */
+    if (hand && HG_Ref_incr(hand) != HG_SUCCESS) {
+      acnt32_free(&blk->nrefs);
+      free(blk);
+      return(NULL);
+    }
+    blk->hand = hand;
+    blk->size = blksz;
+    blk->used = 0;
+    reqpool_count(blks, 1);
+    reqpool_addbytes(sizeof(*blk) + blksz);
+    *blkp = blk;
+  }
+
+  req = (struct request *)((char *)blk + sizeof(*blk) + blk->used);
+  blk->used += need;
+  acnt32_incr(blk->nrefs);
+  req->rclass = REQ_CLASS_BLK;
+  req->blk = blk;
+  req->data = (char *)req + sizeof(*req);
+  return(req);
+}
+
+/*
+ * req_free_defer: release a request allocated with req_alloc() or
+ * reqblk_carve().   if the request was the last one in a zero-copy
+ * reqblk, the reqblk's RPC handle is added to "dhands" for the
+ * caller to destroy once it has dropped its locks.
+ *
+ * @param req the request to free
+ * @param dhands list of handles for the caller to destroy (or NULL)
+ */
+static void req_free_defer(struct request *req,
+                           std::vector<hg_handle_t> *dhands) {
+  struct reqcache *rc;
+  int c;
+
+  if (req->rclass == REQ_CLASS_BLK) {
+    reqblk_dref(req->blk, dhands);
+  } else if (req->rclass == REQ_CLASS_MALLOC) {
+    reqpool_subbytes(sizeof(*req) + req->datalen);
+    free(req);
+  } else {
+    c = req->rclass;
+    rc = reqcache_get();
+    *(void **)req = rc->freelist[c];
+    rc->freelist[c] = req;
+    if (++rc->nfree[c] >= 2 * REQPOOL_BATCH)
+      reqcache_drain(rc, c);
+  }
+}
+
+/*
+ * req_free: release a request, destroying its RPC handle inline.
+ * callers holding deliverlock must use req_free_defer() instead.
+ *
+ * @param req the request to free
+ */
+static void req_free(struct request *req) {
+  req_free_defer(req, NULL);
+}
+
 /*
  * functions used to serialize/deserialize our RPCs args (e.g. XDR-like fn).
  */
@@ -494,77 +851,175 @@ static uint32_t zero = 0;   /* for end of list marker */
 }
 
 /*
- * hg_proc_rpcin_t: encode/decode the rpcin_t structure
+ * hg_proc_delta: encode/decode an int32_t as a varint of the zigzag'd
+ * difference from the previous value (updated on return).  used for
+ * src/dst in fixed-record RPCs, where they rarely change between
+ * records (so they usually take one byte each).
  *
  * @param proc the proc used to serialize/deserialize the data
- * @param data pointer to the data being worked on
+ * @param val the value to encode (or where to put decoded value)
+ * @param prev the previous value
  * @return HG_SUCCESS or an error code
  */
-static hg_return_t hg_proc_rpcin_t(hg_proc_t proc, void *data) {
+static hg_return_t hg_proc_delta(hg_proc_t proc, int32_t *val,
+                                 int32_t *prev) {
+  hg_return_t ret = HG_SUCCESS;
+  uint32_t zz;
+  int32_t d;
+  uint8_t b;
+  int shift;
+
+  if (hg_proc_get_op(proc) == HG_ENCODE) {
+    d = (int32_t)((uint32_t)*val - (uint32_t)*prev);
+    zz = ((uint32_t)d << 1) ^ (uint32_t)(d >> 31);
+    do {
+      b = zz & 0x7f;
+      zz >>= 7;
+      if (zz)
+        b |= 0x80;
+      ret = hg_proc_hg_uint8_t(proc, &b);
+    } while (zz && ret == HG_SUCCESS);
+  } else {
+    zz = 0;
+    for (shift = 0 ; shift < 35 ; shift += 7) {
+      ret = hg_proc_hg_uint8_t(proc, &b);
+      if (ret != HG_SUCCESS)
+        return(ret);
+      zz |= (uint32_t)(b & 0x7f) << shift;
+      if ((b & 0x80) == 0)
+        break;
+    }
+    if (shift >= 35)
+      return(HG_PROTOCOL_ERROR);
+    d = (int32_t)((zz >> 1) ^ (0 - (zz & 1)));
+    *val = (int32_t)((uint32_t)*prev + (uint32_t)d);
+  }
+  *prev = *val;
+  return(ret);
+}
+
+/*
+ * hg_proc_rpcin_body: encode/decode the list of reqs in an rpcin_t
+ * (everything after the RPC header).  there are two formats, selected
+ * by the sender for each RPC:
+ *
+ *  variable: each req has a <datalen,type,src,dst> header and the
+ *            list ends with a <0,0> marker.
+ *  fixed:    all reqs have the same datalen (recsz) and type, so
+ *            those go in a batch header with the req count.  each
+ *            req only carries src/dst (as deltas, see hg_proc_delta).
+ *
+ * the encoder uses fixed only if we asked for it and every req in
+ * the batch fits it.   decoded reqs are appended to inreqs (on error
+ * the caller frees the ones we got).
+ *
+ * @param proc the proc used to serialize/deserialize the data
+ * @param struct_data the rpcin_t being worked on
+ * @param zhand decode in place in this handle's input buffer (or NULL)
+ * @return HG_SUCCESS or an error code
+ */
+static hg_return_t hg_proc_rpcin_body(hg_proc_t proc, rpcin_t *struct_data,
+                                      hg_handle_t zhand) {
   hg_return_t ret = HG_SUCCESS;
   hg_proc_op_t op = hg_proc_get_op(proc);
-  rpcin_t *struct_data = (rpcin_t *) data;
-  struct request *rp, *nrp;
+  struct request *rp;
+  struct reqblk *blk = NULL;
   int cnt, lcv;
-  uint32_t dlen, typ;
-  mlog(UTIL_CALL, "hg_proc_rpcin_t proc=%p op=%d", proc, op);
-
-  if (op == HG_FREE)               /* we combine free and err handling below */
-    goto done;
+  uint32_t dlen, typ, recsz, nrecs;
+  int32_t psrc, pdst;
 
-  if (op == HG_DECODE) {           /* start with an empty inreqs list */
-    XSIMPLEQ_INIT(&struct_data->inreqs);
+  /* pick the format (encode) or find out what the sender picked */
+  recsz = nrecs = typ = 0;
+  if (op == HG_ENCODE && struct_data->recsz != 0) {
+    recsz = struct_data->recsz;
+    XSIMPLEQ_FOREACH(rp, &struct_data->inreqs, next) {
+      if (rp->datalen != recsz || (nrecs && rp->type != typ)) {
+        recsz = 0;                 /* doesn't fit, use variable format */
+        break;
+      }
+      typ = rp->type;
+      nrecs++;
+    }
+    if (nrecs == 0)
+      recsz = 0;
   }
-
-  ret = hg_proc_hg_int32_t(proc, &struct_data->iseq);
-  procheck(ret, "Proc err iseq");
-  ret = hg_proc_hg_int32_t(proc, &struct_data->forwardrank);
-  procheck(ret, "Proc err forwardrank");
+  ret = hg_proc_hg_uint32_t(proc, &recsz);
+  procheck(ret, "Proc err recsz");
+  if (op == HG_DECODE)
+    struct_data->recsz = recsz;
+  if (recsz != 0) {
+    ret = hg_proc_hg_uint32_t(proc, &nrecs);
+    if (ret == HG_SUCCESS) ret = hg_proc_hg_uint32_t(proc, &typ);
+    procheck(ret, "Proc err fixed hdr");
+  }
+  psrc = pdst = 0;
 
   if (op == HG_ENCODE) {   /* serialize list to the proc */
     cnt = 0;
     XSIMPLEQ_FOREACH(rp, &struct_data->inreqs, next) {
-      ret = hg_proc_hg_uint32_t(proc, &rp->datalen);
-      procheck(ret, "Proc en err datalen");
-      ret = hg_proc_hg_uint32_t(proc, &rp->type);
-      procheck(ret, "Proc en err type");
-      ret = hg_proc_hg_int32_t(proc, &rp->src);
-      procheck(ret, "Proc en err src");
-      ret = hg_proc_hg_int32_t(proc, &rp->dst);
-      procheck(ret, "Proc en err dst");
+      if (recsz == 0) {
+        ret = hg_proc_hg_uint32_t(proc, &rp->datalen);
+        procheck(ret, "Proc en err datalen");
+        ret = hg_proc_hg_uint32_t(proc, &rp->type);
+        procheck(ret, "Proc en err type");
+        ret = hg_proc_hg_int32_t(proc, &rp->src);
+        procheck(ret, "Proc en err src");
+        ret = hg_proc_hg_int32_t(proc, &rp->dst);
+        procheck(ret, "Proc en err dst");
+      } else {
+        ret = hg_proc_delta(proc, &rp->src, &psrc);
+        if (ret == HG_SUCCESS) ret = hg_proc_delta(proc, &rp->dst, &pdst);
+        procheck(ret, "Proc en err src/dst");
+      }
       ret = hg_proc_memcpy(proc, rp->data, rp->datalen);
       procheck(ret, "Proc en err data");
       cnt++;
     }
     /* put in the end of list marker (2 uint32_t zeros) */
-    for (lcv = 0 ; lcv < 2 ; lcv++) {
+    for (lcv = 0 ; recsz == 0 && lcv < 2 ; lcv++) {
       ret = hg_proc_hg_uint32_t(proc, &zero);
       procheck(ret, "Proc err zero");
     }
-    mlog(UTIL_D1, "hg_proc_rpcin_t proc %p, encoded=%d", proc, cnt);
+    mlog(UTIL_D1, "hg_proc_rpcin_t proc %p, encoded=%d, recsz=%u", proc,
+         cnt, recsz);
     goto done;
   }
 
   /* op == HG_DECODE */
   cnt = 0;
   while (1) {
-    ret = hg_proc_hg_uint32_t(proc, &dlen);  /* should err if we use up data */
-    procheck(ret, "Proc de err datalen");
-    ret = hg_proc_hg_uint32_t(proc, &typ);
-    procheck(ret, "Proc de err type");
-    if (dlen == 0 && typ == 0) break;     /* got end of list marker */
-    rp = (request*)malloc(sizeof(*rp) + dlen);
+    if (recsz != 0) {
+      if ((uint32_t)cnt >= nrecs) break;  /* got all the fixed recs */
+      dlen = recsz;
+    } else {
+      ret = hg_proc_hg_uint32_t(proc, &dlen);  /* should err if we use up data */
+      procheck(ret, "Proc de err datalen");
+      ret = hg_proc_hg_uint32_t(proc, &typ);
+      procheck(ret, "Proc de err type");
+      if (dlen == 0 && typ == 0) break;     /* got end of list marker */
+    }
+    rp = reqblk_carve(&blk, dlen, zhand);
     if (rp == NULL) ret = HG_NOMEM_ERROR;
     procheck(ret, "Proc de malloc");
     rp->datalen = dlen;
     rp->type = typ;
-    ret = hg_proc_hg_int32_t(proc, &rp->src);
-    if (ret == HG_SUCCESS) ret = hg_proc_hg_int32_t(proc, &rp->dst);
-    rp->data = ((char *)rp) + sizeof(*rp);
-    if (ret == HG_SUCCESS) ret = hg_proc_memcpy(proc, rp->data, dlen);
+    if (recsz == 0) {
+      ret = hg_proc_hg_int32_t(proc, &rp->src);
+      if (ret == HG_SUCCESS) ret = hg_proc_hg_int32_t(proc, &rp->dst);
+    } else {
+      ret = hg_proc_delta(proc, &rp->src, &psrc);
+      if (ret == HG_SUCCESS) ret = hg_proc_delta(proc, &rp->dst, &pdst);
+    }
+    if (ret == HG_SUCCESS && zhand) {   /* point at data in the proc buf */
+      rp->data = hg_proc_save_ptr(proc, dlen);
+      ret = (rp->data) ? hg_proc_restore_ptr(proc, rp->data, dlen)
+                       : HG_SIZE_ERROR;
+    } else if (ret == HG_SUCCESS) {
+      ret = hg_proc_memcpy(proc, rp->data, dlen);
+    }
     rp->owner = NULL;
     if (ret != HG_SUCCESS) {
-      free(rp);
+      req_free(rp);
       procheck(ret, "Proc decoder");
     }
 
@@ -572,13 +1027,194 @@ static hg_return_t hg_proc_rpcin_t(hg_proc_t proc, void *data) {
     XSIMPLEQ_INSERT_TAIL(&struct_data->inreqs, rp, next);
     cnt++;
   }
-  mlog(UTIL_D1, "hg_proc_rpcin_t proc %p, decoded=%d", proc, cnt);
+  mlog(UTIL_D1, "hg_proc_rpcin_t proc %p, decoded=%d, recsz=%u", proc,
+       cnt, recsz);
+  reqpool_count(blkreqs, cnt);
+  if (zhand)
+    reqpool_count(zcreqs, cnt);
+
+done:
+  if (blk)                         /* drop decoder's ref to last reqblk */
+    reqblk_dref(blk, NULL);
+  return(ret);
+}
+
+/*
+ * hg_proc_rpcin_zip: encode the reqs of an rpcin_t into a memory
+ * buffer and compress it.  we give up if compression doesn't save
+ * space.
+ *
+ * @param proc the proc of the RPC we are encoding
+ * @param struct_data the rpcin_t being encoded
+ * @param zlenp compressed length (OUT)
+ * @param rawlenp uncompressed length (OUT)
+ * @return malloc'd compressed data, or NULL if not compressed
+ */
+static char *hg_proc_rpcin_zip(hg_proc_t proc, rpcin_t *struct_data,
+                               uint32_t *zlenp, uint32_t *rawlenp) {
+  struct shuffler *sh = struct_data->zip;
+  struct request *rp;
+  hg_proc_t rproc;
+  hg_return_t ret;
+  hg_size_t bound;
+  uint64_t t0;
+  char *raw, *zbuf;
+  int rawlen, zlen;
+
+  /* worst case size of the body: fixed hdr + per req hdr + end marker */
+  bound = 5 * sizeof(uint32_t);
+  XSIMPLEQ_FOREACH(rp, &struct_data->inreqs, next) {
+    bound += 4 * sizeof(uint32_t) + rp->datalen;
+  }
+  raw = (char *) malloc(bound);
+  if (raw == NULL)
+    return(NULL);
+
+  t0 = cputime_usec();
+  ret = hg_proc_create_set(hg_proc_get_class(proc), raw, bound, HG_ENCODE,
+                           HG_NOHASH, &rproc);
+  if (ret != HG_SUCCESS) {
+    free(raw);
+    return(NULL);
+  }
+  ret = hg_proc_rpcin_body(rproc, struct_data, NULL);
+  rawlen = hg_proc_get_size_used(rproc);
+  hg_proc_free(rproc);
+
+  zbuf = (ret == HG_SUCCESS) ? (char *) malloc(rawlen) : NULL;
+  zlen = (zbuf) ? shufzip_compress(raw, rawlen, zbuf, rawlen - 1) : -1;
+  free(raw);
+
+  pthread_mutex_lock(&sh->ziplock);
+  sh->ziprawb += rawlen;
+  sh->zipb += (zlen > 0) ? zlen : rawlen;
+  sh->zipusec += cputime_usec() - t0;
+  pthread_mutex_unlock(&sh->ziplock);
+
+  if (zlen <= 0) {
+    if (zbuf) free(zbuf);
+    return(NULL);
+  }
+  *zlenp = zlen;
+  *rawlenp = rawlen;
+  return(zbuf);
+}
+
+/*
+ * hg_proc_rpcin_unzip: decompress and decode the reqs of an rpcin_t.
+ * the reqs are copied out of the decompressed buffer (no zero-copy).
+ *
+ * @param proc the proc of the RPC we are decoding
+ * @param struct_data the rpcin_t being decoded
+ * @param zlen compressed length
+ * @param rawlen uncompressed length
+ * @return HG_SUCCESS or an error code
+ */
+static hg_return_t hg_proc_rpcin_unzip(hg_proc_t proc, rpcin_t *struct_data,
+                                       uint32_t zlen, uint32_t rawlen) {
+  struct shuffler *sh = struct_data->zip;
+  hg_proc_t rproc;
+  hg_return_t ret;
+  uint64_t t0;
+  void *zp;
+  char *raw;
+
+  /* LZ matches can't expand more than 255x, reject garbage lengths */
+  if (rawlen > (uint64_t)zlen * 255 + 16)
+    return(HG_PROTOCOL_ERROR);
+  zp = hg_proc_save_ptr(proc, zlen);
+  if (zp == NULL)
+    return(HG_SIZE_ERROR);
+  raw = (char *) malloc(rawlen);
+  if (raw == NULL) {
+    (void) hg_proc_restore_ptr(proc, zp, zlen);
+    return(HG_NOMEM_ERROR);
+  }
+
+  t0 = cputime_usec();
+  if (shufzip_decompress(zp, zlen, raw, rawlen) != (int)rawlen) {
+    ret = HG_PROTOCOL_ERROR;
+  } else {
+    ret = hg_proc_restore_ptr(proc, zp, zlen);
+  }
+  if (ret == HG_SUCCESS)
+    ret = hg_proc_create_set(hg_proc_get_class(proc), raw, rawlen,
+                             HG_DECODE, HG_NOHASH, &rproc);
+  if (ret == HG_SUCCESS) {
+    ret = hg_proc_rpcin_body(rproc, struct_data, NULL);
+    hg_proc_free(rproc);
+  }
+  free(raw);
+
+  if (sh) {
+    pthread_mutex_lock(&sh->ziplock);
+    sh->unzipusec += cputime_usec() - t0;
+    pthread_mutex_unlock(&sh->ziplock);
+  }
+  return(ret);
+}
+
+/*
+ * hg_proc_rpcin_t: encode/decode the rpcin_t structure.  after the
+ * header, the reqs are either inline or compressed (zlen != 0).
+ * the sender only compresses if asked to (zip != NULL) and if it
+ * makes the RPC smaller.
+ *
+ * @param proc the proc used to serialize/deserialize the data
+ * @param data pointer to the data being worked on
+ * @return HG_SUCCESS or an error code
+ */
+static hg_return_t hg_proc_rpcin_t(hg_proc_t proc, void *data) {
+  hg_return_t ret = HG_SUCCESS;
+  hg_proc_op_t op = hg_proc_get_op(proc);
+  rpcin_t *struct_data = (rpcin_t *) data;
+  struct request *rp, *nrp;
+  uint32_t zlen, rawlen;
+  char *zbuf = NULL;
+  mlog(UTIL_CALL, "hg_proc_rpcin_t proc=%p op=%d", proc, op);
+
+  if (op == HG_FREE)               /* we combine free and err handling below */
+    goto done;
+
+  if (op == HG_DECODE) {           /* start with an empty inreqs list */
+    XSIMPLEQ_INIT(&struct_data->inreqs);
+  }
+
+  ret = hg_proc_hg_int32_t(proc, &struct_data->iseq);
+  procheck(ret, "Proc err iseq");
+  ret = hg_proc_hg_int32_t(proc, &struct_data->forwardrank);
+  procheck(ret, "Proc err forwardrank");
+
+  zlen = rawlen = 0;
+  if (op == HG_ENCODE && struct_data->zip != NULL)
+    zbuf = hg_proc_rpcin_zip(proc, struct_data, &zlen, &rawlen);
+  ret = hg_proc_hg_uint32_t(proc, &zlen);
+  procheck(ret, "Proc err zlen");
+
+  if (zlen == 0) {
+    ret = hg_proc_rpcin_body(proc, struct_data,
+                             (op == HG_DECODE) ? struct_data->zhand : NULL);
+    procheck(ret, "Proc err body");
+    goto done;
+  }
+
+  ret = hg_proc_hg_uint32_t(proc, &rawlen);
+  procheck(ret, "Proc err rawlen");
+  if (op == HG_ENCODE) {
+    ret = hg_proc_memcpy(proc, zbuf, zlen);
+  } else {
+    ret = hg_proc_rpcin_unzip(proc, struct_data, zlen, rawlen);
+  }
+  procheck(ret, "Proc err zip body");
+  mlog(UTIL_D1, "hg_proc_rpcin_t proc %p, zip=%u/%u", proc, zlen, rawlen);
 
 done:
+  if (zbuf)
+    free(zbuf);
   if ( ((op == HG_DECODE && ret != HG_SUCCESS) || op == HG_FREE) &&
        XSIMPLEQ_FIRST(&struct_data->inreqs) != NULL) {
     XSIMPLEQ_FOREACH_SAFE(rp, &struct_data->inreqs, next, nrp) {
-      free(rp);
+      req_free(rp);
     }
     XSIMPLEQ_INIT(&struct_data->inreqs);
   }
@@ -856,7 +1492,8 @@ shuffler_t shuffler_init(nexus_ctx_t nxp, char *funname,
            int localsenderlimit, int remotesenderlimit,
            int lomaxrpc, int lobuftarget, int lrmaxrpc, int lrbuftarget,
            int rmaxrpc, int rbuftarget, int deliverq_max,
-           int deliverq_threshold, shuffler_deliver_t delivercb) {
+           int deliverq_threshold, int fixedrecsz,
+           shuffler_deliver_t delivercb) {
   int64_t mask, worldsize;
   int myrank, lcv, rv;
   shuffler_t sh;
@@ -880,10 +1517,12 @@ shuffler_t shuffler_init(nexus_ctx_t nxp, char *funname,
        "shuffler_init maxrpc(lo/lr/r)=%d/%d/%d targ(lo/lr/r)=%d/%d/%d",
        lomaxrpc, lrmaxrpc, rmaxrpc, lobuftarget, lrbuftarget,
        rbuftarget);
-  mlog(SHUF_CALL, "sndrlimit(l/r)=%d/%d dqmax/th=%d/%d",
-       localsenderlimit, remotesenderlimit, deliverq_max, deliverq_threshold);
+  mlog(SHUF_CALL, "sndrlimit(l/r)=%d/%d dqmax/th=%d/%d recsz=%d",
+       localsenderlimit, remotesenderlimit, deliverq_max, deliverq_threshold,
+       fixedrecsz);
 
   sh = new shuffler;    /* aborts w/std::bad_alloc on failure */
+  reqpool_attach();
 
   /* make sure these oqflush_counters are not pointing at garbage */
   sh->local_orq.oqflush_counter = NULL;
@@ -898,6 +1537,7 @@ shuffler_t shuffler_init(nexus_ctx_t nxp, char *funname,
   shufzero(&sh->cntflushwait);
   shufzero(&sh->cntdblock);
   shufzero(&sh->cntdeliver);
+  shufzero(&sh->cntdbatched);
   shufzero(&sh->cntdreqs[0]); shufzero(&sh->cntdreqs[1]);
   shufzero(&sh->cntdwait[0]); shufzero(&sh->cntdwait[1]);
   shufzero(&sh->cntdmaxwait);
@@ -911,6 +1551,11 @@ shuffler_t shuffler_init(nexus_ctx_t nxp, char *funname,
   if (!sh->funname || !sh->seqsrc)
     goto err;
   sh->disablesend = 0;
+  sh->zerocopy = 0;
+  sh->fixedrecsz = (fixedrecsz > 0) ? fixedrecsz : 0;
+  sh->zip = 0;
+  sh->pushmask = 0;
+  sh->ziprawb = sh->zipb = sh->zipusec = sh->unzipusec = 0;
   sh->boottime = shuftime();
 
   nit = nexus_iter(nxp, 1);
@@ -950,18 +1595,25 @@ shuffler_t shuffler_init(nexus_ctx_t nxp, char *funname,
   sh->deliverq_max = deliverq_max;
   sh->deliverq_threshold = deliverq_threshold;
   sh->delivercb = delivercb;
+  sh->delivercbv = NULL;
   if (pthread_mutex_init(&sh->deliverlock, NULL) != 0)
     goto err;
   if (pthread_cond_init(&sh->delivercv, NULL) != 0) {
     pthread_mutex_destroy(&sh->deliverlock);
     goto err;
   }
+  if (pthread_mutex_init(&sh->ziplock, NULL) != 0) {
+    pthread_mutex_destroy(&sh->deliverlock);
+    pthread_cond_destroy(&sh->delivercv);
+    goto err;
+  }
   sh->dflush_counter = 0;
   sh->dshutdown = sh->drunning = 0;
 
   if (shuffler_init_flush(sh) != HG_SUCCESS) {
     pthread_mutex_destroy(&sh->deliverlock);
     pthread_cond_destroy(&sh->delivercv);
+    pthread_mutex_destroy(&sh->ziplock);
     goto err;
   }
 
@@ -969,6 +1621,7 @@ shuffler_t shuffler_init(nexus_ctx_t nxp, char *funname,
   if (start_threads(sh) != 0) {
     pthread_mutex_destroy(&sh->deliverlock);
     pthread_cond_destroy(&sh->delivercv);
+    pthread_mutex_destroy(&sh->ziplock);
     shuffler_flush_discard(sh);
     goto err;
   }
@@ -982,6 +1635,7 @@ err:
   shuffler_outset_discard(&sh->remoteq);
   if (sh->seqsrc) acnt32_free(&sh->seqsrc);
   if (sh->funname) free(sh->funname);
+  reqpool_detach();
   delete sh;
   shuffler_closelog();
   return(NULL);
@@ -1087,6 +1741,7 @@ static void stop_threads(struct shuffler *sh) {
 static int purge_reqs(struct shuffler *sh) {
   int rv = 0;
   struct request *req;
+  std::vector<hg_handle_t> dhands;
   mlog(SHUF_CALL, "purge_reqs");
 
   if (sh->drunning || sh->hgt_local.nrunning || sh->hgt_remote.nrunning) {
@@ -1099,20 +1754,23 @@ static int purge_reqs(struct shuffler *sh) {
     req = sh->dwaitq.front();
     sh->dwaitq.pop_front();
     parent_dref_stopwait(sh, req->owner, 1);
-    free(req);
+    req_free_defer(req, &dhands);
     rv++;
   }
   while (!sh->deliverq.empty()) {
     req = sh->deliverq.front();
     sh->deliverq.pop_front();
-    free(req);
+    req_free_defer(req, &dhands);
     rv++;
   }
 
   /* clear local and remote queeus */
-  rv += purge_reqs_outset(sh, &sh->local_orq);
-  rv += purge_reqs_outset(sh, &sh->local_rlq);
-  rv += purge_reqs_outset(sh, &sh->remoteq);
+  rv += purge_reqs_outset(sh, &sh->local_orq, &dhands);
+  rv += purge_reqs_outset(sh, &sh->local_rlq, &dhands);
+  rv += purge_reqs_outset(sh, &sh->remoteq, &dhands);
+
+  /* release input buffers of stranded zero-copy reqs last */
+  destroy_hands(&dhands);
 
   mlog(SHUF_D1, "purg_reqs => result = %d", rv);
   return(rv);
@@ -1125,9 +1783,11 @@ static int purge_reqs(struct shuffler *sh) {
  *
  * @param sh the shuffler oset belongs to
  * @param oset set to purge
+ * @param dhands RPC handles for the caller to destroy when done
  * @return the number of stranded reqs in the outset
  */
-static int purge_reqs_outset(struct shuffler *sh, struct outset *oset) {
+static int purge_reqs_outset(struct shuffler *sh, struct outset *oset,
+                             std::vector<hg_handle_t> *dhands) {
   int rv = 0;
   std::map<hg_addr_t,struct outqueue *>::iterator it;
   struct outqueue *oq;
@@ -1152,13 +1812,13 @@ static int purge_reqs_outset(struct shuffler *sh, struct outset *oset) {
       req = oq->oqwaitq.front();
       oq->oqwaitq.pop_front();
       parent_dref_stopwait(sh, req->owner, 1);
-      free(req);
+      req_free_defer(req, dhands);
       rv++;
     }
 
     /* now zap the loading requests */
     XSIMPLEQ_FOREACH_SAFE(req, &oq->loading, next, nxt) {
-      free(req);
+      req_free_defer(req, dhands);
       rv++;
     }
 
@@ -1197,6 +1857,8 @@ static void *delivery_main(void *arg) {
   struct request *req;
   struct req_parent *parent;
   struct museprobe delivery_use;
+  std::vector<hg_handle_t> dhands;
+  int ndeliver, lcv;
   mlog(DLIV_CALL, "delivery_main running");
 
   museprobe_start(&delivery_use, MUSEPROBE_THREAD);
@@ -1225,60 +1887,102 @@ static void *delivery_main(void *arg) {
     }
 
     shufcount(&sh->cntdeliver);
-    pthread_mutex_unlock(&sh->deliverlock);
-    mlog(DLIV_D1, "deliver %d->%d t=%d, dl=%d req=%p",
-         req->src, req->dst, req->type, req->datalen, req);
-    /* note: may block in callback */
-    sh->delivercb(req->src, req->dst, req->type, req->data, req->datalen);
-    mlog(DLIV_D1, "deliver %p complete", req);
+    if (sh->delivercbv) {
+      /*
+       * batch mode: hand everything at the front of the deliverq
+       * to the app in one callback.   as above, the reqs stay on
+       * the deliverq until the callback returns.
+       */
+      ndeliver = sh->deliverq.size();
+      if (ndeliver > (int)sh->dvec.size())
+        ndeliver = sh->dvec.size();
+      for (lcv = 0 ; lcv < ndeliver ; lcv++) {
+        req = sh->deliverq[lcv];
+        sh->dvec[lcv].src = req->src;
+        sh->dvec[lcv].dst = req->dst;
+        sh->dvec[lcv].type = req->type;
+        sh->dvec[lcv].d = req->data;
+        sh->dvec[lcv].datalen = req->datalen;
+      }
+      shufadd(&sh->cntdbatched, ndeliver);
+      pthread_mutex_unlock(&sh->deliverlock);
+      mlog(DLIV_D1, "deliver batch of %d", ndeliver);
+      /* note: may block in callback */
+      sh->delivercbv(&sh->dvec[0], ndeliver);
+      mlog(DLIV_D1, "deliver batch of %d complete", ndeliver);
+    } else {
+      ndeliver = 1;
+      pthread_mutex_unlock(&sh->deliverlock);
+      mlog(DLIV_D1, "deliver %d->%d t=%d, dl=%d req=%p",
+           req->src, req->dst, req->type, req->datalen, req);
+      /* note: may block in callback */
+      sh->delivercb(req->src, req->dst, req->type, req->data, req->datalen);
+      mlog(DLIV_D1, "deliver %p complete", req);
+    }
     pthread_mutex_lock(&sh->deliverlock);
 
-    /* see if anyone is waiting for us to flush */
-    if (sh->dflush_counter > 0) {
-      sh->dflush_counter--;
-      mlog(DLIV_D1, "drop dflush_counter to %d", sh->dflush_counter);
-      if (sh->dflush_counter == 0) {   /* droped to 0, wake up flusher */
-        if (sh->curflush)
-          pthread_cond_signal(&sh->curflush->flush_waitcv);
+    for (lcv = 0 ; lcv < ndeliver ; lcv++) {
+      req = sh->deliverq.front();
+
+      /* see if anyone is waiting for us to flush */
+      if (sh->dflush_counter > 0) {
+        sh->dflush_counter--;
+        mlog(DLIV_D1, "drop dflush_counter to %d", sh->dflush_counter);
+        if (sh->dflush_counter == 0) {   /* droped to 0, wake up flusher */
+          if (sh->curflush)
+            pthread_cond_signal(&sh->curflush->flush_waitcv);
+        }
       }
-    }
 
-    /* dispose of the req we just delivered */
-    sh->deliverq.pop_front();
-    if (req->owner)        /* should never happen */
-      notify(DLIV_CRIT, "delivery_main: freeing req with owner!?!");
-    free(req);
-    req = NULL;
+      /* dispose of the req we just delivered */
+      sh->deliverq.pop_front();
+      if (req->owner)        /* should never happen */
+        notify(DLIV_CRIT, "delivery_main: freeing req with owner!?!");
+      req_free_defer(req, &dhands);   /* HG_Destroy() after unlock */
+      req = NULL;
 
-    /* just made space in deliveryq, see if we can advance one from waitq */
-    if (sh->dwaitq.empty())
-      continue;                 /* waitq empty, loop back up */
+      /* just made space in deliveryq, see if we can advance one from waitq */
+      if (sh->dwaitq.empty())
+        continue;               /* waitq empty, loop back up */
 
-    /* move it to deliveryq */
-    req = sh->dwaitq.front();
-    sh->dwaitq.pop_front();
-    sh->deliverq.push_back(req); /* deliverq should be full again */
-    mlog(DLIV_D1, "promoted %p from dwaitq", req);
+      /* move it to deliveryq */
+      req = sh->dwaitq.front();
+      sh->dwaitq.pop_front();
+      sh->deliverq.push_back(req); /* deliverq should be full again */
+      mlog(DLIV_D1, "promoted %p from dwaitq", req);
+
+      /*
+       * now we need to tell req's parent it can stop waiting.  since
+       * we are holding the deliver lock (covers the dwaitq) we can
+       * clear the owner to detach the req from the parent.   then
+       * we need to call parent_dref_stopwait() to drop the parent's
+       * reference counter.
+       *
+       * XXX: be safe and drop deliverlock when calling
+       * parent_dref_stopwait().  normally parent_dref_stopwait()
+       * will just drop the reference count and if it drops to zero
+       * it will call HG_Reply (if parent->input !NULL)
+       * pthread_cond_signal (if parent->input == NULL).  the main worry
+       * is HG_Reply() since that code is external to us and we can't
+       * know what it (or any mercury NA layer under it) will do.
+       */
+      parent = req->owner;
+      req->owner = NULL;
+      pthread_mutex_unlock(&sh->deliverlock);
+      parent_dref_stopwait(sh, parent, 0);
+      pthread_mutex_lock(&sh->deliverlock);
+    }
 
     /*
-     * now we need to tell req's parent it can stop waiting.  since
-     * we are holding the deliver lock (covers the dwaitq) we can
-     * clear the owner to detach the req from the parent.   then
-     * we need to call parent_dref_stopwait() to drop the parent's
-     * reference counter.
-     *
-     * XXX: be safe and drop deliverlock when calling parent_dref_stopwait().
-     * normally parent_dref_stopwait() will just drop the reference count and
-     * if it drops to zero it will call HG_Reply (if parent->input !NULL)
-     * pthread_cond_signal (if parent->input == NULL).  the main worry
-     * is HG_Reply() since that code is external to us and we can't
-     * know what it (or any mercury NA layer under it) will do.
+     * release the input buffers of any zero-copy RPCs we just
+     * finished with.   like HG_Reply() above, HG_Destroy() is
+     * mercury code, so don't call it holding deliverlock.
      */
-    parent = req->owner;
-    req->owner = NULL;
-    pthread_mutex_unlock(&sh->deliverlock);
-    parent_dref_stopwait(sh, parent, 0);
-    pthread_mutex_lock(&sh->deliverlock);
+    if (!dhands.empty()) {
+      pthread_mutex_unlock(&sh->deliverlock);
+      destroy_hands(&dhands);
+      pthread_mutex_lock(&sh->deliverlock);
+    }
   }
   sh->drunning = 0;
   pthread_mutex_unlock(&sh->deliverlock);
@@ -1639,7 +2343,7 @@ void drop_reqs(struct request **reqp, struct request_queue *reqq,
       notify(SHUF_CRIT, "drop_reqs: drop %p(o=%d) due to err (%s), data LOST!",
            rp, owned, msg);
     }
-    free(rp);
+    req_free(rp);
     *reqp = NULL;
   }
 
@@ -1651,7 +2355,7 @@ void drop_reqs(struct request **reqp, struct request_queue *reqq,
             "drop_reqs: drop %p(O=%d) due to err (%s) - data LOST!",
              rp, owned, msg);
       }
-      free(rp);
+      req_free(rp);
     }
     XSIMPLEQ_INIT(reqq);
   }
@@ -1718,35 +2422,85 @@ hg_return_t sender_limit(struct shuffler *sh, struct outset *oset) {
   return((sw.sw_status == SHUFSEND_OKGO) ? HG_SUCCESS : HG_CANCELED);
 }
 
+/*
+ * shuffler_set_deliverv: switch delivery to a batch callback.
+ */
+hg_return_t shuffler_set_deliverv(shuffler_t sh,
+                                  shuffler_deliverv_t delivercbv,
+                                  int maxbatch) {
+  if (delivercbv == NULL || maxbatch < 1)
+    return(HG_INVALID_PARAM);
+
+  pthread_mutex_lock(&sh->deliverlock);
+  sh->dvec.resize(maxbatch);
+  sh->delivercbv = delivercbv;
+  pthread_mutex_unlock(&sh->deliverlock);
+  mlog(SHUF_CALL, "shuffler_set_deliverv: maxbatch=%d", maxbatch);
+
+  return(HG_SUCCESS);
+}
+
+/*
+ * shuffler_set_zerocopy: turn in place decoding of inbound RPCs on/off.
+ */
+hg_return_t shuffler_set_zerocopy(shuffler_t sh, int onoff) {
+  sh->zerocopy = (onoff != 0);
+  mlog(SHUF_CALL, "shuffler_set_zerocopy: %d", sh->zerocopy);
+
+  return(HG_SUCCESS);
+}
+
+/*
+ * shuffler_set_compress: turn compression of remote RPCs on/off.
+ */
+hg_return_t shuffler_set_compress(shuffler_t sh, int onoff) {
+  sh->zip = (onoff != 0);
+  mlog(SHUF_CALL, "shuffler_set_compress: %d", sh->zip);
+
+  return(HG_SUCCESS);
+}
+
+/*
+ * shuffler_set_pushtypes: set the type bits of msgs that are pushed.
+ */
+hg_return_t shuffler_set_pushtypes(shuffler_t sh, uint32_t mask) {
+  sh->pushmask = mask;
+  mlog(SHUF_CALL, "shuffler_set_pushtypes: %#x", mask);
+
+  return(HG_SUCCESS);
+}
+
+/*
+ * shuffler_zip_stats: get RPC compression stats.
+ */
+hg_return_t shuffler_zip_stats(shuffler_t sh, hg_uint64_t *rawbytes,
+                               hg_uint64_t *zipbytes, hg_uint64_t *zipusec,
+                               hg_uint64_t *unzipusec) {
+  pthread_mutex_lock(&sh->ziplock);
+  if (rawbytes) *rawbytes = sh->ziprawb;
+  if (zipbytes) *zipbytes = sh->zipb;
+  if (zipusec) *zipusec = sh->zipusec;
+  if (unzipusec) *unzipusec = sh->unzipusec;
+  pthread_mutex_unlock(&sh->ziplock);
+
+  return(HG_SUCCESS);
+}
+
 /*
  * shuffler_send: start the sending of a message via the shuffle.
  */
 hg_return_t shuffler_send(shuffler_t sh, int dst, uint32_t type,
                           void *d, uint32_t datalen) {
-  nexus_ret_t nexus;
-  int rank;
-  hg_addr_t dstaddr;
-  struct request *req;
-  struct req_parent parent_store, *parent;
-  hg_return_t rv;
-  struct outset *oset;
-  std::map<hg_addr_t, struct outqueue *>::iterator it;
-  struct outqueue *oq;
+  void *buf;
 
   mlog(CLNT_CALL, "shuffler_send: dst=%d t=%d dl=%d", dst, type, datalen);
 
-  /* first, check to see if send is generally disabled */
-  if (sh->disablesend)
-    return(HG_OTHER_ERROR);
-
-  /* determine next hop */
-  nexus = nexus_next_hop(sh->nxp, dst, &rank, &dstaddr);
-
   /*
-   * we always have to malloc and copy the data from the user to one
+   * we always have to allocate and copy the data from the user to one
    * of our buffers because we return to the sender before the is
    * complete (and we don't want to sender to reuse the buffer before
-   * we are done with it).
+   * we are done with it).  callers that can build their message in
+   * place should use shuffler_send_reserve() to skip this copy.
    *
    * XXX: for output queues that have room, it would be nice if we
    * could directly copy into their hg_handle_t buffer as we receive
@@ -1755,20 +2509,69 @@ hg_return_t shuffler_send(shuffler_t sh, int dst, uint32_t type,
    * HG_Forward() which takes an unpacked set of requests and packs
    * them all at once... there is no way to incrementally add data).
    */
-  req = (struct request *) malloc(sizeof(*req) + datalen);
+  buf = shuffler_send_reserve(sh, datalen);
+  if (buf == NULL)
+    return(sh->disablesend ? HG_OTHER_ERROR : HG_NOMEM_ERROR);
+  memcpy(buf, d, datalen);    /* DATA COPY HERE */
+
+  return(shuffler_send_commit(sh, dst, type, buf));
+}
+
+/*
+ * shuffler_send_reserve: get a request buffer for the caller to
+ * build a message in.
+ */
+void *shuffler_send_reserve(shuffler_t sh, uint32_t datalen) {
+  struct request *req;
+
+  /* first, check to see if send is generally disabled */
+  if (sh->disablesend)
+    return(NULL);
+
+  req = req_alloc(datalen);
   if (req == NULL) {
-    mlog(CLNT_ERR, "shuffler_send: dst=%d dl=%d malloc failed", dst, datalen);
-    return(HG_NOMEM_ERROR);
+    mlog(CLNT_ERR, "shuffler_send_reserve: dl=%d malloc failed", datalen);
+    return(NULL);
+  }
+  req->datalen = datalen;
+
+  return(req->data);
+}
+
+/*
+ * shuffler_send_commit: send a message built in a buffer from
+ * shuffler_send_reserve().
+ */
+hg_return_t shuffler_send_commit(shuffler_t sh, int dst, uint32_t type,
+                                 void *d) {
+  nexus_ret_t nexus;
+  int rank;
+  hg_addr_t dstaddr;
+  struct request *req;
+  struct req_parent parent_store, *parent;
+  hg_return_t rv;
+  struct outset *oset;
+  std::map<hg_addr_t, struct outqueue *>::iterator it;
+  struct outqueue *oq;
+
+  /* req_alloc() puts the data right after the request header */
+  req = (struct request *)((char *)d - sizeof(*req));
+
+  /* send may have been disabled since the buffer was reserved */
+  if (sh->disablesend) {
+    req_free(req);
+    return(HG_OTHER_ERROR);
   }
+
+  /* determine next hop */
+  nexus = nexus_next_hop(sh->nxp, dst, &rank, &dstaddr);
+
   mlog(CLNT_D1, "shuffler_send: %d->%d nexus=%d rank=%d addr=%p req=%p",
        sh->grank, dst, nexus, rank, dstaddr, req);
 
-  req->datalen = datalen;
   req->type = type;
   req->src = sh->grank;
   req->dst = dst;
-  req->data = (char *)req + sizeof(*req);
-  memcpy(req->data, d, datalen);    /* DATA COPY HERE */
   req->owner = NULL;
   req->next.sqe_next = NULL;        /* to be safe */
 
@@ -1793,6 +2596,7 @@ hg_return_t shuffler_send(shuffler_t sh, int dst, uint32_t type,
   if (nexus != NX_ISLOCAL && nexus != NX_SRCREP && nexus != NX_DESTREP) {
     /* nexus doesn't know dst, return error */
     mlog(CLNT_ERR, "shuffler_send: bogus nexus value %d", nexus);
+    req_free(req);
     return(HG_INVALID_PARAM);
   }
 
@@ -1820,6 +2624,7 @@ hg_return_t shuffler_send(shuffler_t sh, int dst, uint32_t type,
      * this should not happen!!!
      */
     mlog(CLNT_ERR, "shuffler_send: no route to dst %d", dst);
+    req_free(req);
     return(HG_INVALID_PARAM);
   }
 
@@ -1886,7 +2691,7 @@ static hg_return_t req_to_self(struct shuffler *sh, struct request *req,
   /* this allows delivery to be turned off for debugging... */
   if (sh->deliverq_max < 0) {
     mlog(SHUF_D1, "req_to_self: req=%p discarded (delivery disabled)", req);
-    free(req);
+    req_free(req);
     return(rv);
   }
 
@@ -1901,7 +2706,7 @@ static hg_return_t req_to_self(struct shuffler *sh, struct request *req,
     mlog(SHUF_D1, "req_to_self: deliverq req=%p qsize=%d", req, qsize);
     sh->deliverq.push_back(req);
     /* crossed threshold if the queue size before push_back == threshold */
-    if (qsize == sh->deliverq_threshold) {
+    if (qsize == sh->deliverq_threshold || (req->type & sh->pushmask) != 0) {
       mlog(SHUF_D1, "req_to_self: need to wake delivery thread");
       pthread_cond_signal(&sh->delivercv);  /* wake blocked thread */
     }
@@ -1918,12 +2723,15 @@ static hg_return_t req_to_self(struct shuffler *sh, struct request *req,
       shufmax(&sh->cntdmaxwait, sh->dwaitq.size());
     } else {
       notify(SHUF_CRIT, "shuffler: req_to_self parent init failed (%d)", rv);
-      drop_reqs(&req, NULL, "req_to_self"); /* error means we can't send it */
     }
 
   }
   pthread_mutex_unlock(&sh->deliverlock);
 
+  /* error means we can't send it.  drop after unlock (may HG_Destroy) */
+  if (rv != HG_SUCCESS)
+    drop_reqs(&req, NULL, "req_to_self");
+
   /*
    * if we are sending (!input) and need to wait, we'll block here.
    */
@@ -2010,7 +2818,8 @@ static hg_return_t req_via_mercury(struct shuffler *sh, struct outset *oset,
     /* we can start sending this req now, no need to wait */
     mlog(SHUF_D1, "req_via_mercury: !needwait, send req=%p", req);
     tosend = append_req_to_locked_outqueue(oset, oq, req,
-                                           &tosendq, &oput, false);
+                                           &tosendq, &oput,
+                                           (req->type & sh->pushmask) != 0);
 
   } else {
 
@@ -2203,6 +3012,9 @@ static hg_return_t forward_reqs_now(struct request_queue *tosend,
   mlog(SHUF_CALL, "forward_now: to dst=%p", oq->dst);
 
   /* always rehome the requests to in */
+  in.zhand = NULL;                 /* only used when decoding */
+  in.recsz = sh->fixedrecsz;       /* encoder falls back if reqs don't fit */
+  in.zip = (sh->zip && oset == &sh->remoteq) ? sh : NULL;
   XSIMPLEQ_INIT(&in.inreqs);
   XSIMPLEQ_CONCAT(&in.inreqs, tosend);
 
@@ -2270,7 +3082,7 @@ static hg_return_t forward_reqs_now(struct request_queue *tosend,
 
     /* success!  the data was copied to the handle, so we can free reqs */
     XSIMPLEQ_FOREACH_SAFE(rp, &in.inreqs, next, nrp) {
-      free(rp);
+      req_free(rp);
     }
   }
 
@@ -2463,8 +3275,8 @@ static void forw_start_next(struct outqueue *oq, struct output *oput) {
     /* this bumps nsending back up if it returns a "tosend" list */
     mlog(SHUF_D1, "forw_start_next: dst=%p, pull req=%p from waitq",
          oq->dst, req);
-    tosend = append_req_to_locked_outqueue(oset, oq, req,
-                                           &tosendq, &nxtoput, false);
+    tosend = append_req_to_locked_outqueue(oset, oq, req, &tosendq, &nxtoput,
+                                 (req->type & oset->shuf->pushmask) != 0);
   }
 
   /* if flushing, ensure our req got pushed out */
@@ -2579,7 +3391,13 @@ static hg_return_t shuffler_rpchand(hg_handle_t handle) {
     return(HG_CANCELED);
   }
 
-  /* decode RPC input into an rpcin_t */
+  /*
+   * decode RPC input into an rpcin_t.  in zero-copy mode the reqs
+   * point into the handle's input buffer and hold a ref on the handle
+   * (via their reqblk) so it stays valid after we respond.
+   */
+  in.zhand = (sh->zerocopy) ? handle : NULL;
+  in.zip = sh;                     /* for decompress stats */
   ret = HG_Get_input(handle, &in);
   if (ret != HG_SUCCESS) {
     notify(SHUF_CRIT, "rpchand: drop req due to get input error");
@@ -2956,6 +3774,79 @@ hg_return_t shuffler_flush_qs(shuffler_t sh, int whichqs) {
   return(rv);
 }
 
+/*
+ * shuffler_push_qs: send the partly loaded batches of the specified
+ * output queues now, without waiting for them to be delivered.  see
+ * shuffler.h for details.
+ */
+hg_return_t shuffler_push_qs(shuffler_t sh, int whichqs) {
+  hg_return_t rv = HG_SUCCESS;
+  struct outset *oset;
+  std::map<hg_addr_t, struct outqueue *>::iterator it;
+  struct outqueue *oq;
+  struct request_queue tosendq;
+  struct output *oput;
+  bool tosend;
+  mlog(CLNT_CALL, "shuffler_push_qs: type=%s", outset_typstr(whichqs));
+
+  if (sh->disablesend)
+    return(HG_CANCELED);
+
+  switch (whichqs) {
+    case SHUFFLER_REMOTE_QUEUES:
+      oset = &sh->remoteq;
+      break;
+    case SHUFFLER_ORIGIN_QUEUES:
+      oset = &sh->local_orq;
+      break;
+    case SHUFFLER_RELAY_QUEUES:
+      oset = &sh->local_rlq;
+      break;
+    default:
+      mlog(CLNT_ERR, "shuffler_push_qs(%d): bad whichqs", whichqs);
+      return(HG_OTHER_ERROR);
+  }
+
+  for (it = oset->oqs.begin() ; it != oset->oqs.end() ; it++) {
+    oq = it->second;
+
+    /*
+     * skip queues that are locked, flushing, or already at their
+     * rpc limit (the reqs on the waitq have to go out before the
+     * loading list, so they will push it along).
+     */
+    if (pthread_mutex_trylock(&oq->oqlock) != 0)
+      continue;
+    tosend = false;
+    if (!oq->oqflushing && oq->oqwaitq.empty() &&
+        oq->nsending < oset->maxoqrpc)
+      tosend = append_req_to_locked_outqueue(oset, oq, NULL,
+                                             &tosendq, &oput, true);
+    pthread_mutex_unlock(&oq->oqlock);
+
+    /* we dropped oq lock above since we are calling out to mercury */
+    if (tosend && forward_reqs_now(&tosendq, sh, oset, oq,
+                                   oput) != HG_SUCCESS) {
+      notify(CLNT_CRIT, "shuffler: push_qs: forward_reqs_now failed?!");
+      rv = HG_OTHER_ERROR;
+    }
+  }
+
+  return(rv);
+}
+
+/*
+ * shuffler_push_delivery: wake the delivery thread if it has reqs
+ * queued.  see shuffler.h for details.
+ */
+void shuffler_push_delivery(shuffler_t sh) {
+  if (pthread_mutex_trylock(&sh->deliverlock) != 0)
+    return;                 /* busy, so the delivery thread is too */
+  if (!sh->deliverq.empty())
+    pthread_cond_signal(&sh->delivercv);
+  pthread_mutex_unlock(&sh->deliverlock);
+}
+
 /*
  * start_qflush: start flushing an output queue if it is not empty.
  * flushing an output queue is a multi-step process.  first we must
@@ -3110,8 +4001,8 @@ static void dumpstats(shuffler_t sh) {
   int lcv;
 
   mlog(SHUF_NOTE, "stat counter dump follows");
-  mlog(SHUF_NOTE, "deliver-thread: dblock=%d, delivery=%d", sh->cntdblock,
-       sh->cntdeliver);
+  mlog(SHUF_NOTE, "deliver-thread: dblock=%d, delivery=%d, batched=%d",
+       sh->cntdblock, sh->cntdeliver, sh->cntdbatched);
   mlog(SHUF_NOTE, "deliver: reqs=%d/%d, waits=%d/%d, mxwait=%d",
        sh->cntdreqs[0], sh->cntdreqs[1], sh->cntdwait[0], sh->cntdwait[1],
        sh->cntdmaxwait);
@@ -3321,6 +4212,20 @@ void shuffler_statedump(shuffler_t sh, int tostderr) {
 
   notify(lvl, "flsh: cur=%p, typ=%d, done=%d", sh->curflush, sh->flushtype,
          sh->flushdone);
+
+  lck_rv = pthread_mutex_trylock(&reqpool_lock);
+  notify(lvl, "reqpool: waslck=%d, hits=%" PRIu64 ", grows=%" PRIu64
+         ", mallocs=%" PRIu64, lck_rv != 0, reqpool.hits, reqpool.grows,
+         reqpool.mallocs);
+  notify(lvl, "reqpool: blks=%" PRIu64 ", blkreqs=%" PRIu64 ", zcreqs=%"
+         PRIu64 ", bytes=%" PRIu64 ", peak=%" PRIu64, reqpool.blks,
+         reqpool.blkreqs, reqpool.zcreqs, reqpool.bytes, reqpool.peakbytes);
+  if (lck_rv == 0) pthread_mutex_unlock(&reqpool_lock);
+  lck_rv = pthread_mutex_trylock(&sh->ziplock);
+  notify(lvl, "zip: waslck=%d, on=%d, raw=%" PRIu64 ", zip=%" PRIu64
+         ", zipusec=%" PRIu64 ", unzipusec=%" PRIu64, lck_rv != 0, sh->zip,
+         sh->ziprawb, sh->zipb, sh->zipusec, sh->unzipusec);
+  if (lck_rv == 0) pthread_mutex_unlock(&sh->ziplock);
   statedump_oset(sh, lvl, "local_orgin", &sh->local_orq);
   statedump_oset(sh, lvl, "local_relay", &sh->local_rlq);
   statedump_oset(sh, lvl, "remote", &sh->remoteq);
@@ -3361,7 +4266,9 @@ hg_return_t shuffler_shutdown(shuffler_t sh) {
   if (sh->seqsrc) acnt32_free(&sh->seqsrc);
   pthread_mutex_destroy(&sh->deliverlock);
   pthread_cond_destroy(&sh->delivercv);
+  pthread_mutex_destroy(&sh->ziplock);
   pthread_mutex_destroy(&sh->flushlock);
+  reqpool_detach();
   delete sh;
   mlog(CLNT_CALL, "shuffer_shutdown: DONE closing log...");
   shuffler_closelog();
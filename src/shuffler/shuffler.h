@@ -136,6 +136,25 @@ typedef struct shuffler *shuffler_t;
 typedef void (*shuffler_deliver_t)(int src, int dst, uint32_t type,
                                    void *d, uint32_t datalen);
 
+/*
+ * shuffler_dreq: a msg being delivered to the DST via a batch callback
+ */
+struct shuffler_dreq {
+  int src;                          /* source rank */
+  int dst;                          /* destination rank */
+  uint32_t type;                    /* message type */
+  void *d;                          /* data buffer */
+  uint32_t datalen;                 /* length of data */
+};
+
+/*
+ * shuffler_deliverv_t: pointer to a callback function used to
+ * deliver a batch of msgs to the DST.  the batch is only valid
+ * for the duration of the callback.  this function may block if
+ * the DST is busy/full.
+ */
+typedef void (*shuffler_deliverv_t)(struct shuffler_dreq *v, int cnt);
+
 
 /*
  * shuffler_init: init's the shuffler layer.  if this returns an
@@ -156,6 +175,9 @@ typedef void (*shuffler_deliver_t)(int src, int dst, uint32_t type,
  * @param rbuftarget target number of bytes in remote batch RPC
  * @param deliverq_max max# reqs in deliverq before we switch to deliver waitq
  * @param deliverq_threshold wake delivery when #reqs on deliverq > threshold
+ * @param fixedrecsz if > 0, send batches where every msg is this size
+ *                   (and of the same type) in a compact fixed-record
+ *                   format (one header per batch rather than per msg)
  * @param delivercb application callback to deliver data
  * @return handle to shuffler (a pointer) or NULL on error
  */
@@ -163,7 +185,87 @@ shuffler_t shuffler_init(nexus_ctx_t nxp, char *funname,
            int localsenderlimit, int remotesenderlimit,
            int lomaxrpc, int lobuftarget, int lrmaxrpc, int lrbuftarget,
            int rmaxrpc, int rbuftarget, int deliverq_max,
-           int deliverq_threshold, shuffler_deliver_t delivercb);
+           int deliverq_threshold, int fixedrecsz,
+           shuffler_deliver_t delivercb);
+
+
+/*
+ * shuffler_set_deliverv: have the delivery thread hand msgs to the
+ * app in batches rather than one at a time.   once set, the batch
+ * callback is used instead of the delivercb passed to shuffler_init.
+ * each batch contains the reqs that are on the deliverq when the
+ * delivery thread wakes up (up to maxbatch reqs).   this should be
+ * called right after shuffler_init.
+ *
+ * @param sh shuffler service handle
+ * @param delivercbv application callback to deliver a batch of data
+ * @param maxbatch max# of reqs passed to delivercbv in one call
+ * @return status
+ */
+hg_return_t shuffler_set_deliverv(shuffler_t sh,
+                                  shuffler_deliverv_t delivercbv,
+                                  int maxbatch);
+
+
+/*
+ * shuffler_set_zerocopy: decode inbound RPCs in place.  rather than
+ * copying each msg out of the RPC's input buffer, the msgs point into
+ * it and the RPC handle is held until every msg from it has been
+ * delivered or relayed.  this saves a copy per hop, but an RPC buffer
+ * stays pinned while any of its msgs are queued (so mercury may have
+ * fewer handles free to post for new RPCs).  this should be called
+ * right after shuffler_init.
+ *
+ * @param sh shuffler service handle
+ * @param onoff non-zero to decode in place
+ * @return status
+ */
+hg_return_t shuffler_set_zerocopy(shuffler_t sh, int onoff);
+
+
+/*
+ * shuffler_set_compress: compress the msgs in RPCs we send over the
+ * network (remote hop only, na+sm RPCs are never compressed).  an
+ * RPC is only sent compressed if that makes it smaller.  compressed
+ * RPCs are always copied out when decoded (no zero-copy).  receivers
+ * always accept compressed RPCs, so this can be set per-sender.
+ *
+ * @param sh shuffler service handle
+ * @param onoff non-zero to compress
+ * @return status
+ */
+hg_return_t shuffler_set_compress(shuffler_t sh, int onoff);
+
+
+/*
+ * shuffler_set_pushtypes: mark msg types that should never wait in
+ * a partially filled batch.   a msg whose type has any of the given
+ * bits set flushes each output queue it is appended to (pushing out
+ * the msgs queued ahead of it) and wakes the delivery thread at its
+ * destination.   this is meant for rare control msgs (e.g. an app's
+ * end-of-epoch markers) that must make progress without a flush.
+ *
+ * @param sh shuffler service handle
+ * @param mask type bits of msgs to push (0 to turn off)
+ * @return status
+ */
+hg_return_t shuffler_set_pushtypes(shuffler_t sh, uint32_t mask);
+
+
+/*
+ * shuffler_zip_stats: get RPC compression stats (running totals).
+ * cpu times are thread cpu time summed across threads.
+ *
+ * @param sh shuffler service handle
+ * @param rawbytes #bytes of msgs we compressed (before compression)
+ * @param zipbytes #bytes of msgs we compressed (after compression)
+ * @param zipusec cpu usec spent compressing
+ * @param unzipusec cpu usec spent decompressing
+ * @return status
+ */
+hg_return_t shuffler_zip_stats(shuffler_t sh, hg_uint64_t *rawbytes,
+                               hg_uint64_t *zipbytes, hg_uint64_t *zipusec,
+                               hg_uint64_t *unzipusec);
 
 
 /*
@@ -171,8 +273,11 @@ shuffler_t shuffler_init(nexus_ctx_t nxp, char *funname,
  * this is not end-to-end, it returns success once the message has
  * been queued for the next hop (the message data is copied into
  * the output queue, so the buffer passed in as an arg can be reused
- * when this function returns).   this is called by the main client
- * thread.
+ * when this function returns).   sends are not audited for use by
+ * several threads at once (e.g. the send stats are not updated
+ * atomically), so a client that sends from several threads must
+ * serialize its calls to shuffler_send() and to each
+ * shuffler_send_reserve()/shuffler_send_commit() pair.
  *
  * @param sh shuffler service handle
  * @param dst target to send to
@@ -184,6 +289,32 @@ shuffler_t shuffler_init(nexus_ctx_t nxp, char *funname,
 hg_return_t shuffler_send(shuffler_t sh, int dst, uint32_t type,
                           void *d, uint32_t datalen);
 
+/*
+ * shuffler_send_reserve: get a buffer for a message that the caller
+ * builds in place, saving the data copy done by shuffler_send().
+ * the buffer must be handed to shuffler_send_commit() next, with
+ * no other sends in between (see shuffler_send() above).
+ *
+ * @param sh shuffler service handle
+ * @param datalen length of data
+ * @return a datalen byte buffer, or NULL on error (or send disabled)
+ */
+void *shuffler_send_reserve(shuffler_t sh, uint32_t datalen);
+
+/*
+ * shuffler_send_commit: start the sending of a message built in a
+ * buffer from shuffler_send_reserve().  the buffer is owned by the
+ * shuffler from now on (even if we fail).
+ *
+ * @param sh shuffler service handle
+ * @param dst target to send to
+ * @param type message type (normally 0)
+ * @param d buffer from shuffler_send_reserve()
+ * @return status (success if we've queued the data)
+ */
+hg_return_t shuffler_send_commit(shuffler_t sh, int dst, uint32_t type,
+                                 void *d);
+
 
 /*
  * shuffler_flush_delivery: flush the delivery queue.  this function
@@ -216,6 +347,28 @@ hg_return_t shuffler_flush_delivery(shuffler_t sh);
 hg_return_t shuffler_flush_qs(shuffler_t sh, int whichqs);
 
 
+/*
+ * shuffler_push_qs: send what is loaded in the specified output
+ * queues now rather than waiting for full batches.  unlike
+ * shuffler_flush_qs(), this never blocks: queues that are locked,
+ * flushing, or at their rpc limit are skipped, and we do not wait
+ * for anything we send to be delivered.
+ *
+ * @param sh shuffler service handle
+ * @param whichqs which queues to push (see defines above)
+ * @return status
+ */
+hg_return_t shuffler_push_qs(shuffler_t sh, int whichqs);
+
+/*
+ * shuffler_push_delivery: wake the delivery thread to deliver the
+ * requests it has queued without waiting for more to arrive.  does
+ * not block.
+ *
+ * @param sh shuffler service handle
+ */
+void shuffler_push_delivery(shuffler_t sh);
+
 /*
  * shuffler_flush_originqs: flush client/origin qs (wrap for shuffler_flush_qs)
  *
@@ -41,10 +41,12 @@
 
 #include <map>
 #include <deque>
+#include <vector>
 #include "acnt_wrap.h"
 #include "xqueue.h"
 
 struct req_parent;                  /* forward decl, see below */
+struct reqblk;                      /* forward decl, see below */
 struct outset;                      /* forward decl, see below */
 struct hgthread;                    /* forward decl, see below */
 
@@ -53,6 +55,8 @@ struct hgthread;                    /* forward decl, see below */
  * it has a fixed sized header (first four fields), and a
  * variable length data buffer.   we always allocate the header
  * and the data together.   data will be null if datalen == 0.
+ * requests are allocated with req_alloc() (or carved out of a
+ * reqblk when decoded) and must be released with req_free().
  */
 struct request {
   /* fields that are transmitted over the wire */
@@ -71,6 +75,81 @@ struct request {
    */
   struct req_parent *owner;         /* waiter that generated the request */
   XSIMPLEQ_ENTRY(request) next;     /* next request in a queue of requests */
+
+  /* how the request was allocated (see req_free()) */
+  int32_t rclass;                   /* slab class, or one of the below */
+#define REQ_CLASS_MALLOC  -1        /* malloc'd on its own */
+#define REQ_CLASS_BLK     -2        /* carved out of a reqblk */
+  struct reqblk *blk;               /* owning reqblk (REQ_CLASS_BLK only) */
+};
+
+/*
+ * reqblk: a block of memory that the requests decoded from an
+ * inbound RPC are carved out of (rather than malloc'ing each one).
+ * the block is freed when the decoder and all requests carved out
+ * of it have dropped their reference.   in zero-copy mode only the
+ * request headers live in the reqblk: the data points into the RPC's
+ * input buffer and the reqblk holds a ref on the RPC's handle (the
+ * ref is dropped with HG_Destroy() when the reqblk is freed).
+ */
+struct reqblk {
+  acnt32_t nrefs;                   /* decoder + live requests */
+  hg_handle_t hand;                 /* handle we hold a ref on, or NULL */
+  uint32_t size;                    /* bytes of storage after the header */
+  uint32_t used;                    /* bytes carved out so far */
+};
+
+/*
+ * reqslab_class: a free list of fixed-sized request chunks.
+ * chunks are carved out of large slabs and are recycled via
+ * the free list (slabs are only released when the last shuffler
+ * shuts down).
+ */
+struct reqslab_class {
+  uint32_t maxdata;                 /* max datalen served by this class */
+  void *freelist;                   /* free chunks (linked thru 1st word) */
+  std::vector<void *> slabs;        /* slabs allocated */
+};
+
+/*
+ * reqpool: process-wide request allocator state.  users, gen, cls[],
+ * hits, and grows are locked with reqpool_lock.  the other counters
+ * are updated atomically.  the counters are reported by statedump.
+ */
+#define REQPOOL_NCLASS  4           /* classes: 64, 128, 256, 512 bytes */
+#define REQPOOL_MINDATA 64          /* data size of smallest class */
+#define REQPOOL_SLABSZ  (256*1024)  /* bytes per slab */
+#define REQPOOL_BLKSZ   (64*1024)   /* default size of a reqblk */
+#define REQPOOL_BATCH   32          /* chunks moved to/from a reqcache */
+struct reqpool {
+  int users;                        /* number of active shufflers */
+  uint64_t gen;                     /* bumped each time slabs are set up */
+  struct reqslab_class cls[REQPOOL_NCLASS];
+  /* stats */
+  uint64_t hits;                    /* allocs served from a free list */
+  uint64_t grows;                   /* num slabs allocated */
+  uint64_t mallocs;                 /* allocs that fell back to malloc */
+  uint64_t blks;                    /* num reqblks allocated */
+  uint64_t blkreqs;                 /* num reqs carved out of reqblks */
+  uint64_t zcreqs;                  /* blkreqs decoded in place (zero-copy) */
+  uint64_t bytes;                   /* bytes currently allocated */
+  uint64_t peakbytes;               /* max value of "bytes" */
+};
+
+/*
+ * reqcache: per-thread cache of free chunks, one list per slab
+ * class.  threads alloc and free slab requests through their own
+ * cache and only take reqpool_lock to move REQPOOL_BATCH chunks at
+ * a time between the cache and the shared free lists.  chunks
+ * cached by a thread that exits are not reused until the slabs
+ * are released.  a cache is only valid for the reqpool "gen" it
+ * was filled from.
+ */
+struct reqcache {
+  uint64_t gen;                     /* reqpool gen of cached chunks */
+  void *freelist[REQPOOL_NCLASS];   /* free chunks (linked thru 1st word) */
+  int nfree[REQPOOL_NCLASS];        /* length of each freelist */
+  uint64_t hits;                    /* hits not yet added to reqpool */
 };
 
 /*
@@ -82,12 +161,18 @@ XSIMPLEQ_HEAD(request_queue, request);
  * rpcin_t: a batch of requests (top-level RPC request structure).
  * when we serialize this, we add a request with datalen/type=zero
  * to mark the end of the list (XXX: safer that trying to use
- * hg_proc_get_size_left()?).   note: seq is signed to match acnt32_t.
+ * hg_proc_get_size_left()?).   if all reqs are recsz bytes we may
+ * use the compact fixed-record format instead (see hg_proc_rpcin_body).
+ * the reqs may also be compressed (see hg_proc_rpcin_t).
+ * note: seq is signed to match acnt32_t.
  */
 typedef struct {
   int32_t iseq;                     /* seq# (echoed back), for debugging */
   int32_t forwardrank;              /* rank of proc that initiated rpc */
-  struct request_queue inreqs;      /* list of malloc'd requests */
+  uint32_t recsz;                   /* fixed record size, 0 if variable */
+  struct request_queue inreqs;      /* list of decoded requests */
+  hg_handle_t zhand;                /* decode in place in this (not sent) */
+  struct shuffler *zip;             /* compress reqs, for stats (not sent) */
 } rpcin_t;
 
 /*
@@ -293,6 +378,10 @@ struct shuffler {
   int grank;                        /* my global rank */
   char *funname;                    /* strdup'd copy of mercury func. name */
   int disablesend;                  /* disable new sends (for shutdown) */
+  int zerocopy;                     /* decode inbound reqs in place */
+  int fixedrecsz;                   /* try fixed-record RPCs if > 0 */
+  int zip;                          /* compress remote RPCs */
+  uint32_t pushmask;                /* types of msgs pushed w/o batching */
   time_t boottime;                  /* time we started */
 
   /* mercury threads */
@@ -309,6 +398,8 @@ struct shuffler {
   int deliverq_max;                 /* max #reqs we queue before blocking */
   int deliverq_threshold;           /* wake dlvr when #reqs on q > threshold */
   shuffler_deliver_t delivercb;     /* callback function ptr */
+  shuffler_deliverv_t delivercbv;   /* batch callback fn ptr (or NULL) */
+  std::vector<shuffler_dreq> dvec;  /* batch being delivered (dtask only) */
 
   /* delivery thread and queue itself */
   pthread_mutex_t deliverlock;      /* locks this block of fields */
@@ -320,6 +411,13 @@ struct shuffler {
   int drunning;                     /* dtask is valid and running */
   pthread_t dtask;                  /* delivery thread */
 
+  /* rpc compression stats (only remoteq RPCs are compressed) */
+  pthread_mutex_t ziplock;          /* locks this block of fields */
+  uint64_t ziprawb;                 /* #bytes before compression */
+  uint64_t zipb;                    /* #bytes after compression */
+  uint64_t zipusec;                 /* cpu usec spent compressing */
+  uint64_t unzipusec;               /* cpu usec spent decompressing */
+
   /* flush operation management - flush ops are serialized */
   pthread_mutex_t flushlock;        /* locks the following fields */
   struct flush_queue fpending;      /* queue of pending flush ops */
@@ -343,6 +441,7 @@ struct shuffler {
   /* lock by deliverlock */
   int cntdblock;                    /* number of times deliver blocks */
   int cntdeliver;                   /* number of times delivery cb called */
+  int cntdbatched;                  /* number of reqs delivered in batches */
   int cntdreqs[2];                  /* number of reqs input */
   int cntdwait[2];                  /* number of reqs on delivery wait q*/
   unsigned int cntdmaxwait;         /* max waitq size */
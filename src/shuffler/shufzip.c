@@ -0,0 +1,221 @@
+/*
+ * Copyright (c) 2017, Carnegie Mellon University.
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of the University nor the names of its contributors
+ *    may be used to endorse or promote products derived from this software
+ *    without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * ``AS IS'' AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ * A PARTICULAR PURPOSE ARE DISCLAIMED.  IN NO EVENT SHALL THE COPYRIGHT
+ * HOLDERS OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT,
+ * INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING,
+ * BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS
+ * OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED
+ * AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY
+ * WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+
+/*
+ * shufzip.c  lightweight block compression for shuffle RPC payloads
+ */
+
+/*
+ * block format: a list of sequences.  each sequence is:
+ *
+ *   <token> [litlen ext] <literals> [<offset> [matchlen ext]]
+ *
+ * the high nibble of the token is the number of literals and the
+ * low nibble is the match length minus SZ_MINMATCH.  a nibble of 15
+ * means that more length follows in extension bytes (each 255 means
+ * keep going).  the offset is 2 bytes, little endian.  the final
+ * sequence only has literals (the block ends after them).
+ */
+
+#include <stdint.h>
+#include <string.h>
+
+#include "shufzip.h"
+
+#define SZ_MINMATCH  4                  /* shortest match we encode */
+#define SZ_MAXOFF    65535              /* max match distance */
+#define SZ_HASHLOG   12                 /* log2 of match table size */
+#define SZ_SKIPTRIG  6                  /* speed up after 2^n misses */
+
+/* read 4 bytes (unaligned) */
+static uint32_t sz_read32(const uint8_t *p) {
+  uint32_t v;
+  memcpy(&v, p, sizeof(v));
+  return(v);
+}
+
+/* hash 4 bytes into the match table */
+static uint32_t sz_hash(uint32_t v) {
+  return((v * 2654435761U) >> (32 - SZ_HASHLOG));
+}
+
+/*
+ * sz_putlen: put the extension bytes for a length >= 15 (n is the
+ * part of the length beyond 15).  returns new op or NULL on overflow.
+ */
+static uint8_t *sz_putlen(uint8_t *op, uint8_t *oend, int n) {
+  while (n >= 255) {
+    if (op >= oend) return(NULL);
+    *op++ = 255;
+    n -= 255;
+  }
+  if (op >= oend) return(NULL);
+  *op++ = (uint8_t)n;
+  return(op);
+}
+
+/*
+ * sz_getlen: get extension bytes, adding them to *n.  returns new ip
+ * or NULL if we run off the end of the input.
+ */
+static const uint8_t *sz_getlen(const uint8_t *ip, const uint8_t *iend,
+                                int *n) {
+  uint8_t b;
+  do {
+    if (ip >= iend) return(NULL);
+    b = *ip++;
+    *n += b;
+  } while (b == 255);
+  return(ip);
+}
+
+/*
+ * sz_putseq: put a sequence.  mlen == 0 means literals only.
+ * returns new op or NULL on overflow.
+ */
+static uint8_t *sz_putseq(uint8_t *op, uint8_t *oend, const uint8_t *lit,
+                          int litlen, int off, int mlen) {
+  uint8_t *token;
+  int mcode;
+
+  if (op >= oend) return(NULL);
+  token = op++;
+  *token = (uint8_t)(((litlen < 15) ? litlen : 15) << 4);
+  if (litlen >= 15 && (op = sz_putlen(op, oend, litlen - 15)) == NULL)
+    return(NULL);
+  if (oend - op < litlen) return(NULL);
+  memcpy(op, lit, litlen);
+  op += litlen;
+  if (mlen == 0)
+    return(op);
+
+  if (oend - op < 2) return(NULL);
+  *op++ = (uint8_t)(off & 0xff);
+  *op++ = (uint8_t)(off >> 8);
+  mcode = mlen - SZ_MINMATCH;
+  *token |= (uint8_t)((mcode < 15) ? mcode : 15);
+  if (mcode >= 15 && (op = sz_putlen(op, oend, mcode - 15)) == NULL)
+    return(NULL);
+  return(op);
+}
+
+/*
+ * shufzip_compress: compress a block.
+ */
+int shufzip_compress(const void *src, int srclen, void *dst, int dstcap) {
+  const uint8_t *base = (const uint8_t *)src;
+  const uint8_t *ip = base, *anchor = base, *iend = base + srclen;
+  const uint8_t *ref;
+  uint8_t *op = (uint8_t *)dst, *oend = op + dstcap;
+  int32_t htab[1 << SZ_HASHLOG];
+  uint32_t seq, h;
+  int misses = 0, mlen;
+
+  if (srclen < 0 || dstcap < 0)
+    return(-1);
+  memset(htab, 0xff, sizeof(htab));     /* all -1 */
+
+  while (iend - ip >= SZ_MINMATCH) {
+    seq = sz_read32(ip);
+    h = sz_hash(seq);
+    ref = (htab[h] < 0) ? NULL : base + htab[h];
+    htab[h] = (int32_t)(ip - base);
+    if (ref == NULL || ip - ref > SZ_MAXOFF || sz_read32(ref) != seq) {
+      ip += (misses++ >> SZ_SKIPTRIG) + 1;   /* skip faster if no luck */
+      continue;
+    }
+    misses = 0;
+
+    /* extend the match as far as we can */
+    mlen = SZ_MINMATCH;
+    while (ip + mlen < iend && ref[mlen] == ip[mlen])
+      mlen++;
+
+    op = sz_putseq(op, oend, anchor, (int)(ip - anchor),
+                   (int)(ip - ref), mlen);
+    if (op == NULL)
+      return(-1);
+    ip += mlen;
+    anchor = ip;
+  }
+
+  /* last literals */
+  op = sz_putseq(op, oend, anchor, (int)(iend - anchor), 0, 0);
+  if (op == NULL)
+    return(-1);
+  return((int)(op - (uint8_t *)dst));
+}
+
+/*
+ * shufzip_decompress: decompress a block.
+ */
+int shufzip_decompress(const void *src, int srclen, void *dst, int dstcap) {
+  const uint8_t *ip = (const uint8_t *)src, *iend = ip + srclen;
+  uint8_t *obase = (uint8_t *)dst, *op = obase, *oend = obase + dstcap;
+  const uint8_t *ref;
+  uint8_t token;
+  int litlen, mlen, off;
+
+  if (srclen <= 0 || dstcap < 0)
+    return(-1);
+
+  while (ip < iend) {
+    token = *ip++;
+    litlen = token >> 4;
+    if (litlen == 15 && (ip = sz_getlen(ip, iend, &litlen)) == NULL)
+      return(-1);
+    if (iend - ip < litlen || oend - op < litlen)
+      return(-1);
+    memcpy(op, ip, litlen);
+    op += litlen;
+    ip += litlen;
+    if (ip == iend)                     /* last sequence is literals only */
+      break;
+
+    if (iend - ip < 2)
+      return(-1);
+    off = ip[0] | (ip[1] << 8);
+    ip += 2;
+    if (off == 0 || off > op - obase)
+      return(-1);
+    mlen = token & 15;
+    if (mlen == 15 && (ip = sz_getlen(ip, iend, &mlen)) == NULL)
+      return(-1);
+    mlen += SZ_MINMATCH;
+    if (oend - op < mlen)
+      return(-1);
+    ref = op - off;
+    while (mlen-- > 0)                  /* may overlap, copy bytewise */
+      *op++ = *ref++;
+  }
+
+  return((int)(op - obase));
+}
@@ -0,0 +1,81 @@
+/*
+ * Copyright (c) 2017, Carnegie Mellon University.
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of the University nor the names of its contributors
+ *    may be used to endorse or promote products derived from this software
+ *    without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * ``AS IS'' AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ * A PARTICULAR PURPOSE ARE DISCLAIMED.  IN NO EVENT SHALL THE COPYRIGHT
+ * HOLDERS OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT,
+ * INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING,
+ * BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS
+ * OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED
+ * AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY
+ * WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+
+/*
+ * shufzip.h  lightweight block compression for shuffle RPC payloads
+ */
+
+/*
+ * shufzip is a small LZ77 style block codec (the sequence format
+ * is close to LZ4's).  it is meant for shuffle RPC payloads, which
+ * are made of fixed sized particle records: particle ids from the
+ * same source often share long prefixes and many payload bytes
+ * repeat, so a fast match finder with a 64KB window catches most of
+ * the redundancy at low CPU cost.   each block is self contained.
+ * the codec has no dependencies and no state between calls, so it
+ * is safe to call from any thread.
+ */
+
+#pragma once
+
+#if defined(__cplusplus)
+extern "C" {
+#endif
+
+/**
+ * shufzip_compress: compress a block.  we only succeed if the
+ * compressed block fits in dstcap bytes.  callers that only want
+ * compression when it saves space should pass dstcap < srclen.
+ *
+ * @param src the data to compress
+ * @param srclen length of src
+ * @param dst where to put the compressed block
+ * @param dstcap size of dst
+ * @return length of the compressed block, or -1 if it didn't fit
+ */
+int shufzip_compress(const void *src, int srclen, void *dst, int dstcap);
+
+/**
+ * shufzip_decompress: decompress a block built by shufzip_compress.
+ * the input is checked, so a corrupted block fails rather than
+ * overrunning dst.
+ *
+ * @param src the compressed block
+ * @param srclen length of src
+ * @param dst where to put the decompressed data
+ * @param dstcap size of dst
+ * @return length of the decompressed data, or -1 on error
+ */
+int shufzip_decompress(const void *src, int srclen, void *dst, int dstcap);
+
+#if defined(__cplusplus)
+}
+#endif
@@ -98,35 +98,153 @@ void xn_shuffler_epoch_start(xn_ctx_t* ctx) {
   shuffler_send_stats(ctx->sh, &tmpori, &tmprl, &ctx->stat.remote.sends);
   ctx->stat.local.sends = tmpori + tmprl;
   shuffler_recv_stats(ctx->sh, &ctx->stat.local.recvs, &ctx->stat.remote.recvs);
+  shuffler_zip_stats(ctx->sh, &ctx->stat.zip.raw, &ctx->stat.zip.zip,
+                     &ctx->stat.zip.zusec, &ctx->stat.zip.uzusec);
   hret = shuffler_flush_delivery(ctx->sh);
   if (hret != HG_SUCCESS) {
     RPC_FAILED("fail to flush delivery", hret);
   }
 }
 
+/*
+ * This function may be called at any time by the main thread while it waits on
+ * other ranks. Unlike xn_shuffler_epoch_start, it does not involve the other
+ * local ranks, so it cannot tell if all requests have been forwarded. It only
+ * pushes out what has arrived so far and never blocks: it neither waits on
+ * busy queues nor for anything to be delivered. Errors are ignored since the
+ * next epoch flush will report them.
+ */
+void xn_shuffler_progress(xn_ctx_t* ctx) {
+  assert(ctx != NULL);
+  if (ctx->sh == NULL) return;
+  shuffler_push_qs(ctx->sh, SHUFFLER_RELAY_QUEUES);
+  shuffler_push_delivery(ctx->sh);
+}
+
+/*
+ * With epoch markers on, msg types carry the epoch of the msg: the type of a
+ * write is (epoch + 1) << 1, and the type of an end-of-epoch marker is that
+ * with the lowest bit set. Type 0 stands for "the receiver's current epoch".
+ */
+#define XN_MARKER_BIT 1u
+#define XN_IS_MARKER(type) (((type)&XN_MARKER_BIT) != 0)
+#define XN_EPOCH(type) (static_cast<int>((type) >> 1) - 1)
+#define XN_TYPE(epoch) ((static_cast<uint32_t>(epoch) + 1) << 1)
+#define XN_MARKER(epoch) (XN_TYPE(epoch) | XN_MARKER_BIT)
+
+static inline uint32_t xn_shuffler_type(xn_ctx_t* ctx, int epoch) {
+  return ctx->markers ? XN_TYPE(epoch) : 0;
+}
+
 static void xn_shuffler_deliver(int src, int dst, uint32_t type, void* buf,
                                 uint32_t buf_sz) {
+  hg_uint64_t nwrites;
   int rv;
 
-  rv = shuffle_handle(NULL, static_cast<char*>(buf), buf_sz, -1, src, dst);
+  if (XN_IS_MARKER(type)) {
+    if (buf_sz != sizeof(nwrites)) {
+      ABORT("bad epoch marker");
+    }
+    memcpy(&nwrites, buf, sizeof(nwrites));
+    shuffle_epoch_marker(NULL, src, XN_EPOCH(type), nwrites);
+    return;
+  }
+
+  rv = shuffle_handle(NULL, static_cast<char*>(buf), buf_sz, XN_EPOCH(type),
+                      src, dst);
 
   if (rv != 0) {
     ABORT("plfsdir write failed");
   }
 }
 
+static void xn_shuffler_deliverv(struct shuffler_dreq* v, int cnt) {
+  char* bufs[MAX_HANDLE_BATCH];
+  int srcs[MAX_HANDLE_BATCH];
+  uint32_t buf_sz;
+  int n;
+  int i;
+  int rv;
+
+  /* split the batch into runs of equal-sized msgs of the same type */
+  for (i = 0; i < cnt; i += n) {
+    if (XN_IS_MARKER(v[i].type)) {
+      xn_shuffler_deliver(v[i].src, v[i].dst, v[i].type, v[i].d,
+                          v[i].datalen);
+      n = 1;
+      continue;
+    }
+    buf_sz = v[i].datalen;
+    for (n = 0; i + n < cnt && n < MAX_HANDLE_BATCH; n++) {
+      if (v[i + n].datalen != buf_sz || v[i + n].type != v[i].type) break;
+      bufs[n] = static_cast<char*>(v[i + n].d);
+      srcs[n] = v[i + n].src;
+    }
+    rv = shuffle_handle_batch(NULL, bufs, n, buf_sz, XN_EPOCH(v[i].type), srcs,
+                              v[i].dst);
+    if (rv != 0) {
+      ABORT("plfsdir write failed");
+    }
+  }
+}
+
 void xn_shuffler_enqueue(xn_ctx_t* ctx, void* buf, unsigned char buf_sz,
                          int epoch, int dst, int src) {
   hg_return_t hret;
   assert(ctx->sh != NULL);
-  hret = shuffler_send(ctx->sh, dst, 0, buf, buf_sz);
+  pthread_mtx_lock(&ctx->send_mtx);
+  hret = shuffler_send(ctx->sh, dst, xn_shuffler_type(ctx, epoch), buf,
+                       buf_sz);
+  pthread_mtx_unlock(&ctx->send_mtx);
 
   if (hret != HG_SUCCESS) {
     RPC_FAILED("plfsdir shuffler send failed", hret);
   }
 }
 
-void xn_shuffler_init(xn_ctx_t* ctx) {
+void xn_shuffler_mark(xn_ctx_t* ctx, int dst, int epoch,
+                      unsigned long long nwrites) {
+  hg_uint64_t tmp;
+  hg_return_t hret;
+  assert(ctx->sh != NULL);
+  tmp = nwrites;
+  pthread_mtx_lock(&ctx->send_mtx);
+  hret = shuffler_send(ctx->sh, dst, XN_MARKER(epoch), &tmp, sizeof(tmp));
+  pthread_mtx_unlock(&ctx->send_mtx);
+
+  if (hret != HG_SUCCESS) {
+    RPC_FAILED("plfsdir shuffler marker failed", hret);
+  }
+}
+
+void* xn_shuffler_reserve(xn_ctx_t* ctx, unsigned char buf_sz) {
+  void* buf;
+  assert(ctx->sh != NULL);
+  pthread_mtx_lock(&ctx->send_mtx); /* released by xn_shuffler_commit */
+  buf = shuffler_send_reserve(ctx->sh, buf_sz);
+
+  if (buf == NULL) {
+    ABORT("plfsdir shuffler reserve failed");
+  }
+
+  return buf;
+}
+
+void xn_shuffler_commit(xn_ctx_t* ctx, void* buf, int epoch, int dst,
+                        int src) {
+  hg_return_t hret;
+  assert(ctx->sh != NULL);
+  hret =
+      shuffler_send_commit(ctx->sh, dst, xn_shuffler_type(ctx, epoch), buf);
+  pthread_mtx_unlock(&ctx->send_mtx);
+
+  if (hret != HG_SUCCESS) {
+    RPC_FAILED("plfsdir shuffler send failed", hret);
+  }
+}
+
+void xn_shuffler_init(xn_ctx_t* ctx, int recsz) {
+  int fixedrecsz;
   int deliverq_min;
   int deliverq_max;
   int lrmaxrpc;
@@ -138,11 +256,15 @@ void xn_shuffler_init(xn_ctx_t* ctx) {
   int rbuftarget;
   int rsenderlimit;
   const char* logfile;
+  hg_return_t hret;
   const char* env;
   char uri[100];
   int n;
 
   assert(ctx != NULL);
+  if (pthread_mutex_init(&ctx->send_mtx, NULL) != 0) {
+    ABORT("pthread_mutex_init");
+  }
 
   shuffle_prepare_uri(uri);
   ctx->nx = nexus_bootstrap_uri(uri);
@@ -256,6 +378,12 @@ void xn_shuffler_init(xn_ctx_t* ctx) {
     }
   }
 
+  if (is_envset("SHUFFLE_Fixed_records")) {
+    fixedrecsz = recsz;
+  } else {
+    fixedrecsz = 0;
+  }
+
   logfile = maybe_getenv("SHUFFLE_Log_file");
 #define DEF_CFGLOG_ARGS(log) -1, "INFO", "WARN", NULL, NULL, log, 1, 0, 0, 0
   if (logfile != NULL && logfile[0] != 0 && strcmp(logfile, "/") != 0) {
@@ -265,16 +393,32 @@ void xn_shuffler_init(xn_ctx_t* ctx) {
   ctx->sh = shuffler_init(ctx->nx, const_cast<char*>("shuffle_rpc_write"),
                           lsenderlimit, rsenderlimit, lomaxrpc, lobuftarget,
                           lrmaxrpc, lrbuftarget, rmaxrpc, rbuftarget,
-                          deliverq_max, deliverq_min, xn_shuffler_deliver);
+                          deliverq_max, deliverq_min, fixedrecsz,
+                          xn_shuffler_deliver);
 
   if (ctx->sh == NULL) {
     ABORT("shuffler_init");
-  } else if (pctx.my_rank == 0) {
+  }
+  /* msgs delivered before this takes effect go through the per-msg callback */
+  hret = shuffler_set_deliverv(
+      ctx->sh, xn_shuffler_deliverv,
+      deliverq_max > 0 ? deliverq_max : DEFAULT_DELIVER_MAX);
+  if (hret != HG_SUCCESS) {
+    RPC_FAILED("shuffler_set_deliverv", hret);
+  }
+  if (ctx->markers) {
+    /* markers must not wait in a half-filled batch at any hop */
+    hret = shuffler_set_pushtypes(ctx->sh, XN_MARKER_BIT);
+    if (hret != HG_SUCCESS) {
+      RPC_FAILED("shuffler_set_pushtypes", hret);
+    }
+  }
+  if (pctx.my_rank == 0) {
     logf(LOG_INFO,
          "3-HOP confs: sndlim(l/r)=%d/%d, maxrpc(lo/lr/r)=%d/%d/%d, "
-         "buftgt(lo/lr/r)=%d/%d/%d, dq(min/max)=%d/%d",
+         "buftgt(lo/lr/r)=%d/%d/%d, dq(min/max)=%d/%d, recsz=%d",
          lsenderlimit, rsenderlimit, lomaxrpc, lrmaxrpc, rmaxrpc, lobuftarget,
-         lrbuftarget, rbuftarget, deliverq_min, deliverq_max);
+         lrbuftarget, rbuftarget, deliverq_min, deliverq_max, fixedrecsz);
     if (logfile != NULL && logfile[0] != 0 && strcmp(logfile, "/") != 0) {
       fputs(">>> LOGGING is ON, will log to ...\n --> ", stderr);
       fputs(logfile, stderr);
@@ -282,6 +426,26 @@ void xn_shuffler_init(xn_ctx_t* ctx) {
     }
   }
 
+  if (is_envset("SHUFFLE_Zero_copy")) {
+    hret = shuffler_set_zerocopy(ctx->sh, 1);
+    if (hret != HG_SUCCESS) {
+      RPC_FAILED("shuffler_set_zerocopy", hret);
+    }
+    if (pctx.my_rank == 0) {
+      logf(LOG_INFO, "3-HOP zero-copy rpc decode ON");
+    }
+  }
+
+  if (is_envset("SHUFFLE_Compress")) {
+    hret = shuffler_set_compress(ctx->sh, 1);
+    if (hret != HG_SUCCESS) {
+      RPC_FAILED("shuffler_set_compress", hret);
+    }
+    if (pctx.my_rank == 0) {
+      logf(LOG_INFO, "3-HOP remote rpc compression ON");
+    }
+  }
+
   if (is_envset("SHUFFLE_Force_global_barrier")) {
     ctx->force_global_barrier = 1;
     if (pctx.my_rank == 0) {
@@ -324,5 +488,6 @@ void xn_shuffler_destroy(xn_ctx_t* ctx) {
       nexus_destroy(ctx->nx);
       ctx->nx = NULL;
     }
+    pthread_mutex_destroy(&ctx->send_mtx);
   }
 }
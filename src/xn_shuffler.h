@@ -64,6 +64,15 @@
  *  SHUFFLE_Dq_max
  *    Max queue size for the final delivery queue
  *      Set to "-1" to disable msg delivery so all msgs will be discarded
+ *  SHUFFLE_Fixed_records
+ *    Send rpcs in a compact format with a single header for all msgs
+ *      Saves 16 bytes per msg minus ~2 bytes of delta-coded src/dst
+ *  SHUFFLE_Zero_copy
+ *    Decode incoming rpcs in place instead of copying each msg out
+ *      Rpc buffers stay pinned until all their msgs are delivered/relayed
+ *  SHUFFLE_Compress
+ *    Compress the msgs in rpcs sent over the network (remote hop only)
+ *      An rpc is sent as is if compression does not make it smaller
  *  SHUFFLE_Min_port
  *    The min port number we can use
  *  SHUFFLE_Max_port
@@ -74,6 +83,7 @@
 
 #pragma once
 
+#include <pthread.h>
 #include <stddef.h>
 
 #include <deltafs-nexus/deltafs-nexus_api.h>
@@ -90,20 +100,31 @@ typedef struct xn_stat {
     hg_uint64_t recvs; /* total rpcs received */
     hg_uint64_t sends; /* total rpcs sent */
   } remote;
+  struct {
+    hg_uint64_t raw;    /* total bytes before compression */
+    hg_uint64_t zip;    /* total bytes after compression */
+    hg_uint64_t zusec;  /* total cpu usec spent compressing */
+    hg_uint64_t uzusec; /* total cpu usec spent decompressing */
+  } zip;
 } xn_stat_t;
 
 /* shuffle context for the multi-hop shuffler */
 typedef struct xn_ctx {
   /* replace all local barriers with global barriers */
   int force_global_barrier;
+  /* tag msgs with their epochs and send end-of-epoch markers */
+  int markers;
   xn_stat_t last_stat;
   xn_stat_t stat;
   nexus_ctx_t nx; /* nexus handle */
   shuffler_t sh;
+  /* serializes sends into sh, which expects a single sending thread. held
+   * from xn_shuffler_reserve until the matching xn_shuffler_commit. */
+  pthread_mutex_t send_mtx;
 } xn_ctx_t;
 
-/* xn_shuffler_init: init the shuffler or die */
-extern void xn_shuffler_init(xn_ctx_t* ctx);
+/* xn_shuffler_init: init the shuffler or die, all msgs are recsz bytes */
+extern void xn_shuffler_init(xn_ctx_t* ctx, int recsz);
 
 /* xn_shuffler_world_size: return comm world size */
 extern int xn_shuffler_world_size(xn_ctx_t* ctx);
@@ -114,12 +135,29 @@ extern int xn_shuffler_my_rank(xn_ctx_t* ctx);
 void xn_shuffler_enqueue(xn_ctx_t* ctx, void* buf, unsigned char buf_sz,
                          int epoch, int dst, int src);
 
+/* xn_shuffler_reserve: get a buf_sz buffer to build a write in place. other
+ * sends are blocked until xn_shuffler_commit is called */
+extern void* xn_shuffler_reserve(xn_ctx_t* ctx, unsigned char buf_sz);
+
+/* xn_shuffler_commit: send a write built in a reserved buffer */
+extern void xn_shuffler_commit(xn_ctx_t* ctx, void* buf, int epoch, int dst,
+                               int src);
+
+/* xn_shuffler_mark: send an end-of-epoch marker carrying the number of
+ * writes sent to dst in an epoch. call before xn_shuffler_epoch_end */
+extern void xn_shuffler_mark(xn_ctx_t* ctx, int dst, int epoch,
+                             unsigned long long nwrites);
+
 /* xn_shuffler_epoch_end: do necessary flush at the end of an epoch */
 extern void xn_shuffler_epoch_end(xn_ctx_t* ctx);
 
 /* xn_shuffler_epoch_start: do necessary flush at the beginning of an epoch */
 extern void xn_shuffler_epoch_start(xn_ctx_t* ctx);
 
+/* xn_shuffler_progress: forward relayed requests and deliver what has been
+ * received so far. non-collective and non-blocking */
+extern void xn_shuffler_progress(xn_ctx_t* ctx);
+
 /* xn_shuffler_destroy: shutdown the shuffler */
 extern void xn_shuffler_destroy(xn_ctx_t* ctx);
 
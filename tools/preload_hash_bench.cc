@@ -0,0 +1,177 @@
+/*
+ * Copyright (c) 2019 Carnegie Mellon University,
+ * Copyright (c) 2019 Triad National Security, LLC, as operator of
+ *     Los Alamos National Laboratory.
+ * All rights reserved.
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * with the Software without restriction, including without limitation the
+ * rights to use, copy, modify, merge, publish, distribute, sublicense, and/or
+ * sell copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice,
+ *    this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ *    this list of conditions and the following disclaimer in the documentation
+ *    and/or other materials provided with the distribution.
+ * 3. Neither the name of CMU, TRIAD, Los Alamos National Laboratory, LANL, the
+ *    U.S. Government, nor the names of its contributors may be used to endorse
+ *    or promote products derived from this software without specific prior
+ *    written permission.
+
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS "AS IS" AND ANY EXPRESS OR
+ * IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO
+ * EVENT SHALL THE COPYRIGHT HOLDERS OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT,
+ * INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/*
+ * preload_hash_bench.cc  compare batched simd hashing of particle ids
+ * against hashing them one at a time.
+ */
+#include <getopt.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/time.h>
+
+#include <pdlfs-common/xxhash.h>
+
+#include "hash_batch.h"
+
+/*
+ * default values
+ */
+#define DEF_IDSIZE 8       /* bytes per particle id */
+#define DEF_NIDS 1048576   /* particle ids per round */
+#define DEF_BATCH 256      /* ids hashed per batch call */
+#define DEF_ROUNDS 16      /* rounds per path */
+
+static uint64_t now_micros() {
+  struct timeval tv;
+  gettimeofday(&tv, NULL);
+  return uint64_t(tv.tv_sec) * 1000000 + tv.tv_usec;
+}
+
+static void usage(const char* argv0, const char* msg) {
+  if (msg) fprintf(stderr, "%s: %s\n\n", argv0, msg);
+  fprintf(stderr, "usage: %s [options]\n\n", argv0);
+  fprintf(stderr, "options:\n");
+  fprintf(stderr, "\t-i bytes    particle id size (default %d)\n",
+          DEF_IDSIZE);
+  fprintf(stderr, "\t-n num      particle ids per round (default %d)\n",
+          DEF_NIDS);
+  fprintf(stderr, "\t-b num      ids per batch (default %d)\n", DEF_BATCH);
+  fprintf(stderr, "\t-r num      rounds per path (default %d)\n",
+          DEF_ROUNDS);
+  exit(1);
+}
+
+/*
+ * run: hash all ids rounds times in batches using fn and return the
+ * elapsed time in micros. hashes are summed into *sum so the work
+ * cannot be optimized away.
+ */
+static uint64_t run(xxhash32_batch_fn fn, const char* const* keys, int n,
+                    int idsz, int batch, int rounds, uint32_t* out,
+                    uint64_t* sum) {
+  uint64_t start;
+  int r;
+  int i;
+  int m;
+
+  start = now_micros();
+  for (r = 0; r < rounds; r++) {
+    for (i = 0; i < n; i += m) {
+      m = (n - i < batch) ? n - i : batch;
+      fn(keys + i, m, idsz, 0, out + i);
+    }
+  }
+  for (i = 0; i < n; i++) *sum += out[i];
+  return now_micros() - start;
+}
+
+int main(int argc, char* argv[]) {
+  int idsz = DEF_IDSIZE;
+  int n = DEF_NIDS;
+  int batch = DEF_BATCH;
+  int rounds = DEF_ROUNDS;
+  uint32_t* h0;
+  uint32_t* h1;
+  const char** keys;
+  char* ids;
+  uint64_t sum;
+  uint64_t t0;
+  uint64_t t1;
+  int ch;
+  int i;
+
+  while ((ch = getopt(argc, argv, "i:n:b:r:")) != -1) {
+    switch (ch) {
+      case 'i':
+        idsz = atoi(optarg);
+        if (idsz < 1 || idsz > 255) usage(argv[0], "bad id size");
+        break;
+      case 'n':
+        n = atoi(optarg);
+        if (n < 1) usage(argv[0], "bad num of ids");
+        break;
+      case 'b':
+        batch = atoi(optarg);
+        if (batch < 1) usage(argv[0], "bad batch size");
+        break;
+      case 'r':
+        rounds = atoi(optarg);
+        if (rounds < 1) usage(argv[0], "bad num of rounds");
+        break;
+      default:
+        usage(argv[0], NULL);
+    }
+  }
+
+  ids = static_cast<char*>(malloc(size_t(n) * idsz));
+  keys = static_cast<const char**>(malloc(n * sizeof(char*)));
+  h0 = static_cast<uint32_t*>(malloc(n * sizeof(uint32_t)));
+  h1 = static_cast<uint32_t*>(malloc(n * sizeof(uint32_t)));
+  if (!ids || !keys || !h0 || !h1) {
+    fprintf(stderr, "%s: out of memory\n", argv[0]);
+    exit(1);
+  }
+  srandom(301);
+  for (i = 0; i < n * idsz; i++) ids[i] = char(random());
+  for (i = 0; i < n; i++) keys[i] = ids + size_t(i) * idsz;
+
+  printf("%d ids x %d bytes, %d ids per batch, %d rounds\n", n, idsz, batch,
+         rounds);
+  printf("batched path: %s\n", xxhash32_batch_impl());
+
+  sum = 0;
+  t0 = run(xxhash32_batch_scalar, keys, n, idsz, batch, rounds, h0, &sum);
+  t1 = run(xxhash32_batch, keys, n, idsz, batch, rounds, h1, &sum);
+  if (memcmp(h0, h1, n * sizeof(uint32_t)) != 0) {
+    fprintf(stderr, "%s: batched and scalar hashes disagree!\n", argv[0]);
+    exit(1);
+  }
+
+  printf("scalar:  %8.3f Mids/s (%.3f s)\n",
+         double(n) * rounds / (t0 ? t0 : 1), t0 / 1000000.0);
+  printf("batched: %8.3f Mids/s (%.3f s)\n",
+         double(n) * rounds / (t1 ? t1 : 1), t1 / 1000000.0);
+  printf("speedup: %.2fx (chksum %llx)\n", double(t0) / (t1 ? t1 : 1),
+         static_cast<unsigned long long>(sum));
+
+  free(h1);
+  free(h0);
+  free(keys);
+  free(ids);
+  return 0;
+}
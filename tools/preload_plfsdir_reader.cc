@@ -228,7 +228,10 @@ static void runqueries(const struct plfsdir_stats* s, int rank) {
 
   const int reads = std::min(g.d, int(names.size()));
 
-  if (g.v)
+  if (g.v && c.num_weights != 0)
+    info("rank %d (%d reads) ...\t\t(%d samples available, weight %g)", rank,
+         reads, int(names.size()), c.recv_weights[rank]);
+  else if (g.v)
     info("rank %d (%d reads) ...\t\t(%d samples available)", rank, reads,
          int(names.size()));
 
@@ -338,6 +341,11 @@ int main(int argc, char* argv[]) {
   printf("\tbypass shuffle: %d\n", c.bypass_shuffle);
   printf("\tlg parts: %d\n", c.lg_parts);
   printf("\tcomm sz: %d\n", c.comm_sz);
+  printf("\tworld sz: %d\n", c.world_sz);
+  printf("\trecv rate: %d\n", c.recv_rate);
+  printf("\trecv weights: %d\n", c.num_weights);
+  printf("\trange pivot sets: %d\n", c.num_ranges);
+  printf("\tredirect stride: %d\n", c.redirect_stride);
   printf("\tparticle id size: %d\n", c.particle_id_size);
   printf("\tparticle size: %d\n", c.particle_size);
   printf("\tbloomy fmt: %d\n", c.bloomy_fmt);
@@ -384,6 +392,12 @@ int main(int argc, char* argv[]) {
   if (tp) deltafs_tp_close(tp);
   if (c.memtable_size) free(c.memtable_size);
   if (c.filter_bits_per_key) free(c.filter_bits_per_key);
+  free(c.recv_weights);
+  free(c.recv_bounds);
+  for (int j = 0; j < c.num_ranges; j++) free(c.range_pivots[j]);
+  free(c.range_pivots);
+  free(c.range_npivots);
+  free(c.range_epochs);
   delete z.latencies;
 
   if (g.v) info("all done!");
@@ -145,12 +145,94 @@ struct plfsdir_conf {
   int unordered_storage;
   int io_engine;
   int comm_sz;
+  int world_sz;  /* num of writers, 0 if unknown */
+  int recv_rate; /* 1 receiver per recv_rate writers, 0 if unknown */
+  /* capacity weights of partitions under weighted placement. partition i
+   * owns 32-bit name hashes in [recv_bounds[i - 1], recv_bounds[i]). */
+  double* recv_weights;
+  unsigned long long* recv_bounds;
+  int num_weights;
+  /* writes for partition i may have been redirected to partition
+   * (i + redirect_stride) % comm_sz, 0 if never */
+  int redirect_stride;
+  /* range placement: from epoch range_epochs[j] on, partition i owns name
+   * keys (first 8 bytes, big-endian) in [range_pivots[j][i - 1],
+   * range_pivots[j][i]). epochs before range_epochs[0] were hashed. */
+  int* range_epochs;
+  unsigned long long** range_pivots;
+  int* range_npivots;
+  int num_ranges;
   int particle_id_size;
   int particle_size;
   int bloomy_fmt;
   int wisc_fmt;
 };
 
+/*
+ * parse_manifest_weight: parse a "recv_weight=<weight> <bound>" line and
+ * append it to the list of partition weights in *c
+ */
+static inline bool parse_manifest_weight(char* ch, const char* prefix,
+                                         struct plfsdir_conf* c) {
+  size_t n = strlen(prefix);
+  double w;
+  unsigned long long b;
+  if (strncmp(ch, prefix, n) != 0) return false;
+  if (sscanf(ch + n, "%lf %llu", &w, &b) != 2) {
+    complain("bad manifest line: %s", ch);
+  }
+  c->recv_weights = static_cast<double*>(
+      realloc(c->recv_weights, sizeof(double) * (c->num_weights + 1)));
+  c->recv_bounds = static_cast<unsigned long long*>(realloc(
+      c->recv_bounds, sizeof(unsigned long long) * (c->num_weights + 1)));
+  if (!c->recv_weights || !c->recv_bounds) {
+    complain("out of memory");
+  }
+  c->recv_weights[c->num_weights] = w;
+  c->recv_bounds[c->num_weights] = b;
+  c->num_weights++;
+  return true;
+}
+
+/*
+ * parse_manifest_range: parse a "range_epoch=<epoch>" line, which starts a
+ * new set of range pivots, or a "range_pivot=<key>" line, which appends a
+ * pivot to the last set
+ */
+static inline bool parse_manifest_range(char* ch, struct plfsdir_conf* c) {
+  const int j = c->num_ranges - 1;
+  unsigned long long k;
+  int e;
+  if (sscanf(ch, "range_epoch=%d", &e) == 1) {
+    c->range_epochs = static_cast<int*>(
+        realloc(c->range_epochs, sizeof(int) * (c->num_ranges + 1)));
+    c->range_pivots = static_cast<unsigned long long**>(
+        realloc(c->range_pivots,
+                sizeof(unsigned long long*) * (c->num_ranges + 1)));
+    c->range_npivots = static_cast<int*>(
+        realloc(c->range_npivots, sizeof(int) * (c->num_ranges + 1)));
+    if (!c->range_epochs || !c->range_pivots || !c->range_npivots) {
+      complain("out of memory");
+    }
+    c->range_epochs[c->num_ranges] = e;
+    c->range_pivots[c->num_ranges] = NULL;
+    c->range_npivots[c->num_ranges] = 0;
+    c->num_ranges++;
+    return true;
+  } else if (sscanf(ch, "range_pivot=%llu", &k) == 1) {
+    if (j < 0) complain("bad manifest line: %s", ch);
+    c->range_pivots[j] = static_cast<unsigned long long*>(
+        realloc(c->range_pivots[j],
+                sizeof(unsigned long long) * (c->range_npivots[j] + 1)));
+    if (!c->range_pivots[j]) {
+      complain("out of memory");
+    }
+    c->range_pivots[j][c->range_npivots[j]++] = k;
+    return true;
+  }
+  return false;
+}
+
 /*
  * getmanifest: retrieve dir manifest from *dirinfo and store it to *c
  */
@@ -181,6 +263,11 @@ static inline void getmanifest(const char* dirinfo, struct plfsdir_conf* c) {
         parse_manifest_int(ch, "unordered_storage=", &c->unordered_storage) ||
         parse_manifest_int(ch, "io_engine=", &c->io_engine) ||
         parse_manifest_int(ch, "comm_sz=", &c->comm_sz) ||
+        parse_manifest_int(ch, "world_sz=", &c->world_sz) ||
+        parse_manifest_int(ch, "recv_rate=", &c->recv_rate) ||
+        parse_manifest_int(ch, "redirect_stride=", &c->redirect_stride) ||
+        parse_manifest_weight(ch, "recv_weight=", c) ||
+        parse_manifest_range(ch, c) ||
         parse_manifest_int(ch, "particle_id_size=", &c->particle_id_size) ||
         parse_manifest_int(ch, "particle_size=", &c->particle_size)) {
     } else if (strcmp(ch, "fmt=bloomy\n") == 0) {
@@ -197,6 +284,16 @@ static inline void getmanifest(const char* dirinfo, struct plfsdir_conf* c) {
   if (c->key_size == 0 || c->comm_sz == 0) {
     complain("bad manifest: key_size or comm_sz is 0?!");
   }
+  if (c->num_weights != 0 && c->num_weights != c->comm_sz) {
+    complain("bad manifest: %d recv weights for %d partitions?!",
+             c->num_weights, c->comm_sz);
+  }
+  for (int j = 0; j < c->num_ranges; j++) {
+    if (c->range_npivots[j] != c->comm_sz - 1) {
+      complain("bad manifest: %d range pivots for %d partitions?!",
+               c->range_npivots[j], c->comm_sz);
+    }
+  }
 
   fclose(f);
 }
@@ -308,8 +405,9 @@ static inline void onemore(const struct plfsdir_stats* s, int rank, off_t off) {
   deltafs_plfsdir_free_handle(dir);
 }
 
-static inline void readone(const struct plfsdir_stats* s,
-                           deltafs_plfsdir_t* dir, const char* fname) {
+static inline size_t readone(const struct plfsdir_stats* s,
+                             deltafs_plfsdir_t* dir, const char* fname,
+                             int epoch) {
   size_t table_seeks;
   size_t seeks;
   size_t sz;
@@ -320,7 +418,7 @@ static inline void readone(const struct plfsdir_stats* s,
 
   if (s->v) info("reading %s ...", fname);
   char* buf = static_cast<char*>(
-      deltafs_plfsdir_read(dir, fname, -1, &sz, &table_seeks, &seeks));
+      deltafs_plfsdir_read(dir, fname, epoch, &sz, &table_seeks, &seeks));
   if (!buf) {
     complain("error reading %s: %s", fname, strerror(errno));
   }
@@ -347,14 +445,16 @@ static inline void readone(const struct plfsdir_stats* s,
   s->m->bytes += sz;
   if (sz != 0) s->m->okops++;
   s->m->ops++;
+
+  return sz;
 }
 
-static inline void readnames(const struct plfsdir_stats* s, int rank,
-                             std::string* fnames, int nnames) {
+static inline deltafs_plfsdir_t* openplfsdir(const struct plfsdir_stats* s,
+                                         int rank) {
   deltafs_plfsdir_t* dir;
+  char conf[500];
 
-  char* conf = static_cast<char*>(malloc(500));
-  genconf(s->r, s->c, rank, conf, 500);
+  genconf(s->r, s->c, rank, conf, sizeof(conf));
   dir = deltafs_plfsdir_create_handle(conf, O_RDONLY, s->c->io_engine);
   if (!dir) {
     complain("fail to create plfsdir handle");
@@ -368,10 +468,12 @@ static inline void readnames(const struct plfsdir_stats* s, int rank,
 
   if (deltafs_plfsdir_open(dir, s->dirname) != 0)
     complain("error opening plfsdir: %s", strerror(errno));
-  for (int i = 0; i < nnames; i++) {
-    readone(s, dir, fnames[i].c_str());
-  }
 
+  return dir;
+}
+
+static inline void closeplfsdir(const struct plfsdir_stats* s,
+                            deltafs_plfsdir_t* dir) {
   s->m->under_bytes +=
       deltafs_plfsdir_get_integer_property(dir, "io.total_bytes_read");
   s->m->under_files +=
@@ -380,8 +482,34 @@ static inline void readnames(const struct plfsdir_stats* s, int rank,
       deltafs_plfsdir_get_integer_property(dir, "io.total_seeks");
 
   deltafs_plfsdir_free_handle(dir);
+}
+
+static inline void readnames(const struct plfsdir_stats* s, int rank,
+                             std::string* fnames, int nnames) {
+  deltafs_plfsdir_t* dir = openplfsdir(s, rank);
+  for (int i = 0; i < nnames; i++) {
+    readone(s, dir, fnames[i].c_str(), -1);
+  }
+  closeplfsdir(s, dir);
+}
 
-  free(conf);
+/*
+ * readredirected: read a name epoch by epoch from its partition and, for
+ * epochs in which the writer redirected it, from the partition's overflow
+ * partner, so data comes out in epoch order.
+ */
+static inline void readredirected(const struct plfsdir_stats* s, int rank,
+                                  const std::string& fname) {
+  const int partner = (rank + s->c->redirect_stride) % s->c->comm_sz;
+  deltafs_plfsdir_t* dir = openplfsdir(s, rank);
+  deltafs_plfsdir_t* overflow = openplfsdir(s, partner);
+  for (int epoch = 0; epoch < s->c->num_epochs; epoch++) {
+    if (readone(s, dir, fname.c_str(), epoch) == 0) {
+      readone(s, overflow, fname.c_str(), epoch);
+    }
+  }
+  closeplfsdir(s, overflow);
+  closeplfsdir(s, dir);
 }
 
 static inline void filterreadnames(const struct plfsdir_stats* s, int rank,
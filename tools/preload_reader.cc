@@ -123,6 +123,81 @@ static void consume(char* buf, size_t sz) {
   }
 }
 
+/*
+ * range_set: return the set of range pivots used in a given epoch, or -1 if
+ * names were hashed in that epoch.
+ */
+static int range_set(int epoch) {
+  int j = c.num_ranges - 1;
+  while (j >= 0 && c.range_epochs[j] > epoch) j--;
+  return j;
+}
+
+/*
+ * partition: return the data partition holding a given name in a given
+ * epoch. under range placement, names go by their first 8 bytes once pivots
+ * are in place. otherwise, names are hashed over the receivers when those
+ * are weighted or picked by topology (receivers form a dense set), or over
+ * all writers and masked down to every recv_rate-th writer. partitions are
+ * numbered by receiver.
+ */
+static int partition(const std::string& fname, int epoch) {
+  const uint32_t h = pdlfs::xxhash32(fname.data(), fname.length(), 0);
+  const int j = range_set(epoch);
+  unsigned long long k = 0;
+  if (j >= 0) {
+    for (int i = 0; i < 8; i++) {
+      k <<= 8;
+      if (i < int(fname.length())) k |= static_cast<unsigned char>(fname[i]);
+    }
+    return static_cast<int>(
+        std::upper_bound(c.range_pivots[j],
+                         c.range_pivots[j] + c.range_npivots[j], k) -
+        c.range_pivots[j]);
+  } else if (c.num_weights != 0) {
+    return static_cast<int>(
+        std::upper_bound(c.recv_bounds, c.recv_bounds + c.num_weights,
+                         static_cast<unsigned long long>(h)) -
+        c.recv_bounds);
+  } else if (c.recv_rate > 1 && c.world_sz > 0 && !c.bypass_shuffle) {
+    return static_cast<int>(h % c.world_sz) / c.recv_rate;
+  } else {
+    return static_cast<int>(h % c.comm_sz);
+  }
+}
+
+/*
+ * readranged: read a name epoch by epoch from the partition that held it in
+ * each epoch (and from that partition's overflow partner if writes may have
+ * been redirected). names move between partitions when pivots change.
+ */
+static void readranged(const struct plfsdir_stats* s,
+                       const std::string& fname) {
+  deltafs_plfsdir_t* dir = NULL;
+  deltafs_plfsdir_t* overflow = NULL;
+  int rank = -1;
+  int p;
+
+  for (int epoch = 0; epoch < c.num_epochs; epoch++) {
+    p = partition(fname, epoch);
+    if (p != rank) {
+      if (overflow) closeplfsdir(s, overflow);
+      if (dir) closeplfsdir(s, dir);
+      rank = p;
+      dir = openplfsdir(s, rank);
+      overflow = NULL;
+      if (c.redirect_stride != 0)
+        overflow = openplfsdir(s, (rank + c.redirect_stride) % c.comm_sz);
+    }
+    if (readone(s, dir, fname.c_str(), epoch) == 0 && overflow) {
+      readone(s, overflow, fname.c_str(), epoch);
+    }
+  }
+
+  if (overflow) closeplfsdir(s, overflow);
+  if (dir) closeplfsdir(s, dir);
+}
+
 static void read(const struct plfsdir_stats* s, char* target) {
   std::string path, fname;
   int rank;
@@ -133,11 +208,15 @@ static void read(const struct plfsdir_stats* s, char* target) {
   if (!out) {
     complain("cannot create output file %s: %s", target, strerror(errno));
   }
-  rank = pdlfs::xxhash32(fname.data(), fname.length(), 0) % c.comm_sz;
+  rank = partition(fname, 0);
   z.nfiles++;
 
-  if (c.bloomy_fmt) {
+  if (c.bloomy_fmt) { /* writers never redirect names in bloomy dirs */
     filterreadnames(s, rank, &fname, 1);
+  } else if (c.num_ranges != 0) {
+    readranged(s, fname);
+  } else if (c.redirect_stride != 0) {
+    readredirected(s, rank, fname);
   } else {
     readnames(s, rank, &fname, 1);
   }
@@ -232,6 +311,11 @@ int main(int argc, char* argv[]) {
     printf("\tbypass shuffle: %d\n", c.bypass_shuffle);
     printf("\tlg parts: %d\n", c.lg_parts);
     printf("\tcomm sz: %d\n", c.comm_sz);
+    printf("\tworld sz: %d\n", c.world_sz);
+    printf("\trecv rate: %d\n", c.recv_rate);
+    printf("\trecv weights: %d\n", c.num_weights);
+    printf("\trange pivot sets: %d\n", c.num_ranges);
+    printf("\tredirect stride: %d\n", c.redirect_stride);
     printf("\tparticle id size: %d\n", c.particle_id_size);
     printf("\tparticle size: %d\n", c.particle_size);
     printf("\tbloomy fmt: %d\n", c.bloomy_fmt);
@@ -275,6 +359,12 @@ int main(int argc, char* argv[]) {
   if (tp) deltafs_tp_close(tp);
   if (c.memtable_size) free(c.memtable_size);
   if (c.filter_bits_per_key) free(c.filter_bits_per_key);
+  free(c.recv_weights);
+  free(c.recv_bounds);
+  for (int j = 0; j < c.num_ranges; j++) free(c.range_pivots[j]);
+  free(c.range_pivots);
+  free(c.range_npivots);
+  free(c.range_epochs);
 
   if (g.v) info("all done!");
   if (g.v) info("bye");
@@ -54,6 +54,8 @@
 #include <string.h>
 
 #include <dirent.h>
+#include <dlfcn.h>
+#include <pthread.h>
 #include <sys/stat.h>
 #include <sys/types.h>
 #include <unistd.h>
@@ -128,6 +130,8 @@ static struct gs {
   int psize;          /* total state per vpic particle (bytes) */
   int nps;            /* number of particles per rank */
   int timeout;        /* alarm timeout */
+  int batch;          /* particles per batch write (0 means stdio) */
+  int nthreads;       /* number of dumping threads per rank */
 } g;
 
 /*
@@ -153,10 +157,12 @@ static void usage(const char* msg) {
           "num_dumps num_steps]\n",
           argv0);
   fprintf(stderr, "\noptions:\n");
+  fprintf(stderr, "\t-B count    write particles in batches of count\n");
   fprintf(stderr, "\t-b bytes    bytes for each particle\n");
   fprintf(stderr, "\t-c count    number of particles to simulate per rank\n");
   fprintf(stderr, "\t-d dump     number of frame dumps\n");
   fprintf(stderr, "\t-o output   particle output dir (can be relative)\n");
+  fprintf(stderr, "\t-P threads  number of dumping threads per rank\n");
   fprintf(stderr, "\t-s step     number of steps to perform\n");
   fprintf(stderr, "\t-T time     step time in seconds\n");
   fprintf(stderr, "\t-t sec      timeout (alarm), in seconds\n");
@@ -169,10 +175,21 @@ skip_prints:
 /*
  * per-rank program state.
  */
+typedef int (*write_particles_t)(const char*, unsigned char, const char*,
+                                 unsigned char, size_t, int);
+struct dumper {
+  pthread_t tid;
+  int lo, hi; /* particles [lo, hi) of this rank */
+  char pname[256];
+  /* batch mode (-B) */
+  char* bids;  /* g.batch particle ids */
+  char* bdata; /* g.batch particles */
+};
 static struct ps {
   size_t psz; /* total write size per particle */
-  char pname[256];
   char* pdata;
+  write_particles_t write_particles; /* from the preload lib (-B) */
+  struct dumper* d;                  /* g.nthreads dumpers */
 } p;
 
 /*
@@ -215,9 +232,14 @@ int main(int argc, char* argv[]) {
   g.psize = DEF_PARTICLESIZE;
   g.nps = DEF_NPARTICLES;
   g.timeout = DEF_TIMEOUT;
+  g.nthreads = 1;
 
-  while ((ch = getopt(argc, argv, "b:c:d:o:s:T:t:")) != -1) {
+  while ((ch = getopt(argc, argv, "B:b:c:d:o:P:s:T:t:")) != -1) {
     switch (ch) {
+      case 'B':
+        g.batch = atoi(optarg);
+        if (g.batch <= 0) usage("bad batch size");
+        break;
       case 'b':
         g.psize = atoi(optarg);
         if (g.psize < 0) usage("bad particle bytes");
@@ -233,6 +255,10 @@ int main(int argc, char* argv[]) {
       case 'o':
         strncpy(g.pdir, optarg, sizeof(g.pdir));
         break;
+      case 'P':
+        g.nthreads = atoi(optarg);
+        if (g.nthreads < 1) usage("bad num threads");
+        break;
       case 's':
         g.nsteps = atoi(optarg);
         if (g.nsteps < 0) usage("bad num steps");
@@ -298,6 +324,11 @@ int main(int argc, char* argv[]) {
     printf(" > num_dumps  = %d\n", g.ndumps);
     printf(" > num_steps  = %d\n", g.nsteps);
     printf(" > timeout    = %d secs\n", g.timeout);
+    if (g.batch)
+      printf(" > batch      = %d particles per write\n", g.batch);
+    else
+      printf(" > batch      = OFF (stdio)\n");
+    printf(" > threads    = %d per rank\n", g.nthreads);
     printf("\n");
   }
 
@@ -310,9 +341,33 @@ int main(int argc, char* argv[]) {
   p.pdata = static_cast<char*>(malloc(p.psz));
   if (!p.pdata) complain(EXIT_FAILURE, 0, "malloc pdata failed");
   memset(p.pdata, 'x', p.psz);
+  if (g.batch) {
+    p.write_particles = reinterpret_cast<write_particles_t>(
+        dlsym(RTLD_DEFAULT, "preload_write_particles"));
+    if (!p.write_particles)
+      complain(EXIT_FAILURE, 0, "batch mode needs the preload lib");
+  }
+  p.d = static_cast<struct dumper*>(calloc(g.nthreads, sizeof(*p.d)));
+  if (!p.d) complain(EXIT_FAILURE, 0, "malloc dumpers failed");
+  for (int i = 0; i < g.nthreads; i++) {
+    p.d[i].lo = int(1LL * g.nps * i / g.nthreads);
+    p.d[i].hi = int(1LL * g.nps * (i + 1) / g.nthreads);
+    if (g.batch) {
+      p.d[i].bids = static_cast<char*>(malloc(size_t(g.batch) * 16));
+      p.d[i].bdata = static_cast<char*>(malloc(size_t(g.batch) * p.psz));
+      if (!p.d[i].bids || !p.d[i].bdata)
+        complain(EXIT_FAILURE, 0, "malloc batch failed");
+      memset(p.d[i].bdata, 'x', size_t(g.batch) * p.psz);
+    }
+  }
   run_vpic_app();
   MPI_Barrier(MPI_COMM_WORLD);
   if (myrank == 0) printf("\n== VPIC Done\n");
+  for (int i = 0; i < g.nthreads; i++) {
+    free(p.d[i].bdata);
+    free(p.d[i].bids);
+  }
+  free(p.d);
   free(p.pdata);
 
   MPI_Finalize();
@@ -384,26 +439,66 @@ void base64_encoding(char* dst, uint64_t input) { /* 6 bytes -> 8 bytes */
 #endif
 }  // namespace
 
-static void do_dump() {
+/*
+ * dump_range: write out particles [d->lo, d->hi) of this rank.
+ */
+static void* dump_range(void* arg) {
+  struct dumper* const d = static_cast<struct dumper*>(arg);
   FILE* file;
-  DIR* dir;
-  dir = opendir(g.pdir);
-  if (!dir) {
-    complain(EXIT_FAILURE, 0, "!opendir errno=%d", errno);
-  }
-  const int prefix = snprintf(p.pname, sizeof(p.pname), "%s/", g.pdir);
+  const int prefix = snprintf(d->pname, sizeof(d->pname), "%s/", g.pdir);
 #ifdef PRELOAD_EXASCALE_RUNS
   uint64_t highbits = (static_cast<uint64_t>(myrank) << 32);
 #else
   uint64_t highbits = (static_cast<uint64_t>(myrank) << 28);
 #endif
-  for (int i = 0; i < g.nps; i++) {
-    base64_encoding(p.pname + prefix, (highbits | i));
-    file = fopen(p.pname, "a");
-    if (!file) complain(EXIT_FAILURE, 0, "!fopen errno=%d", errno);
-    fwrite(p.pdata, 1, p.psz, file);
-    fclose(file);
+  if (g.batch) { /* hand particles to the preload lib directly */
+    char tmp[16];
+    base64_encoding(tmp, highbits);
+    const size_t idsz = strlen(tmp);
+    for (int i = d->lo; i < d->hi; i += g.batch) {
+      const int n = (d->hi - i < g.batch) ? d->hi - i : g.batch;
+      for (int j = 0; j < n; j++) {
+        base64_encoding(tmp, (highbits | (i + j)));
+        memcpy(d->bids + j * idsz, tmp, idsz);
+      }
+      if (p.write_particles(d->bids, idsz, d->bdata, p.psz, n, -1) != 0)
+        complain(EXIT_FAILURE, 0, "!preload_write_particles errno=%d", errno);
+    }
+  } else {
+    for (int i = d->lo; i < d->hi; i++) {
+      base64_encoding(d->pname + prefix, (highbits | i));
+      file = fopen(d->pname, "a");
+      if (!file) complain(EXIT_FAILURE, 0, "!fopen errno=%d", errno);
+      fwrite(p.pdata, 1, p.psz, file);
+      fclose(file);
+    }
+  }
+
+  return NULL;
+}
+
+static void do_dump() {
+  DIR* dir;
+  double start;
+  double dura;
+  dir = opendir(g.pdir);
+  if (!dir) {
+    complain(EXIT_FAILURE, 0, "!opendir errno=%d", errno);
+  }
+  start = MPI_Wtime();
+  if (g.nthreads == 1) {
+    dump_range(&p.d[0]);
+  } else {
+    for (int i = 0; i < g.nthreads; i++)
+      if (pthread_create(&p.d[i].tid, NULL, dump_range, &p.d[i]) != 0)
+        complain(EXIT_FAILURE, 0, "!pthread_create");
+    for (int i = 0; i < g.nthreads; i++) pthread_join(p.d[i].tid, NULL);
   }
+  dura = MPI_Wtime() - start;
+  MPI_Reduce(myrank == 0 ? MPI_IN_PLACE : &dura, &dura, 1, MPI_DOUBLE, MPI_MAX,
+             0, MPI_COMM_WORLD);
+  if (myrank == 0)
+    printf("== dump %.3f secs (%d threads per rank)\n", dura, g.nthreads);
 
   closedir(dir);
 }